@@ -1,92 +1,198 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "logger.h"
 
 
 /* Adapted from code by Stuart Norcross */
 
-// This is to identify the fist call to output the trace data (first call to vmemfree or vmemalloc).
-// Before any trace data is written the column headers are written. Set to 0 when trace data is output.
-static int firstCall = 1;
+// The mapped trace file, or NULL if tracing is off.
+TraceFileHeader* traceHeader = NULL;
 
-// The output stream to which trace data will be written.
-static FILE* traceFile = NULL;
+// The records following the header, and the mask giving the position of a record in the ring.
+static TraceRecord* traceRecords;
+static uint64_t traceMask;
 
-static long start_time;
+// Size of the ring used by the next call to setTraceFile.
+static uint64_t traceCapacity = DEFAULT_TRACE_RECORDS;
+
+// The time set by setupTimer, used as the start of the trace.
+static uint64_t timerTicks;
+static int64_t timerNanos;
+
+// The header timestamps are checkpointed every time this many records have been written.
+#define TRACE_CHECKPOINT_MASK ((1 << 16) - 1)
+
+#ifdef VMEM_THREAD_SAFE
+static __thread uint32_t traceThread;
+static uint32_t traceThreadCount = 0;
+#endif
 
 // The total size (in bytes) of all currently allocated regions.
-int allocatedSpace = 0;
+int64_t allocatedSpace = 0;
 
 // The total number of currently allocated regions.
-int allocatedChunkCount = 0;
+int64_t allocatedChunkCount = 0;
 
-// The total size (in bytes) of all current free regions.
-int freeSpace = 0;
+// The total size (in bytes) of all current free large chunks, including those kept by thread caches.
+int64_t freeSpace = 0;
 
 // The current number of free regions.
-int freeChunkCount = 0;
+int64_t freeChunkCount = 0;
 
 // The number of mmapped regions in use.
-int regionsUsed = 0;
-
-// Current time in microseconds.
-long time_in_usecs() {
-    struct timeval tim;
-    gettimeofday(&tim, NULL);
-    long current_time = tim.tv_sec * 1000000 + tim.tv_usec;
-    return current_time;
+int64_t regionsUsed = 0;
+
+// The number of new regions taken from the cache of empty regions, and the number that had to be mapped.
+int64_t regionCacheHits = 0;
+int64_t regionCacheMisses = 0;
+
+// The total size (in bytes) of empty regions kept in the cache.
+int64_t regionCacheBytes = 0;
+
+// Current time in nanoseconds.
+static int64_t timeInNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-// Execution time in micro-seconds.
-long execution_time() {
-    long current_time = time_in_usecs();
-    return current_time-start_time;
+// Cheap timestamp for trace records: the time stamp counter where there is one.
+static uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return timeInNanos();
+#endif
 }
 
 void setupTimer() {
-    start_time = time_in_usecs();
+    timerTicks = readTicks();
+    timerNanos = timeInNanos();
+    if (traceHeader != NULL) {
+        traceHeader->startTicks = timerTicks;
+        traceHeader->startNanos = timerNanos;
+    }
 }
 
-// Outputs the headers for the tab seperated trace data columns.
-void outputTraceColumnHeaders() {
-    fprintf(traceFile, "Function,Time(us),Alloc'd Space,Alloc'd Chunks,Free Space,Free Chunks,Regions\n");
+// Records the current time in both units, so the converter can work out the tick rate.
+void checkpointTraceTime(void) {
+    traceHeader->endTicks = readTicks();
+    traceHeader->endNanos = timeInNanos();
 }
 
+uint64_t claimTrace(void) {
+#ifdef VMEM_THREAD_SAFE
+    return __atomic_fetch_add(&traceHeader->nextRecord, 1, __ATOMIC_RELAXED);
+#else
+    return traceHeader->nextRecord++;
+#endif
+}
+
+void recordTrace(TraceOp op, void* ptr, uint64_t size, uint64_t arg, int kind, int bin) {
+    writeTrace(claimTrace(), op, ptr, size, arg, kind, bin);
+}
 
-void outputTraceData(char* op) {
-    // Only output trace data if the trace file has been set.
-    if (traceFile != NULL) {
-        if (firstCall) {
-            firstCall = 0;
-            start_time = time_in_usecs();
-            outputTraceColumnHeaders();
-        }
-        fprintf(traceFile, "%s,%ld,%d,%d,%d,%d,%d\n", op, execution_time(), allocatedSpace,
-                allocatedChunkCount, freeSpace, freeChunkCount, regionsUsed);
+void writeTrace(uint64_t index, TraceOp op, void* ptr, uint64_t size, uint64_t arg, int kind, int bin) {
+#ifdef VMEM_THREAD_SAFE
+    if (traceThread == 0) {
+        traceThread = __atomic_add_fetch(&traceThreadCount, 1, __ATOMIC_RELAXED);
+    }
+    uint32_t thread = traceThread - 1;
+#else
+    uint32_t thread = 0;
+#endif
+    TraceRecord* record = &traceRecords[index & traceMask];
+    record->ticks = readTicks();
+    record->ptr = (uint64_t)(uintptr_t)ptr;
+    record->arg = arg;
+    record->size = size;
+    record->thread = thread;
+    record->op = op;
+    record->kind = kind;
+    record->bin = bin;
+    record->allocatedSpace = STAT_GET(allocatedSpace);
+    record->allocatedChunkCount = STAT_GET(allocatedChunkCount);
+    record->freeSpace = STAT_GET(freeSpace);
+    record->freeChunkCount = STAT_GET(freeChunkCount);
+    record->regionsUsed = STAT_GET(regionsUsed);
+    if ((index & TRACE_CHECKPOINT_MASK) == TRACE_CHECKPOINT_MASK) {
+        checkpointTraceTime();
     }
 }
 
-// Set the trace file. If path is NULL then trace is output to stdout.
+void setTraceCapacity(int records) {
+    // Round up to a power of two, so the position in the ring is found with a mask.
+    traceCapacity = 1;
+    while (traceCapacity < (uint64_t)records) {
+        traceCapacity <<= 1;
+    }
+}
+
+// Set the trace file. The file is created, or truncated if it exists.
 void setTraceFile(char* path) {
-    if (traceFile == NULL) {
-        if (path != NULL) {
-            if ((traceFile = fopen(path, "a+")) == NULL) {
-                perror("Failed to open tracefile:");
-                exit(EXIT_FAILURE);
-            }
-        } else {
-            traceFile = stdout;
-        }
-        
-    } else {
+#ifdef VMEM_NO_STATS
+    (void)path;
+    fprintf(stderr, "Tracing is not available in the VMEM_NO_STATS build.\n");
+#else
+    if (traceHeader != NULL) {
         fprintf(stderr, "Trace file cannot be set twice. Exiting.\n");
         exit(EXIT_FAILURE);
     }
+    if (path == NULL) {
+        fprintf(stderr, "Trace data is binary and must be written to a file. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to open tracefile:");
+        exit(EXIT_FAILURE);
+    }
+    size_t length = sizeof(TraceFileHeader) + traceCapacity * sizeof(TraceRecord);
+    if (ftruncate(fd, length)) {
+        perror("Failed to size tracefile:");
+        exit(EXIT_FAILURE);
+    }
+    void* mapping = mmap(0, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("Failed to map tracefile:");
+        exit(EXIT_FAILURE);
+    }
+    TraceFileHeader* header = (TraceFileHeader*)mapping;
+    header->magic = TRACE_MAGIC;
+    header->version = TRACE_VERSION;
+    header->recordSize = sizeof(TraceRecord);
+    header->capacity = traceCapacity;
+    header->nextRecord = 0;
+    if (timerNanos == 0) {
+        setupTimer();
+    }
+    header->startTicks = timerTicks;
+    header->startNanos = timerNanos;
+    traceRecords = (TraceRecord*)(header + 1);
+    traceMask = traceCapacity - 1;
+    traceHeader = header;
+    checkpointTraceTime();
+#endif
 }
 
 void closeTraceFile() {
-    fclose(traceFile);
-    traceFile = NULL;
+    if (traceHeader == NULL) {
+        return;
+    }
+    TraceFileHeader* header = traceHeader;
+    checkpointTraceTime();
+    traceHeader = NULL;
+    size_t length = sizeof(TraceFileHeader) + header->capacity * sizeof(TraceRecord);
+    if (munmap(header, length)) {
+        perror("Failed to unmap tracefile:");
+    }
 }
@@ -1,22 +1,66 @@
 #ifndef VMEMALLOC_TRACER_GUARD
 #define VMEMALLOC_TRACER_GUARD
 
+#include "vmemalloc_trace.h"
+
 // The total size (in bytes) of all currently allocated regions.
-extern int allocatedSpace;
+extern int64_t allocatedSpace;
 
 // The total number of currently allocated regions.
-extern int allocatedChunkCount;
+extern int64_t allocatedChunkCount;
 
-// The total size (in bytes) of all current free regions.
-extern int freeSpace;
+// The total size (in bytes) of all current free large chunks, including those kept by thread caches.
+// Free chunks in containers of small chunks are counted per bin by vmemstats.
+extern int64_t freeSpace;
 
 // The current number of free regions.
-extern int freeChunkCount;
+extern int64_t freeChunkCount;
 
 // The number of mmapped regions in use.
-extern int regionsUsed;
+extern int64_t regionsUsed;
+
+// The number of new regions taken from the cache of empty regions, and the number that had to be mapped.
+extern int64_t regionCacheHits;
+extern int64_t regionCacheMisses;
+
+// The total size (in bytes) of empty regions kept in the cache.
+extern int64_t regionCacheBytes;
+
+// Building with VMEM_NO_STATS compiles out the counters and tracing. The counters stay at 0.
+// Counters are updated by several threads at once in the thread-safe build.
+#if defined(VMEM_NO_STATS)
+#define STAT_ADD(counter, value) ((void)(value))
+#define STAT_GET(counter) (counter)
+#elif defined(VMEM_THREAD_SAFE)
+#define STAT_ADD(counter, value) __atomic_add_fetch(&(counter), (value), __ATOMIC_RELAXED)
+#define STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(counter, value) ((counter) += (value))
+#define STAT_GET(counter) (counter)
+#endif
+#define STAT_SUB(counter, value) STAT_ADD(counter, -(value))
+
+// The mapped trace file, or NULL if tracing is off.
+extern TraceFileHeader* traceHeader;
+
+#ifdef VMEM_NO_STATS
+#define TRACING() 0
+#else
+#define TRACING() (traceHeader != NULL)
+#endif
+
+// Records the current time in ticks and nanoseconds in the trace header. Only call this if TRACING().
+extern void checkpointTraceTime(void);
+
+// Appends a record of an operation to the trace file. Only call this if TRACING().
+extern void recordTrace(TraceOp op, void* ptr, uint64_t size, uint64_t arg, int kind, int bin);
+
+// Takes the next record of the trace file, to be filled in by writeTrace once the operation is done.
+// Frees claim their record before the chunk is released, so it comes before any allocation of the same
+// address by another thread. Only call this if TRACING().
+extern uint64_t claimTrace(void);
 
-// Outputs the headers for the tab seperated trace data columns.
-extern void outputTraceData(char* op);
+// Fills in a record taken by claimTrace.
+extern void writeTrace(uint64_t index, TraceOp op, void* ptr, uint64_t size, uint64_t arg, int kind, int bin);
 
 #endif
@@ -1,15 +1,25 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
 
 #include "vmemalloc.h"
+#include "vmemalloc_profile.h"
 
 
 #define NUM_TO_ALLOC 65
 
+// Default limits of the cache of empty regions.
+#define DEFAULT_CACHE_BYTES (8 * 1024 * 1024)
+#define DEFAULT_CACHE_DECAY_MS 1000
+
+// Default size of the address space reserved for regions.
+#define DEFAULT_RESERVATION_BYTES (64 * 1024 * 1024)
+
 void checkBlock(unsigned char* block, unsigned char value, size_t size) {
     for (int i = 0; i < (int)size; i++) {
-        assert(block[0] == value);
+        assert(block[i] == value);
     }
 }
 
@@ -119,14 +129,1221 @@ void testSmall() {
     assert(freeChunkCount == 0);
 }
 
+#define NUM_SMALL_TO_ALLOC 1000
+
+void testSmallContainers() {
+    printf("Testing small containers\n");
+
+    long *longs[NUM_SMALL_TO_ALLOC];
+
+    for (int i = 0; i < NUM_SMALL_TO_ALLOC; i++) {
+        longs[i] = vmemalloc(sizeof(long));
+        assert(longs[i] != NULL);
+        *longs[i] = (long)i;
+    }
+    // Page sized containers hold hundreds of chunks each.
+    int regions = regionsUsed;
+    assert(regions > 0 && regions <= 3);
+
+    // Free every other chunk, leaving holes in every container.
+    for (int i = 0; i < NUM_SMALL_TO_ALLOC; i += 2) {
+        vmemfree(longs[i]);
+    }
+    // The holes are reused before any new container is created.
+    for (int i = 0; i < NUM_SMALL_TO_ALLOC; i += 2) {
+        longs[i] = vmemalloc(sizeof(long));
+        assert(longs[i] != NULL);
+        *longs[i] = (long)i;
+    }
+    assert(regionsUsed == regions);
+
+    for (int i = 0; i < NUM_SMALL_TO_ALLOC; i++) {
+        assert(*longs[i] == (long)i);
+        vmemfree(longs[i]);
+    }
+    assert(allocatedSpace == 0);
+    assert(allocatedChunkCount == 0);
+    assert(regionsUsed == 0);
+    assert(freeSpace == 0);
+}
+
+#define NUM_RANDOM_CHUNKS 256
+#define NUM_RANDOM_OPS 20000
+
+// Small linear congruential generator, so the test is repeatable.
+static unsigned int randomState = 1;
+unsigned int nextRandom() {
+    randomState = randomState * 1103515245 + 12345;
+    return (randomState >> 16) & 0x7fff;
+}
+
+void testLargeRandom() {
+    printf("Testing random large allocations\n");
+
+    unsigned char* allocd[NUM_RANDOM_CHUNKS] = {NULL};
+    int sizes[NUM_RANDOM_CHUNKS];
+
+    // Randomly allocate and free chunks, checking that no chunks overlap.
+    for (int op = 0; op < NUM_RANDOM_OPS; op++) {
+        int i = nextRandom() % NUM_RANDOM_CHUNKS;
+        if (allocd[i] == NULL) {
+            sizes[i] = 32 + nextRandom() % 8192;
+            allocd[i] = vmemalloc(sizes[i]);
+            assert(allocd[i] != NULL);
+            memset(allocd[i], i, sizes[i]);
+        } else {
+            for (int j = 0; j < sizes[i]; j++) {
+                assert(allocd[i][j] == (unsigned char)i);
+            }
+            vmemfree(allocd[i]);
+            allocd[i] = NULL;
+        }
+    }
+    for (int i = 0; i < NUM_RANDOM_CHUNKS; i++) {
+        if (allocd[i] != NULL) {
+            vmemfree(allocd[i]);
+        }
+    }
+    assert(allocatedSpace == 0);
+    assert(allocatedChunkCount == 0);
+    assert(freeChunkCount == 0);
+    assert(regionsUsed == 0);
+}
+
+void testCoalescing() {
+    printf("Testing reuse of freed large chunks\n");
+
+    unsigned char* allocd[NUM_TO_ALLOC];
+    // Fill one region with chunks of the same size.
+    allocd[0] = vmemalloc(1000);
+    vmemfree(allocd[0]);
+    for (int i = 0; i < NUM_TO_ALLOC; i++) {
+        allocd[i] = vmemalloc(1000);
+        assert(allocd[i] != NULL);
+    }
+    int regions = regionsUsed;
+
+    // Free every other chunk, then allocate chunks that fit in the holes.
+    for (int i = 0; i < NUM_TO_ALLOC; i += 2) {
+        vmemfree(allocd[i]);
+    }
+    for (int i = 0; i < NUM_TO_ALLOC; i += 2) {
+        allocd[i] = vmemalloc(900);
+        assert(allocd[i] != NULL);
+    }
+    assert(regionsUsed == regions);
+
+    // Free adjacent chunks so they coalesce, then allocate chunks too big for a single hole.
+    for (int i = 0; i < NUM_TO_ALLOC - 1; i += 4) {
+        vmemfree(allocd[i]);
+        vmemfree(allocd[i + 1]);
+    }
+    for (int i = 0; i < NUM_TO_ALLOC - 1; i += 4) {
+        allocd[i] = vmemalloc(1800);
+        allocd[i + 1] = NULL;
+        assert(allocd[i] != NULL);
+    }
+    assert(regionsUsed == regions);
+
+    for (int i = 0; i < NUM_TO_ALLOC; i++) {
+        if (allocd[i] != NULL) {
+            vmemfree(allocd[i]);
+        }
+    }
+    assert(allocatedSpace == 0);
+    assert(allocatedChunkCount == 0);
+    assert(freeChunkCount == 0);
+    assert(regionsUsed == 0);
+}
+
+void testForeignFree() {
+    printf("Testing freeing pointers not from vmemalloc\n");
+
+    long onStack = 0;
+    char* small = vmemalloc(sizeof(char));
+    char* large = vmemalloc(100);
+    int space = allocatedSpace;
+
+    // Neither pointer belongs to the allocator, so nothing should change.
+    vmemfree(&onStack);
+    vmemfree(&space);
+    assert(allocatedSpace == space);
+    assert(allocatedChunkCount == 2);
+
+    vmemfree(small);
+    vmemfree(large);
+    assert(allocatedSpace == 0);
+    assert(allocatedChunkCount == 0);
+    assert(regionsUsed == 0);
+}
+
+void testRegionCache() {
+    printf("Testing reuse of empty regions\n");
+
+    // Start with an empty cache. Regions committed from reservations aren't cached, so map each on its own.
+    setRegionReservation(0);
+    setRegionCacheLimits(0, 0);
+    setRegionCacheLimits(1024 * 1024, 60 * 1000);
+    int hits = regionCacheHits;
+    int misses = regionCacheMisses;
+
+    // Allocating and freeing the same size repeatedly reuses the same region.
+    for (int i = 0; i < 10; i++) {
+        void* chunk = vmemalloc(5000);
+        assert(chunk != NULL);
+        vmemfree(chunk);
+        assert(regionsUsed == 0);
+        assert(regionCacheBytes > 0);
+    }
+    assert(regionCacheMisses == misses + 1);
+    assert(regionCacheHits == hits + 9);
+
+    // A much bigger region can't be reused.
+    void* chunk = vmemalloc(50000);
+    assert(regionCacheMisses == misses + 2);
+    vmemfree(chunk);
+
+    // Turning the cache off releases everything in it.
+    setRegionCacheLimits(0, 0);
+    assert(regionCacheBytes == 0);
+    chunk = vmemalloc(5000);
+    vmemfree(chunk);
+    assert(regionCacheBytes == 0);
+    assert(regionCacheMisses == misses + 3);
+
+    setRegionCacheLimits(DEFAULT_CACHE_BYTES, DEFAULT_CACHE_DECAY_MS);
+    setRegionReservation(DEFAULT_RESERVATION_BYTES);
+}
+
+// Checks that a growing heap stays in one region, whose chunks coalesce across the pages committed for it.
+void testReservation() {
+    printf("Testing regions committed from reserved address space\n");
+
+    VmemStats before, after;
+    before.size = after.size = sizeof(VmemStats);
+    assert(vmemstats(&before, 0) == 0);
+    unsigned char* chunks[200];
+    for (int i = 0; i < 200; i++) {
+        chunks[i] = vmemalloc(20000);
+        assert(chunks[i] != NULL);
+        memset(chunks[i], i, 20000);
+    }
+    assert(regionsUsed == 1);
+    assert(vmemstats(&after, 0) == 0);
+    // The 4MB are committed in steps that grow with the region.
+    assert(after.mmapCalls - before.mmapCalls <= 1);
+    assert(after.mappedBytes - before.mappedBytes <= 200 * 20000 * 5 / 4 + 64 * 1024);
+    for (int i = 0; i < 200; i++) {
+        checkBlock(chunks[i], i, 20000);
+    }
+
+    // Freeing every other chunk and then the rest coalesces them into one free chunk, emptying the region.
+    for (int i = 0; i < 200; i += 2) {
+        vmemfree(chunks[i]);
+    }
+    assert(freeChunkCount <= 101);
+    for (int i = 1; i < 200; i += 2) {
+        vmemfree(chunks[i]);
+    }
+    assert(regionsUsed == 0 && freeChunkCount == 0);
+    assert(vmemstats(&after, 0) == 0);
+    assert(after.mappedBytes == before.mappedBytes);
+
+    // The decommitted pages are committed again, and come back filled with zeros.
+    unsigned char* chunk = vmemcalloc(1, 50000);
+    assert(chunk != NULL && chunk == chunks[0]);
+    checkBlock(chunk, 0, 50000);
+    vmemfree(chunk);
+    assert(regionsUsed == 0);
+}
+
+void testHuge() {
+    printf("Testing huge allocations\n");
+
+    int size = 4 * 1024 * 1024;
+    unsigned char* chunk = vmemalloc(size);
+    assert(chunk != NULL);
+    memset(chunk, 1, size);
+    // Huge chunks have their own region, and are never split.
+    assert(regionsUsed == 1);
+    assert(freeChunkCount == 0);
+    assert(allocatedSpace >= size);
+
+    // Keep doubling the size. The contents must be kept.
+    for (int i = 0; i < 3; i++) {
+        unsigned char* oldChunk = chunk;
+        chunk = vmemrealloc(chunk, size * 2);
+        assert(chunk != NULL);
+        checkBlock(chunk, 1, size);
+        // A chunk that moved is only known at its new address.
+        assert(vmemusablesize(chunk) >= (size_t)size * 2);
+        assert(chunk == oldChunk || vmemusablesize(oldChunk) == 0);
+        memset(chunk + size, 1, size);
+        size *= 2;
+        assert(regionsUsed == 1);
+        assert(allocatedSpace >= size);
+    }
+
+    // Shrink it back down.
+    chunk = vmemrealloc(chunk, 2 * 1024 * 1024);
+    assert(chunk != NULL);
+    checkBlock(chunk, 1, 2 * 1024 * 1024);
+    assert(allocatedSpace < 3 * 1024 * 1024);
+
+    // Shrinking below the threshold moves it back to the bins.
+    chunk = vmemrealloc(chunk, 1000);
+    checkBlock(chunk, 1, 1000);
+    assert(allocatedSpace < 2000);
+    vmemfree(chunk);
+
+    assert(allocatedSpace == 0);
+    assert(allocatedChunkCount == 0);
+    assert(freeChunkCount == 0);
+    assert(regionsUsed == 0);
+}
+
+void testRealloc() {
+    printf("Testing realloc and calloc\n");
+
+    // Small chunks stay in their slot while they fit.
+    unsigned char* small = vmemalloc(5);
+    memset(small, 2, 5);
+    assert(vmemrealloc(small, 8) == small);
+    checkBlock(small, 2, 5);
+
+    // A large chunk followed by a free chunk grows into it without moving.
+    unsigned char* chunk = vmemalloc(1000);
+    unsigned char* next = vmemalloc(2000);
+    unsigned char* guard = vmemalloc(100);
+    memset(chunk, 3, 1000);
+    vmemfree(next);
+    assert(vmemrealloc(chunk, 2500) == chunk);
+    checkBlock(chunk, 3, 1000);
+    memset(chunk, 3, 2500);
+
+    // Shrinking frees the end of the chunk, which can be reused.
+    assert(vmemrealloc(chunk, 500) == chunk);
+    checkBlock(chunk, 3, 500);
+    assert(allocatedSpace < 500 + 100 + 2 * 32);
+    next = vmemalloc(1500);
+    assert(next > chunk && next < guard);
+
+    // No room after the chunk, so it has to move.
+    unsigned char* moved = vmemrealloc(chunk, 4000);
+    assert(moved != chunk);
+    checkBlock(moved, 3, 500);
+    vmemfree(next);
+    vmemfree(guard);
+    vmemfree(moved);
+    vmemfree(small);
+
+    // calloc returns zeros, from fresh regions and reused chunks alike.
+    for (int size = 100; size <= 100000; size *= 10) {
+        unsigned char* dirty = vmemalloc(size);
+        memset(dirty, 4, size);
+        unsigned char* keep = vmemalloc(16);
+        vmemfree(dirty);
+        unsigned char* zeros = vmemcalloc(size / 4, 4);
+        checkBlock(zeros, 0, size);
+        vmemfree(zeros);
+        vmemfree(keep);
+    }
+    small = vmemcalloc(3, 7);
+    checkBlock(small, 0, 21);
+    vmemfree(small);
+    assert(vmemcalloc(SIZE_MAX / 2, 3) == NULL);
+
+    assert(allocatedSpace == 0);
+    assert(allocatedChunkCount == 0);
+}
+
+void testAlign() {
+    printf("Testing aligned allocations\n");
+
+    int alignments[] = {1, 8, 16, 64, 256, 4096, 65536};
+    int sizes[] = {1, 7, 24, 100, 3000, 70000, 2 * 1024 * 1024};
+    unsigned char* chunks[7][7];
+    for (int i = 0; i < 7; i++) {
+        for (int j = 0; j < 7; j++) {
+            chunks[i][j] = vmemalign(alignments[i], sizes[j]);
+            assert(chunks[i][j] != NULL);
+            assert((uintptr_t)chunks[i][j] % alignments[i] == 0);
+            memset(chunks[i][j], i * 7 + j, sizes[j]);
+        }
+    }
+    for (int i = 0; i < 7; i++) {
+        for (int j = 0; j < 7; j++) {
+            checkBlock(chunks[i][j], i * 7 + j, sizes[j]);
+            vmemfree(chunks[i][j]);
+        }
+    }
+    assert(allocatedSpace == 0);
+    assert(allocatedChunkCount == 0);
+    assert(freeChunkCount == 0);
+
+    // A size and alignment that fit in a header on their own, but not together, are refused.
+    assert(vmemalign((size_t)1 << 61, ((size_t)1 << 63) - 4096) == NULL);
+    assert(regionsUsed == 0 && freeChunkCount == 0);
+
+    // Cache-line aligned chunks share a region rather than each getting their own.
+    setRegionCacheLimits(0, 0);
+    unsigned char* lines[16];
+    for (int i = 0; i < 16; i++) {
+        lines[i] = vmemalign(64, 64);
+        assert((uintptr_t)lines[i] % 64 == 0);
+    }
+    assert(regionsUsed == 1);
+    for (int i = 0; i < 16; i++) {
+        vmemfree(lines[i]);
+    }
+    assert(regionsUsed == 0);
+    setRegionCacheLimits(DEFAULT_CACHE_BYTES, DEFAULT_CACHE_DECAY_MS);
+
+    void* ptr = NULL;
+    assert(vmemposixalign(&ptr, 128, 1000) == 0);
+    assert(ptr != NULL && (uintptr_t)ptr % 128 == 0);
+    vmemfree(ptr);
+    assert(vmemposixalign(&ptr, 4, 1000) == EINVAL);
+    assert(vmemposixalign(&ptr, 48, 1000) == EINVAL);
+    assert(vmemalign(24, 10) == NULL);
+    assert(allocatedSpace == 0);
+}
+
+// Checks vmemstats against the counters, and that it fills no more than the size it is given.
+void testStats() {
+    printf("Testing vmemstats\n");
+
+    VmemStats stats;
+    assert(vmemstats(NULL, 0) == -1);
+    stats.size = sizeof(VmemStats);
+    assert(vmemstats(&stats, 0) == 0);
+    assert(stats.version == VMEM_STATS_VERSION && stats.size == sizeof(VmemStats));
+    assert(stats.allocatedBytes == 0 && stats.smallAllocatedBytes == 0);
+    uint64_t mmapCalls = stats.mmapCalls;
+    uint64_t munmapCalls = stats.munmapCalls;
+
+    void* small[100];
+    for (int i = 0; i < 100; i++) {
+        small[i] = vmemalloc(8);
+    }
+    unsigned char* large = vmemalloc(1000);
+    void* keep = vmemalloc(1000);
+    int hugeSize = 2 * 1024 * 1024;
+    unsigned char* huge = vmemalloc(hugeSize);
+    memset(huge, 1, hugeSize);
+    vmemfree(large);
+
+    assert(vmemstats(&stats, VMEM_STATS_RESIDENT) == 0);
+    assert(stats.allocatedBytes == (uint64_t)allocatedSpace);
+    assert(stats.allocatedChunks == 102);
+    assert(stats.smallBins[3].chunkSize == 8);
+    assert(stats.smallBins[3].chunksInUse == 100);
+    assert(stats.smallBins[3].containers >= 1);
+    assert(stats.smallBins[3].chunks >= 100);
+    assert(stats.smallAllocatedBytes == 800);
+    assert(stats.smallFreeBytes == (stats.smallBins[3].chunks - 100) * 8);
+    assert(stats.hugeChunks == 1 && stats.hugeAllocatedBytes >= (uint64_t)hugeSize);
+    // The freed chunk is between 512 and 1023 bytes, and can't coalesce with the chunk after it.
+    assert(stats.largeBins[9].freeChunks >= 1);
+    assert(stats.freeBytes == (uint64_t)freeSpace && stats.freeChunks == (uint64_t)freeChunkCount);
+    assert(stats.mmapCalls > mmapCalls);
+    assert(stats.mappedBytes > stats.allocatedBytes);
+    assert(stats.fragmentation > 0 && stats.fragmentation < 1);
+    assert(stats.residentBytes >= (uint64_t)hugeSize && stats.residentBytes <= stats.mappedBytes);
+
+    // A caller built with a smaller struct only gets the fields it knows about.
+    VmemStats older;
+    memset(&older, 0xff, sizeof(VmemStats));
+    older.size = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+    assert(vmemstats(&older, 0) == 0);
+    assert(older.size == 2 * sizeof(uint32_t) + sizeof(uint64_t));
+    assert(older.allocatedBytes == stats.allocatedBytes);
+    assert(older.allocatedChunks == ~(uint64_t)0);
+
+    for (int i = 0; i < 100; i++) {
+        vmemfree(small[i]);
+    }
+    vmemfree(keep);
+    vmemfree(huge);
+    assert(vmemstats(&stats, 0) == 0);
+    assert(stats.allocatedBytes == 0 && stats.allocatedChunks == 0);
+    assert(stats.smallBins[3].chunksInUse == 0 && stats.hugeChunks == 0);
+    assert(stats.freeChunks == 0 && stats.regions == 0);
+    assert(stats.munmapCalls > munmapCalls);
+}
+
+// Splits, grows and coalesces chunks bigger than 4GB. Regions are mapped with MAP_NORESERVE and only
+// a few pages of each chunk are touched, so this doesn't need that much memory.
+void testLargeHeap() {
+    printf("Testing chunks bigger than 4GB\n");
+    setMapNoReserve(1);
+
+    size_t gigabyte = (size_t)1 << 30;
+    // Keep the chunks in the large allocator, so they are split and coalesced.
+    setHugeChunkThreshold(64 * gigabyte);
+    unsigned char* first = vmemalloc(12 * gigabyte);
+    assert(first != NULL);
+    assert(vmemusablesize(first) >= 12 * gigabyte);
+    assert(allocatedSpace >= (int64_t)(12 * gigabyte));
+    assert(regionsUsed == 1);
+    first[0] = 1;
+    first[12 * gigabyte - 1] = 1;
+
+    // Shrinking splits off the end of the chunk, which is free space of about 7GB in bin 32.
+    assert(vmemrealloc(first, 5 * gigabyte) == first);
+    assert(vmemusablesize(first) >= 5 * gigabyte && vmemusablesize(first) < 5 * gigabyte + 64);
+    assert(freeChunkCount == 1 && freeSpace > (int64_t)(6 * gigabyte));
+    VmemStats stats;
+    stats.size = sizeof(VmemStats);
+    assert(vmemstats(&stats, 0) == 0);
+    assert(stats.largeBins[32].freeChunks == 1 && stats.largeBins[32].freeBytes > 6 * gigabyte);
+
+    // Growing takes 1GB of the free chunk after it.
+    int64_t tailSpace = freeSpace;
+    assert(vmemrealloc(first, 6 * gigabyte) == first);
+    assert(freeChunkCount == 1 && freeSpace == tailSpace - (int64_t)gigabyte);
+    first[6 * gigabyte - 1] = 1;
+
+    // The next chunk is split out of the free space rather than mapped.
+    unsigned char* second = vmemalloc(5 * gigabyte);
+    assert(second > first && second < first + 12 * gigabyte);
+    assert(regionsUsed == 1);
+    assert(freeChunkCount == 1 && freeSpace < (int64_t)(2 * gigabyte));
+    second[0] = 2;
+    second[5 * gigabyte - 1] = 2;
+
+    // Freeing the second chunk coalesces it with the free chunks on both sides, emptying the region.
+    vmemfree(first);
+    assert(freeChunkCount == 2 && freeSpace > (int64_t)(6 * gigabyte));
+    assert(second[0] == 2 && second[5 * gigabyte - 1] == 2);
+    vmemfree(second);
+    assert(regionsUsed == 0);
+    assert(freeChunkCount == 0);
+    assert(allocatedSpace == 0);
+
+    // Huge chunks bigger than 4GB are resized with mremap.
+    setHugeChunkThreshold(1024 * 1024);
+    unsigned char* huge = vmemalloc(5 * gigabyte);
+    assert(huge != NULL);
+    huge[5 * gigabyte - 1] = 3;
+    huge = vmemrealloc(huge, 9 * gigabyte);
+    assert(huge != NULL && huge[5 * gigabyte - 1] == 3);
+    assert(vmemusablesize(huge) >= 9 * gigabyte);
+    assert(allocatedSpace >= (int64_t)(9 * gigabyte));
+    vmemfree(huge);
+    assert(regionsUsed == 0);
+    assert(allocatedSpace == 0);
+    assert(allocatedChunkCount == 0);
+    setMapNoReserve(0);
+}
+
+// Checks that containers share 2MB slabs and regions are 2MB aligned in huge page mode.
+void testHugePages() {
+    printf("Testing huge page mode\n");
+
+    Word hugePage = 2 * 1024 * 1024;
+    assert(setHugePageMode(3) == -1);
+    assert(setHugePageMode(VMEM_HUGE_PAGES_TRANSPARENT) == 0);
+
+    // Containers of every bin are packed into one slab.
+    void* small[SMALL_CHUNK_LIMIT_POWER];
+    for (int bin = 0; bin < SMALL_CHUNK_LIMIT_POWER; bin++) {
+        small[bin] = vmemalloc(1 << bin);
+        assert(small[bin] != NULL);
+        assert(((Word)small[bin] & ~(hugePage - 1)) == ((Word)small[0] & ~(hugePage - 1)));
+    }
+    assert(regionsUsed == 1);
+
+    unsigned char* large = vmemalloc(100000);
+    assert(large != NULL);
+    assert(regionsUsed == 2);
+    assert(((Word)large & ~(hugePage - 1)) != ((Word)small[0] & ~(hugePage - 1)));
+    unsigned char* huge = vmemalloc(3 * 1024 * 1024);
+    assert(huge != NULL);
+    // The mapping is aligned, and the chunk starts just after its header.
+    assert(((Word)huge & (hugePage - 1)) < 64);
+    huge = vmemrealloc(huge, 5 * 1024 * 1024);
+    assert(huge != NULL);
+
+    VmemStats stats;
+    stats.size = sizeof(VmemStats);
+    assert(vmemstats(&stats, 0) == 0);
+    assert(stats.hugePageBytes == 0 && stats.transparentHugePageBytes == stats.mappedBytes);
+    assert(stats.mappedBytes == 2 * hugePage + 6 * 1024 * 1024);
+
+    // The mode can't change under allocated memory.
+    assert(setHugePageMode(VMEM_HUGE_PAGES_OFF) == -1);
+    for (int bin = 0; bin < SMALL_CHUNK_LIMIT_POWER; bin++) {
+        vmemfree(small[bin]);
+    }
+    vmemfree(large);
+    vmemfree(huge);
+    assert(regionsUsed == 0);
+
+    // Without a reserved hugetlbfs pool, regions fall back to transparent huge pages.
+    assert(setHugePageMode(VMEM_HUGE_PAGES_HUGETLB) == 0);
+    large = vmemalloc(100000);
+    assert(large != NULL);
+    memset(large, 1, 100000);
+    void* chunk = vmemalloc(8);
+    assert(chunk != NULL);
+    assert(vmemstats(&stats, 0) == 0);
+    assert(stats.hugePageBytes + stats.transparentHugePageBytes == stats.mappedBytes);
+    vmemfree(chunk);
+    vmemfree(large);
+    assert(regionsUsed == 0);
+    assert(allocatedSpace == 0);
+
+    assert(setHugePageMode(VMEM_HUGE_PAGES_OFF) == 0);
+    assert(vmemstats(&stats, 0) == 0);
+    assert(stats.hugePageBytes == 0 && stats.transparentHugePageBytes == 0 && stats.mappedBytes == 0);
+}
+
+// Checks that arenas bump-allocate from blocks, and keep only the blocks they used when reset.
+void testArena() {
+    printf("Testing arenas\n");
+
+    assert(vmemarena_alloc(NULL, 8) == NULL);
+    VmemArena* arena = vmemarena_create(4096);
+    assert(arena != NULL);
+    assert(vmemarena_alloc(arena, 0) == NULL);
+
+    // Objects are aligned and packed one after another.
+    unsigned char* first = vmemarena_alloc(arena, 1);
+    unsigned char* second = vmemarena_alloc(arena, 100);
+    assert((Word)first % LARGEST_ALIGNMENT == 0);
+    assert(second == first + LARGEST_ALIGNMENT);
+    memset(second, 1, 100);
+    int64_t oneBlock = allocatedSpace;
+
+    // Filling the block moves on to a new one, and big objects get a block of their own.
+    unsigned char* objects[100];
+    for (int i = 0; i < 100; i++) {
+        objects[i] = vmemarena_alloc(arena, 100);
+        assert(objects[i] != NULL);
+        memset(objects[i], i, 100);
+    }
+    unsigned char* big = vmemarena_alloc(arena, 10000);
+    assert(big != NULL);
+    memset(big, 2, 10000);
+    for (int i = 0; i < 100; i++) {
+        assert(objects[i][0] == i && objects[i][99] == i);
+    }
+    assert(second[99] == 1);
+    int64_t fourBlocks = allocatedSpace;
+    assert(fourBlocks > oneBlock + 10000 + 2 * 4096);
+
+    // Reset keeps the shared blocks and reuses them in the same order.
+    vmemarena_reset(arena);
+    assert(allocatedSpace < fourBlocks - 10000 && allocatedSpace > oneBlock + 2 * 4096);
+    assert(vmemarena_alloc(arena, 1) == first);
+
+    // A reset after a smaller round gives back the blocks it didn't use.
+    vmemarena_reset(arena);
+    assert(allocatedSpace == oneBlock);
+    vmemarena_reset(arena);
+    assert(allocatedSpace < oneBlock);
+    assert(vmemarena_alloc(arena, 1) != NULL);
+
+    vmemarena_destroy(arena);
+    assert(allocatedSpace == 0);
+    assert(allocatedChunkCount == 0);
+}
+
+// Checks that freed objects are reused last in, first out, and that only empty blocks are released.
+void testPool() {
+    printf("Testing object pools\n");
+
+    assert(vmempool_create(0, 0) == NULL);
+    assert(vmempool_create(100, 24) == NULL);
+    assert(vmempool_create(1024 * 1024, 0) == NULL);
+    VmemPool* pool = vmempool_create(100, 64);
+    assert(pool != NULL);
+    VmemPoolStats stats;
+    assert(vmempool_stats(pool, &stats) == 0);
+    assert(stats.objectSize == 128 && stats.blocks == 0);
+    int perBlock = (stats.blockSize - 64) / 128;
+
+    // Objects are aligned, and the pool moves on to a new block when one is full.
+    unsigned char* objects[2000];
+    for (int i = 0; i < 2000; i++) {
+        objects[i] = vmempool_alloc(pool);
+        assert(objects[i] != NULL && (Word)objects[i] % 64 == 0);
+        memset(objects[i], i % 256, 100);
+    }
+    for (int i = 0; i < 2000; i++) {
+        checkBlock(objects[i], i % 256, 100);
+    }
+    assert(vmempool_stats(pool, &stats) == 0);
+    int blocks = (2000 + perBlock - 1) / perBlock;
+    assert((int)stats.blocks == blocks && stats.objectsInUse == 2000);
+
+    // The last object freed is the first reused.
+    vmempool_free(pool, objects[10]);
+    vmempool_free(pool, objects[20]);
+    assert(vmempool_alloc(pool) == objects[20]);
+    assert(vmempool_alloc(pool) == objects[10]);
+
+    // Shrinking only releases blocks with nothing in use, and their objects aren't handed out again.
+    assert(vmempool_shrink(pool) == 0);
+    for (int i = 0; i < 2 * perBlock; i++) {
+        vmempool_free(pool, objects[i]);
+    }
+    vmempool_free(pool, objects[1999]);
+    int64_t before = allocatedSpace;
+    assert(vmempool_shrink(pool) == 2 * stats.blockSize);
+    assert(allocatedSpace < before - (int64_t)stats.blockSize);
+    Word blockMask = ~(Word)(stats.blockSize - 1);
+    for (int i = 0; i < 10; i++) {
+        unsigned char* object = vmempool_alloc(pool);
+        assert(((Word)object & blockMask) != ((Word)objects[0] & blockMask));
+        assert(((Word)object & blockMask) != ((Word)objects[perBlock] & blockMask));
+        objects[1999] = object;
+    }
+    assert(vmempool_stats(pool, &stats) == 0);
+    assert((int)stats.blocks == blocks - 2 && stats.blocksReleased == 2);
+    assert((int)stats.objectsInUse == 2000 - 2 * perBlock - 1 + 10 && stats.peakObjectsInUse == 2000);
+
+    vmempool_destroy(pool);
+    assert(allocatedSpace == 0 && allocatedChunkCount == 0);
+}
+
+// Checks that batches come from shared containers and regions, and are freed in any order.
+void testBatch() {
+    printf("Testing batch allocation\n");
+
+    // Frees are only grouped while tracing is off.
+    closeTraceFile();
+    void* ptrs[300];
+    assert(vmemalloc_batch(0, 10, ptrs) == 0);
+
+    // Small chunks are claimed a bitmap word at a time, from as few containers as possible.
+    assert(vmemalloc_batch(24, 300, ptrs) == 300);
+    assert(allocatedSpace == 300 * 32 && allocatedChunkCount == 300);
+    for (int i = 0; i < 300; i++) {
+        memset(ptrs[i], i, 24);
+    }
+    for (int i = 0; i < 300; i++) {
+        assert(((unsigned char*)ptrs[i])[23] == (unsigned char)i);
+    }
+    // Only the last container has free chunks left.
+    VmemStats stats;
+    stats.size = sizeof(VmemStats);
+    assert(vmemstats(&stats, 0) == 0);
+    VmemSmallBinStats* bin = &stats.smallBins[5];
+    assert(bin->chunksInUse == 300 && bin->chunks - 300 < bin->chunks / bin->containers);
+    // Reverse the order, so vmemfree_batch has to sort it.
+    for (int i = 0; i < 150; i++) {
+        void* ptr = ptrs[i];
+        ptrs[i] = ptrs[299 - i];
+        ptrs[299 - i] = ptr;
+    }
+    vmemfree_batch(ptrs, 300);
+    assert(allocatedSpace == 0 && allocatedChunkCount == 0);
+    assert(regionsUsed == 0);
+
+    // Large chunks are split one after another out of a single free chunk.
+    assert(vmemalloc_batch(1000, 50, ptrs) == 50);
+    assert(regionsUsed == 1);
+    for (int i = 1; i < 50; i++) {
+        assert(ptrs[i] == ptrs[i - 1] + vmemusablesize(ptrs[i - 1]) + sizeof(Word));
+    }
+    memset(ptrs[49], 1, 1000);
+    // Freeing every other chunk leaves gaps, and the rest of the batch fills them in.
+    void* odd[25];
+    for (int i = 0; i < 25; i++) {
+        odd[i] = ptrs[2 * i + 1];
+        ptrs[i] = ptrs[2 * i];
+    }
+    vmemfree_batch(odd, 25);
+    assert(allocatedChunkCount == 25);
+    // The last chunk of the batch coalesces with the rest of the region.
+    assert(freeChunkCount == 25);
+    vmemfree_batch(ptrs, 25);
+    assert(allocatedSpace == 0 && allocatedChunkCount == 0);
+    assert(freeChunkCount == 0 && regionsUsed == 0);
+
+    // Huge chunks each get their own mapping, and repeated pointers are only freed once.
+    assert(vmemalloc_batch(2 * 1024 * 1024, 3, ptrs) == 3);
+    assert(allocatedChunkCount == 3);
+    ptrs[3] = ptrs[0];
+    ptrs[4] = vmemalloc(8);
+    vmemfree_batch(ptrs, 5);
+    assert(allocatedSpace == 0 && allocatedChunkCount == 0);
+}
+
+// Checks that sized frees release small, large and huge chunks.
+void testSizedFree() {
+    printf("Testing sized frees\n");
+
+    int sizes[] = {1, 24, 100, 1000, 5000, 2 * 1024 * 1024};
+    void* chunks[6];
+    for (int i = 0; i < 6; i++) {
+        chunks[i] = vmemalloc(sizes[i]);
+        assert(chunks[i] != NULL);
+        memset(chunks[i], i, sizes[i]);
+    }
+    // Keeps the container of the 24 byte chunk in use.
+    void* neighbour = vmemalloc(20);
+    for (int i = 0; i < 6; i++) {
+        vmemfree_sized(chunks[i], sizes[i]);
+    }
+    assert(allocatedChunkCount == 1);
+    // Shrinking keeps the chunk in its slot, so it is freed with a smaller size than its bin's.
+    assert(vmemrealloc(neighbour, 10) == neighbour);
+    vmemfree_sized(neighbour, 10);
+    assert(allocatedSpace == 0 && allocatedChunkCount == 0);
+    assert(regionsUsed == 0);
+
+    // vmemfree_owned frees its own chunks of every kind, and quietly ignores everything else.
+    for (int i = 0; i < 6; i++) {
+        chunks[i] = vmemalloc(sizes[i]);
+        assert(chunks[i] != NULL);
+    }
+    for (int i = 0; i < 6; i++) {
+        assert(vmemfree_owned(chunks[i]) == 1);
+    }
+    int local;
+    assert(vmemfree_owned(&local) == 0);
+    assert(vmemfree_owned(NULL) == 0);
+    assert(allocatedSpace == 0 && allocatedChunkCount == 0);
+}
+
+void testScavenge() {
+    printf("Testing release of free pages\n");
+
+    VmemStats before, after;
+    before.size = after.size = sizeof(VmemStats);
+    // Shrinking a chunk in place leaves the rest of its region as a free chunk, with its pages resident.
+    int size = 900 * 1024;
+    unsigned char* chunk = vmemalloc(size);
+    assert(chunk != NULL);
+    memset(chunk, 7, size);
+    assert(vmemrealloc(chunk, 4096) == chunk);
+    assert(vmemstats(&before, VMEM_STATS_RESIDENT) == 0);
+    size_t released = vmemtrim();
+    assert(released >= 800 * 1024);
+    assert(vmemstats(&after, VMEM_STATS_RESIDENT) == 0);
+    assert(after.residentBytes + 800 * 1024 <= before.residentBytes);
+    assert(after.scavengePasses == before.scavengePasses + 1);
+    assert(after.scavengedBytes >= before.scavengedBytes + 800 * 1024);
+    // Released chunks stay free, so nothing more is released until they are used again.
+    assert(vmemtrim() == 0);
+    for (int i = 0; i < 4096; i++) {
+        assert(chunk[i] == 7);
+    }
+
+    // Released pages come back when the chunk is reused.
+    unsigned char* reused = vmemalloc(size / 2);
+    assert(reused != NULL);
+    memset(reused, 9, size / 2);
+    assert(reused[size / 2 - 1] == 9);
+
+    // With no byte limit or delay, every free scavenges.
+    setScavengeLimits(1, 0);
+    vmemstats(&before, 0);
+    vmemfree(reused);
+    vmemstats(&after, 0);
+    assert(after.scavengePasses == before.scavengePasses + 1);
+    assert(after.scavengedBytes >= before.scavengedBytes + size / 4);
+    vmemfree(chunk);
+    assert(allocatedSpace == 0 && regionsUsed == 0);
+
+    setScavengeLimits(16 * 1024 * 1024, 1000);
+}
+
+// Checks that reserved memory is used before anything new is mapped, and that pinned memory is kept.
+// Pinned memory can't be released, so this runs after the other single threaded tests.
+void testReserve() {
+    printf("Testing reserved memory\n");
+
+    assert(vmemreserve(0, 0) == -1);
+    assert(vmemreserve(1024, 0x4) == -1);
+
+    VmemStats before, after;
+    before.size = after.size = sizeof(VmemStats);
+    assert(vmemstats(&before, 0) == 0);
+    // Half of the 8MB goes to the large bins, and half to containers of 8 byte chunks. The containers
+    // are carved out of one mapping.
+    assert(vmemreserve(8 * 1024 * 1024, VMEM_RESERVE_POPULATE | VMEM_RESERVE_SMALL(3)) == 0);
+    uint64_t mmapCalls = before.mmapCalls;
+    assert(vmemstats(&before, VMEM_STATS_RESIDENT) == 0);
+    assert(before.mmapCalls - mmapCalls <= 4);
+    assert(before.freeBytes >= 4 * 1024 * 1024);
+    assert(before.smallBins[3].containers == 1024);
+    assert(before.residentBytes >= 7 * 1024 * 1024);
+
+    void* large[100];
+    void* small[10000];
+    for (int i = 0; i < 100; i++) {
+        large[i] = vmemalloc(20000);
+        assert(large[i] != NULL);
+    }
+    for (int i = 0; i < 10000; i++) {
+        small[i] = vmemalloc(8);
+        assert(small[i] != NULL);
+    }
+    assert(vmemstats(&after, 0) == 0);
+    assert(after.mmapCalls == before.mmapCalls);
+    assert(after.smallBins[3].containers == 1024);
+
+    // Without pinning, the memory goes once the heap is empty.
+    for (int i = 0; i < 100; i++) {
+        vmemfree(large[i]);
+    }
+    for (int i = 0; i < 10000; i++) {
+        vmemfree(small[i]);
+    }
+    assert(regionsUsed == 0);
+
+    // Pinned memory stays even then, and isn't released by vmemtrim.
+    assert(vmemreserve(1024 * 1024, VMEM_RESERVE_PIN | VMEM_RESERVE_POPULATE | VMEM_RESERVE_SMALL(4)) == 0);
+    void* chunk = vmemalloc(20000);
+    void* smallChunk = vmemalloc(16);
+    vmemfree(chunk);
+    vmemfree(smallChunk);
+    vmemtrim();
+    assert(vmemstats(&after, VMEM_STATS_RESIDENT) == 0);
+    assert(allocatedSpace == 0);
+    assert(after.freeBytes >= 512 * 1024);
+    assert(after.smallBins[4].containers == 128);
+    assert(after.residentBytes >= 900 * 1024);
+}
+
+// Counts the lines of a file that start with prefix.
+int countLines(const char* path, const char* prefix) {
+    FILE* file = fopen(path, "r");
+    assert(file != NULL);
+    char line[4096];
+    int count = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, prefix, strlen(prefix)) == 0) {
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+// Checks that about one chunk is sampled per sample rate bytes, and that only live samples are dumped.
+void testProfile() {
+    printf("Testing the heap profiler\n");
+
+    assert(setProfileSampleRate(4096) == 0);
+    // 1MB in all, so about 250 samples.
+    void* chunks[1000];
+    for (int i = 0; i < 1000; i++) {
+        chunks[i] = vmemalloc(1000);
+    }
+    int64_t samples = profileSampleCount;
+    assert(samples > 150 && samples < 350);
+    assert(vmemprofile_dump("experiment2.heap") == 0);
+    assert(countLines("experiment2.heap", "heap profile: ") == 1);
+    assert(countLines("experiment2.heap", "1: 1000 [1: 1000] @ 0x") == samples);
+    assert(countLines("experiment2.heap", "MAPPED_LIBRARIES:") == 1);
+
+    // Samples are forgotten when their chunks are freed, however they are freed.
+    for (int i = 0; i < 500; i++) {
+        vmemfree(chunks[i]);
+    }
+    vmemfree_batch(chunks + 500, 250);
+    assert(profileSampleCount < samples);
+    samples = profileSampleCount;
+
+    // A realloc that fails leaves the chunk allocated, so it keeps its sample. At a rate of one byte
+    // every allocation is sampled once the countdown left from the old rate runs out.
+    assert(setProfileSampleRate(1) == 0);
+    void* sampled = vmemalloc(1000);
+    while (profileSampleCount == samples) {
+        vmemfree(sampled);
+        sampled = vmemalloc(1000);
+    }
+    assert(profileSampleCount == samples + 1);
+    assert(vmemrealloc(sampled, (size_t)1 << 62) == NULL);
+    assert(profileSampleCount == samples + 1);
+    vmemfree(sampled);
+    assert(profileSampleCount == samples);
+
+    // Stopping keeps the samples of chunks that are still allocated.
+    assert(setProfileSampleRate(0) == 0);
+    assert(vmemprofile_dump_on_signal(SIGUSR1, "experiment2.heap") == 0);
+    assert(raise(SIGUSR1) == 0);
+    assert(countLines("experiment2.heap", "1: 1000 [1: 1000] @ 0x") == samples);
+    signal(SIGUSR1, SIG_DFL);
+    for (int i = 750; i < 1000; i++) {
+        vmemfree(chunks[i]);
+    }
+    assert(profileSampleCount == 0);
+    assert(allocatedSpace == 0 && allocatedChunkCount == 0);
+}
+
+// Checks that timed operations land in the right histograms, and that the percentiles are in order.
+void testLatency() {
+    printf("Testing latency histograms\n");
+
+    assert(setLatencyTracking(1) == 0);
+    void* chunks[100];
+    for (int i = 0; i < 100; i++) {
+        chunks[i] = vmemalloc(i % 2 == 0 ? 16 : 1000);
+    }
+    // Sized frees count as frees once, whether they are small or passed on to vmemfree.
+    for (int i = 0; i < 100; i++) {
+        vmemfree_sized(chunks[i], i % 2 == 0 ? 16 : 1000);
+    }
+    assert(setLatencyTracking(0) == 0);
+    // Nothing is recorded while tracking is off.
+    vmemfree(vmemalloc(16));
+
+    VmemLatencyStats stats;
+    assert(vmemlatency(VMEM_LATENCY_ALLOC, &stats) == 0);
+    assert(stats.count == 100);
+    assert(stats.p50 <= stats.p90 && stats.p90 <= stats.p99 && stats.p99 <= stats.p999);
+    assert(stats.p999 <= stats.max && stats.mean <= stats.max);
+    assert(vmemlatency(VMEM_LATENCY_FREE, &stats) == 0);
+    assert(stats.count == 100);
+    assert(vmemlatency(VMEM_LATENCY_SMALL_ALLOC, &stats) == 0);
+    assert(stats.count == 50);
+    assert(vmemlatency(VMEM_LATENCY_LARGE_FREE, &stats) == 0);
+    assert(stats.count == 50);
+    assert(vmemlatency(VMEM_LATENCY_OPS, &stats) == -1);
+
+    assert(vmemlatency_dump("experiment2.latency") == 0);
+    assert(countLines("experiment2.latency", "alloc count=100 ") == 1);
+    assert(countLines("experiment2.latency", "small_alloc count=50 ") == 1);
+    assert(allocatedSpace == 0 && allocatedChunkCount == 0);
+}
+
+#ifdef VMEM_THREAD_SAFE
+#include <pthread.h>
+
+#define NUM_THREADS 4
+#define NUM_THREAD_ROUNDS 20
+#define NUM_PER_THREAD 500
+
+static unsigned char* threadChunks[NUM_THREADS][NUM_PER_THREAD];
+static int threadChunkSizes[NUM_THREADS][NUM_PER_THREAD];
+static pthread_barrier_t threadBarrier;
+
+// Each round, every thread allocates chunks and then frees the chunks of the next thread.
+void* threadMain(void* arg) {
+    int id = (int)(long)arg;
+    int next = (id + 1) % NUM_THREADS;
+    for (int round = 0; round < NUM_THREAD_ROUNDS; round++) {
+        for (int i = 0; i < NUM_PER_THREAD; i++) {
+            // Mix small chunks, cached large chunks and uncached large chunks.
+            int size = (i % 3 == 0) ? 1 + i % 31 : (i % 3 == 1) ? 32 + i : 3000 + i;
+            threadChunks[id][i] = vmemalloc(size);
+            assert(threadChunks[id][i] != NULL);
+            threadChunkSizes[id][i] = size;
+            memset(threadChunks[id][i], id + round, size);
+        }
+        pthread_barrier_wait(&threadBarrier);
+        for (int i = 0; i < NUM_PER_THREAD; i++) {
+            unsigned char* chunk = threadChunks[next][i];
+            for (int j = 0; j < threadChunkSizes[next][i]; j++) {
+                assert(chunk[j] == (unsigned char)(next + round));
+            }
+            vmemfree(chunk);
+        }
+        pthread_barrier_wait(&threadBarrier);
+    }
+    return NULL;
+}
+
+void testThreads() {
+    printf("Testing frees from other threads\n");
+
+    pthread_t threads[NUM_THREADS];
+    pthread_barrier_init(&threadBarrier, NULL, NUM_THREADS);
+    for (long i = 0; i < NUM_THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, threadMain, (void*)i) == 0);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&threadBarrier);
+    assert(allocatedSpace == 0);
+    assert(allocatedChunkCount == 0);
+    VmemStats stats;
+    stats.size = sizeof(VmemStats);
+    assert(vmemstats(&stats, VMEM_STATS_RESIDENT) == 0);
+    assert(stats.smallAllocatedBytes == 0 && stats.metadataBytes > 0);
+}
+
+#define NUM_CACHING_THREADS 32
+
+// Frees about 240KB of large chunks into the thread's cache, and keeps it until the main thread has looked.
+void* cachingThreadMain(void* arg) {
+    (void)arg;
+    void* chunks[240];
+    for (int i = 0; i < 240; i++) {
+        chunks[i] = vmemalloc(1000);
+        assert(chunks[i] != NULL);
+    }
+    for (int i = 0; i < 240; i++) {
+        vmemfree(chunks[i]);
+    }
+    pthread_barrier_wait(&threadBarrier);
+    pthread_barrier_wait(&threadBarrier);
+    return NULL;
+}
+
+// Checks that vmemtrim empties the calling thread's cache, and that all the caches share a limit.
+void testThreadCache() {
+    printf("Testing thread caches of large chunks\n");
+
+    VmemStats stats;
+    stats.size = sizeof(VmemStats);
+    void* chunks[100];
+    for (int i = 0; i < 100; i++) {
+        chunks[i] = vmemalloc(1000);
+        assert(chunks[i] != NULL);
+    }
+    for (int i = 0; i < 100; i++) {
+        vmemfree(chunks[i]);
+    }
+    assert(vmemstats(&stats, 0) == 0);
+    assert(stats.threadCacheBytes >= 100 * 1000);
+    vmemtrim();
+    assert(vmemstats(&stats, 0) == 0);
+    assert(stats.threadCacheBytes == 0);
+
+    pthread_t threads[NUM_CACHING_THREADS];
+    pthread_barrier_init(&threadBarrier, NULL, NUM_CACHING_THREADS + 1);
+    for (int i = 0; i < NUM_CACHING_THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, cachingThreadMain, NULL) == 0);
+    }
+    pthread_barrier_wait(&threadBarrier);
+    assert(vmemstats(&stats, 0) == 0);
+    assert(stats.threadCacheBytes > 0 && stats.threadCacheBytes <= 4 * 1024 * 1024);
+    pthread_barrier_wait(&threadBarrier);
+    for (int i = 0; i < NUM_CACHING_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&threadBarrier);
+    assert(vmemstats(&stats, 0) == 0);
+    assert(stats.threadCacheBytes == 0);
+}
+
+#define NUM_TIMED_THREADS 4
+
+void* timedThreadMain(void* arg) {
+    (void)arg;
+    for (int i = 0; i < 1000; i++) {
+        vmemfree(vmemalloc(16));
+    }
+    return NULL;
+}
+
+// Checks that the histograms of every thread are merged when they are read, including those of threads
+// that have exited, and that new threads take over the histograms of exited ones.
+void testThreadLatency() {
+    printf("Testing latency histograms of threads\n");
+
+    VmemLatencyStats latency;
+    VmemStats stats;
+    stats.size = sizeof(VmemStats);
+    assert(setLatencyTracking(1) == 0);
+    pthread_t threads[NUM_TIMED_THREADS];
+    for (int i = 0; i < NUM_TIMED_THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, timedThreadMain, NULL) == 0);
+    }
+    for (int i = 0; i < NUM_TIMED_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    assert(vmemlatency(VMEM_LATENCY_ALLOC, &latency) == 0);
+    assert(latency.count == NUM_TIMED_THREADS * 1000);
+    assert(vmemstats(&stats, 0) == 0);
+    uint64_t metadataBytes = stats.metadataBytes;
+
+    // Each of these threads starts after the last has exited, so none maps new histograms.
+    for (int i = 0; i < NUM_TIMED_THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, timedThreadMain, NULL) == 0);
+        pthread_join(threads[i], NULL);
+    }
+    assert(vmemlatency(VMEM_LATENCY_FREE, &latency) == 0);
+    assert(latency.count == 2 * NUM_TIMED_THREADS * 1000);
+    assert(vmemstats(&stats, 0) == 0);
+    assert(stats.metadataBytes == metadataBytes);
+
+    // Turning tracking on again clears every thread's histograms.
+    assert(setLatencyTracking(1) == 0);
+    assert(vmemlatency(VMEM_LATENCY_ALLOC, &latency) == 0);
+    assert(latency.count == 0);
+    assert(setLatencyTracking(0) == 0);
+}
+#endif
+
+// Traces more operations than the ring holds, and checks the file keeps the newest.
+void testTrace() {
+    printf("Testing the trace file\n");
+
+    setTraceCapacity(10);
+    setTraceFile("experiment2.trace");
+    for (int i = 0; i < 20; i++) {
+        vmemfree(vmemalloc(100 + i));
+    }
+    closeTraceFile();
+    setTraceCapacity(DEFAULT_TRACE_RECORDS);
+
+    FILE* file = fopen("experiment2.trace", "r");
+    assert(file != NULL);
+    TraceFileHeader header;
+    assert(fread(&header, sizeof(header), 1, file) == 1);
+    assert(header.magic == TRACE_MAGIC);
+    assert(header.capacity == 16);
+    assert(header.nextRecord == 40);
+    assert(header.endNanos > header.startNanos);
+    TraceRecord records[16];
+    assert(fread(records, sizeof(TraceRecord), 16, file) == 16);
+    fclose(file);
+
+    // Record n is at n % 16, so the newest (the 40th) is at 7.
+    TraceRecord* alloc = &records[6];
+    TraceRecord* freed = &records[7];
+    assert(alloc->op == TRACE_ALLOC && alloc->size == 119);
+    assert(alloc->allocatedChunkCount == 1);
+    assert(freed->op == TRACE_FREE && freed->ptr == alloc->ptr);
+    assert(freed->allocatedChunkCount == 0);
+    assert(freed->ticks >= alloc->ticks);
+}
+
 int main(){
     setupTimer();
-    setTraceFile("experiment2.csv");
+    setTraceFile("experiment2.trace");
 
+#ifdef VMEM_THREAD_SAFE
+    // Thread caches keep freed chunks, so the counters checked by the other tests don't apply.
+    testThreads();
+    testThreadCache();
+    testThreadLatency();
+#else
     testLarge();
     testSmall();
+    testSmallContainers();
+    testForeignFree();
+    testLargeRandom();
+    testCoalescing();
+    testRegionCache();
+    testReservation();
+    testHuge();
+    testRealloc();
+    testAlign();
+    testStats();
+    testLargeHeap();
+    testHugePages();
+    testArena();
+    testPool();
+    testBatch();
+    testSizedFree();
+    testProfile();
+    testScavenge();
+    testLatency();
+    testReserve();
+#endif
 
     closeTraceFile();
+    testTrace();
     printf("Test succeeded.\n");
     return 0;
 }
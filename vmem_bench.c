@@ -0,0 +1,500 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vmemalloc.h"
+#include "vmem_bench_common.h"
+
+// Standard allocator workloads, each run against vmemalloc (the thread-safe build) and the C library's
+// malloc in separate processes. Reports throughput, latency percentiles and memory overhead side by side,
+// and writes them as CSV so runs can be compared with a saved baseline.
+// Usage: vmem_bench [-w workload-prefix] [-o results.csv] [-b baseline.csv]
+
+// Latencies of at most this many operations are kept per workload.
+#define MAX_LATENCIES (16 * 1024 * 1024)
+
+// A throughput drop bigger than this, compared with the baseline, is flagged.
+#define REGRESSION_THRESHOLD 0.10
+
+// State of a workload run.
+typedef struct BenchContext {
+    const Allocator* allocator;
+    uint32_t* latencies;
+    uint64_t latencyCount;
+    uint64_t ops;
+    // Bytes requested by the program and not yet freed. Threads of a workload share the counts of
+    // the context they were started from, which is totals.
+    int64_t liveBytes;
+    int64_t peakLiveBytes;
+    struct BenchContext* totals;
+    // Used to pick sizes and slots.
+    uint64_t random;
+} BenchContext;
+
+static void recordLatency(BenchContext* context, uint64_t ticks) {
+    if (context->latencyCount < MAX_LATENCIES) {
+        context->latencies[context->latencyCount++] = ticks;
+    }
+    context->ops++;
+}
+
+static void addLiveBytes(BenchContext* context, int64_t bytes) {
+    BenchContext* totals = context->totals;
+    int64_t live = __atomic_add_fetch(&totals->liveBytes, bytes, __ATOMIC_RELAXED);
+    int64_t peak = __atomic_load_n(&totals->peakLiveBytes, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&totals->peakLiveBytes, &peak, live, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void* benchAlloc(BenchContext* context, int size) {
+    uint64_t start = readTicks();
+    void* ptr = context->allocator->alloc(size);
+    recordLatency(context, readTicks() - start);
+    if (ptr == NULL) {
+        fprintf(stderr, "%s failed to allocate %d bytes\n", context->allocator->name, size);
+        exit(EXIT_FAILURE);
+    }
+    touchChunk(ptr, size);
+    addLiveBytes(context, size);
+    return ptr;
+}
+
+static void benchFree(BenchContext* context, void* ptr, int size) {
+    uint64_t start = readTicks();
+    context->allocator->free(ptr);
+    recordLatency(context, readTicks() - start);
+    addLiveBytes(context, -size);
+}
+
+static void* benchRealloc(BenchContext* context, void* ptr, int oldSize, int size) {
+    uint64_t start = readTicks();
+    void* newPtr = context->allocator->realloc(ptr, size);
+    recordLatency(context, readTicks() - start);
+    if (newPtr == NULL) {
+        fprintf(stderr, "%s failed to reallocate to %d bytes\n", context->allocator->name, size);
+        exit(EXIT_FAILURE);
+    }
+    ((volatile unsigned char*)newPtr)[size - 1] = 1;
+    addLiveBytes(context, size - oldSize);
+    return newPtr;
+}
+
+// Size of a chunk in the random workloads: mostly small, some large, a few bigger than a page.
+static int randomSize(BenchContext* context) {
+    uint32_t kind = nextRandom(&context->random) % 100;
+    if (kind < 70) {
+        return 1 + nextRandom(&context->random) % SMALL_CHUNK_LIMIT;
+    } else if (kind < 95) {
+        return SMALL_CHUNK_LIMIT + 1 + nextRandom(&context->random) % 4096;
+    }
+    return 4097 + nextRandom(&context->random) % 65536;
+}
+
+#define CHURN_BATCH 100
+#define CHURN_ROUNDS 10000
+
+// Allocates a batch of chunks of one small size, then frees them, over and over.
+static void churn(BenchContext* context, int size) {
+    void* batch[CHURN_BATCH];
+    for (int round = 0; round < CHURN_ROUNDS; round++) {
+        for (int i = 0; i < CHURN_BATCH; i++) {
+            batch[i] = benchAlloc(context, size);
+        }
+        for (int i = CHURN_BATCH - 1; i >= 0; i--) {
+            benchFree(context, batch[i], size);
+        }
+    }
+}
+
+static void churn1(BenchContext* context) { churn(context, 1); }
+static void churn2(BenchContext* context) { churn(context, 2); }
+static void churn4(BenchContext* context) { churn(context, 4); }
+static void churn8(BenchContext* context) { churn(context, 8); }
+static void churn16(BenchContext* context) { churn(context, 16); }
+static void churn32(BenchContext* context) { churn(context, 32); }
+
+#define MIX_SLOTS 10000
+#define MIX_OPS 2000000
+
+// Each step frees a random slot if it is in use, or fills it with a chunk of random size, so chunks
+// have random sizes and lifetimes.
+static void randomMix(BenchContext* context) {
+    void** slots = mapArray(MIX_SLOTS, sizeof(void*));
+    int* sizes = mapArray(MIX_SLOTS, sizeof(int));
+    for (int i = 0; i < MIX_OPS; i++) {
+        int slot = nextRandom(&context->random) % MIX_SLOTS;
+        if (slots[slot] != NULL) {
+            benchFree(context, slots[slot], sizes[slot]);
+            slots[slot] = NULL;
+        } else {
+            sizes[slot] = randomSize(context);
+            slots[slot] = benchAlloc(context, sizes[slot]);
+        }
+    }
+    for (int slot = 0; slot < MIX_SLOTS; slot++) {
+        if (slots[slot] != NULL) {
+            benchFree(context, slots[slot], sizes[slot]);
+        }
+    }
+}
+
+#define LARSON_THREADS 4
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 10
+#define LARSON_STEPS 50000
+#define LARSON_MIN_SIZE 8
+#define LARSON_MAX_SIZE 512
+
+// Larson-style server simulation: each thread keeps replacing random objects in a set, and after
+// each round hands its set to the next thread, so most objects are freed by a different thread.
+typedef struct LarsonShared {
+    void** slots[LARSON_THREADS];
+    int* sizes[LARSON_THREADS];
+    pthread_barrier_t barrier;
+} LarsonShared;
+
+typedef struct LarsonThread {
+    LarsonShared* shared;
+    int id;
+    BenchContext context;
+} LarsonThread;
+
+// Adds the latencies and operations of a thread to the context it was started from.
+static void gatherThreadResults(BenchContext* context, BenchContext* threadContext) {
+    memcpy(context->latencies + context->latencyCount, threadContext->latencies,
+            threadContext->latencyCount * sizeof(uint32_t));
+    context->latencyCount += threadContext->latencyCount;
+    context->ops += threadContext->ops;
+}
+
+static void* larsonThread(void* arg) {
+    LarsonThread* thread = (LarsonThread*)arg;
+    LarsonShared* shared = thread->shared;
+    BenchContext* context = &thread->context;
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        int set = (thread->id + round) % LARSON_THREADS;
+        void** slots = shared->slots[set];
+        int* sizes = shared->sizes[set];
+        for (int step = 0; step < LARSON_STEPS; step++) {
+            int slot = nextRandom(&context->random) % LARSON_SLOTS;
+            if (slots[slot] != NULL) {
+                benchFree(context, slots[slot], sizes[slot]);
+            }
+            sizes[slot] = LARSON_MIN_SIZE + nextRandom(&context->random) % (LARSON_MAX_SIZE - LARSON_MIN_SIZE);
+            slots[slot] = benchAlloc(context, sizes[slot]);
+        }
+        pthread_barrier_wait(&shared->barrier);
+    }
+    return NULL;
+}
+
+static void larson(BenchContext* context) {
+    LarsonShared shared;
+    LarsonThread threads[LARSON_THREADS];
+    pthread_t handles[LARSON_THREADS];
+    pthread_barrier_init(&shared.barrier, NULL, LARSON_THREADS);
+    for (int i = 0; i < LARSON_THREADS; i++) {
+        shared.slots[i] = mapArray(LARSON_SLOTS, sizeof(void*));
+        shared.sizes[i] = mapArray(LARSON_SLOTS, sizeof(int));
+        threads[i].shared = &shared;
+        threads[i].id = i;
+        threads[i].context = *context;
+        threads[i].context.random = context->random + i;
+        threads[i].context.latencies = mapArray(MAX_LATENCIES / LARSON_THREADS, sizeof(uint32_t));
+        threads[i].context.latencyCount = 0;
+        threads[i].context.ops = 0;
+    }
+    for (int i = 0; i < LARSON_THREADS; i++) {
+        pthread_create(&handles[i], NULL, larsonThread, &threads[i]);
+    }
+    for (int i = 0; i < LARSON_THREADS; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    pthread_barrier_destroy(&shared.barrier);
+    for (int i = 0; i < LARSON_THREADS; i++) {
+        gatherThreadResults(context, &threads[i].context);
+    }
+    for (int set = 0; set < LARSON_THREADS; set++) {
+        for (int slot = 0; slot < LARSON_SLOTS; slot++) {
+            if (shared.slots[set][slot] != NULL) {
+                context->allocator->free(shared.slots[set][slot]);
+            }
+        }
+    }
+}
+
+#define SCALING_MAX_THREADS 8
+#define SCALING_SLOTS 1000
+#define SCALING_STEPS 500000
+#define SCALING_MAX_SIZE 2048
+
+// Each thread replaces random chunks of its own, small ones and large ones its cache keeps, without
+// sharing anything with the others. Every thread does the same work, so with enough cores the
+// throughput of scaling_N should be close to N times that of scaling_1.
+static void* scalingThread(void* arg) {
+    BenchContext* context = (BenchContext*)arg;
+    void** slots = mapArray(SCALING_SLOTS, sizeof(void*));
+    int* sizes = mapArray(SCALING_SLOTS, sizeof(int));
+    for (int step = 0; step < SCALING_STEPS; step++) {
+        int slot = nextRandom(&context->random) % SCALING_SLOTS;
+        if (slots[slot] != NULL) {
+            benchFree(context, slots[slot], sizes[slot]);
+        }
+        sizes[slot] = 1 + nextRandom(&context->random) % SCALING_MAX_SIZE;
+        slots[slot] = benchAlloc(context, sizes[slot]);
+    }
+    for (int slot = 0; slot < SCALING_SLOTS; slot++) {
+        if (slots[slot] != NULL) {
+            benchFree(context, slots[slot], sizes[slot]);
+        }
+    }
+    return NULL;
+}
+
+static void scaling(BenchContext* context, int threadCount) {
+    BenchContext threads[SCALING_MAX_THREADS];
+    pthread_t handles[SCALING_MAX_THREADS];
+    for (int i = 0; i < threadCount; i++) {
+        threads[i] = *context;
+        threads[i].random = context->random + i;
+        threads[i].latencies = mapArray(MAX_LATENCIES / SCALING_MAX_THREADS, sizeof(uint32_t));
+        threads[i].latencyCount = 0;
+        threads[i].ops = 0;
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_create(&handles[i], NULL, scalingThread, &threads[i]);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(handles[i], NULL);
+        gatherThreadResults(context, &threads[i]);
+    }
+}
+
+static void scaling1(BenchContext* context) { scaling(context, 1); }
+static void scaling2(BenchContext* context) { scaling(context, 2); }
+static void scaling4(BenchContext* context) { scaling(context, 4); }
+static void scaling8(BenchContext* context) { scaling(context, 8); }
+
+#define GROWTH_BUFFERS 64
+#define GROWTH_STEP 100
+#define GROWTH_LIMIT 100000
+
+// Grows many buffers a little at a time, in turn, like strings or vectors being appended to.
+static void reallocGrowth(BenchContext* context) {
+    void* buffers[GROWTH_BUFFERS];
+    for (int i = 0; i < GROWTH_BUFFERS; i++) {
+        buffers[i] = benchAlloc(context, GROWTH_STEP);
+    }
+    for (int size = GROWTH_STEP; size < GROWTH_LIMIT; size += GROWTH_STEP) {
+        for (int i = 0; i < GROWTH_BUFFERS; i++) {
+            buffers[i] = benchRealloc(context, buffers[i], size, size + GROWTH_STEP);
+        }
+    }
+    int finalSize = GROWTH_STEP * ((GROWTH_LIMIT - 1) / GROWTH_STEP + 1);
+    for (int i = 0; i < GROWTH_BUFFERS; i++) {
+        benchFree(context, buffers[i], finalSize);
+    }
+}
+
+#define FRAGMENT_CHUNKS 100000
+
+// Fills memory with chunks, frees every other one, then allocates chunks too big for the holes.
+static void fragmentation(BenchContext* context) {
+    void** chunks = mapArray(FRAGMENT_CHUNKS, sizeof(void*));
+    int* sizes = mapArray(FRAGMENT_CHUNKS, sizeof(int));
+    for (int i = 0; i < FRAGMENT_CHUNKS; i++) {
+        sizes[i] = 64 + nextRandom(&context->random) % 960;
+        chunks[i] = benchAlloc(context, sizes[i]);
+    }
+    for (int i = 0; i < FRAGMENT_CHUNKS; i += 2) {
+        benchFree(context, chunks[i], sizes[i]);
+    }
+    for (int i = 0; i < FRAGMENT_CHUNKS; i += 2) {
+        sizes[i] = 1100 + nextRandom(&context->random) % 900;
+        chunks[i] = benchAlloc(context, sizes[i]);
+    }
+    for (int i = 0; i < FRAGMENT_CHUNKS; i++) {
+        benchFree(context, chunks[i], sizes[i]);
+    }
+}
+
+typedef struct Workload {
+    const char* name;
+    void (*run)(BenchContext* context);
+} Workload;
+
+static const Workload workloads[] = {
+    {"churn_1", churn1},
+    {"churn_2", churn2},
+    {"churn_4", churn4},
+    {"churn_8", churn8},
+    {"churn_16", churn16},
+    {"churn_32", churn32},
+    {"random_mix", randomMix},
+    {"larson", larson},
+    {"scaling_1", scaling1},
+    {"scaling_2", scaling2},
+    {"scaling_4", scaling4},
+    {"scaling_8", scaling8},
+    {"realloc_growth", reallocGrowth},
+    {"fragmentation", fragmentation}
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+typedef struct BenchRun {
+    const Workload* workload;
+    const Allocator* allocator;
+    // Shared with the parent process.
+    BenchResult* result;
+} BenchRun;
+
+// Runs a workload with one allocator. Runs in its own process.
+static void runWorkload(void* arg) {
+    BenchRun* run = (BenchRun*)arg;
+    BenchContext context;
+    memset(&context, 0, sizeof(context));
+    context.allocator = run->allocator;
+    context.latencies = mapArray(MAX_LATENCIES, sizeof(uint32_t));
+    context.random = 12345;
+    context.totals = &context;
+    long baselineRss = readRssKB();
+
+    int64_t startNanos = timeInNanos();
+    uint64_t startTicks = readTicks();
+    run->workload->run(&context);
+    double seconds = (timeInNanos() - startNanos) / 1e9;
+    double nanosPerTick = seconds * 1e9 / (double)(readTicks() - startTicks);
+
+    BenchResult* result = run->result;
+    startBenchResult(result, run->workload->name, run->allocator->name);
+    result->ops = context.ops;
+    result->opsPerSec = context.ops / seconds;
+    summariseLatencies(context.latencies, context.latencyCount, nanosPerTick, &result->latency);
+    result->peakLiveKB = context.peakLiveBytes / 1024;
+    result->peakRssKB = readPeakRssKB() - baselineRss;
+    result->overhead = result->peakLiveKB > 0 ? (double)result->peakRssKB / result->peakLiveKB : 0;
+}
+
+#define CSV_HEADER "workload,allocator,ops,opsPerSec,p50Ns,p90Ns,p99Ns,p999Ns,maxNs,peakLiveKB,peakRssKB,overhead"
+
+static void writeResults(FILE* file, BenchResult* results, int count) {
+    fprintf(file, "%s\n", CSV_HEADER);
+    for (int i = 0; i < count; i++) {
+        BenchResult* result = &results[i];
+        fprintf(file, "%s,%s,%llu,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%ld,%ld,%.3f\n", result->workload, result->allocator,
+                (unsigned long long)result->ops, result->opsPerSec, result->latency.p50, result->latency.p90,
+                result->latency.p99, result->latency.p999, result->latency.max, result->peakLiveKB,
+                result->peakRssKB, result->overhead);
+    }
+}
+
+// Reads results written by writeResults. Returns the number read.
+static int readResults(const char* path, BenchResult* results, int maxCount) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Failed to open baseline");
+        return 0;
+    }
+    char line[512];
+    int count = 0;
+    while (count < maxCount && fgets(line, sizeof(line), file) != NULL) {
+        BenchResult* result = &results[count];
+        unsigned long long ops;
+        if (sscanf(line, "%31[^,],%31[^,],%llu,%lf,%lf,%lf,%lf,%lf,%lf,%ld,%ld,%lf", result->workload,
+                result->allocator, &ops, &result->opsPerSec, &result->latency.p50, &result->latency.p90,
+                &result->latency.p99, &result->latency.p999, &result->latency.max, &result->peakLiveKB,
+                &result->peakRssKB, &result->overhead) == 12) {
+            result->ops = ops;
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+static double percentChange(double value, double baseline) {
+    return baseline > 0 ? 100 * (value - baseline) / baseline : 0;
+}
+
+// Prints how each result has changed since the baseline.
+static void compareResults(BenchResult* results, int count, BenchResult* baseline, int baselineCount) {
+    printf("\nChange from baseline:\n");
+    printf("%-16s %-10s %10s %10s %10s\n", "workload", "allocator", "ops/s", "p99", "rss");
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < baselineCount; j++) {
+            if (strcmp(results[i].workload, baseline[j].workload) || strcmp(results[i].allocator, baseline[j].allocator)) {
+                continue;
+            }
+            double throughput = percentChange(results[i].opsPerSec, baseline[j].opsPerSec);
+            printf("%-16s %-10s %+9.1f%% %+9.1f%% %+9.1f%%%s\n", results[i].workload, results[i].allocator, throughput,
+                    percentChange(results[i].latency.p99, baseline[j].latency.p99),
+                    percentChange(results[i].peakRssKB, baseline[j].peakRssKB),
+                    throughput < -100 * REGRESSION_THRESHOLD ? "  SLOWER" : "");
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* prefix = "";
+    const char* outputPath = NULL;
+    const char* baselinePath = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "w:o:b:")) != -1) {
+        switch (option) {
+            case 'w':
+                prefix = optarg;
+                break;
+            case 'o':
+                outputPath = optarg;
+                break;
+            case 'b':
+                baselinePath = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w workload-prefix] [-o results.csv] [-b baseline.csv]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    BenchResult* results = mapSharedArray(NUM_WORKLOADS * NUM_ALLOCATORS, sizeof(BenchResult));
+    int count = 0;
+    printf("%-16s %-10s %10s %8s %8s %8s %10s %10s %10s %8s\n", "workload", "allocator", "ops/s", "p50ns", "p99ns",
+            "p999ns", "maxns", "liveKB", "rssKB", "overhead");
+    for (int i = 0; i < (int)NUM_WORKLOADS; i++) {
+        if (strncmp(workloads[i].name, prefix, strlen(prefix))) {
+            continue;
+        }
+        for (int j = 0; j < NUM_ALLOCATORS; j++) {
+            BenchRun run = {&workloads[i], &allocators[j], &results[count]};
+            if (runInChild(runWorkload, &run)) {
+                fprintf(stderr, "%s failed with %s\n", workloads[i].name, allocators[j].name);
+                return EXIT_FAILURE;
+            }
+            BenchResult* result = &results[count++];
+            printf("%-16s %-10s %10.0f %8.0f %8.0f %8.0f %10.0f %10ld %10ld %8.2f\n", result->workload,
+                    result->allocator, result->opsPerSec, result->latency.p50, result->latency.p99,
+                    result->latency.p999, result->latency.max, result->peakLiveKB, result->peakRssKB, result->overhead);
+            fflush(stdout);
+        }
+    }
+
+    if (outputPath != NULL) {
+        FILE* file = fopen(outputPath, "w");
+        if (file == NULL) {
+            perror("Failed to open results file");
+            return EXIT_FAILURE;
+        }
+        writeResults(file, results, count);
+        fclose(file);
+    }
+    if (baselinePath != NULL) {
+        BenchResult* baseline = mapArray(NUM_WORKLOADS * NUM_ALLOCATORS, sizeof(BenchResult));
+        int baselineCount = readResults(baselinePath, baseline, NUM_WORKLOADS * NUM_ALLOCATORS);
+        compareResults(results, count, baseline, baselineCount);
+    }
+    return EXIT_SUCCESS;
+}
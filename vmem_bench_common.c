@@ -0,0 +1,131 @@
+// Needed for MAP_ANONYMOUS.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "vmemalloc.h"
+#include "vmem_bench_common.h"
+
+static void* libcAlign(size_t alignment, size_t size) {
+    void* ptr = NULL;
+    return posix_memalign(&ptr, alignment < sizeof(void*) ? sizeof(void*) : alignment, size) ? NULL : ptr;
+}
+
+const Allocator allocators[NUM_ALLOCATORS] = {
+    {"vmemalloc", vmemalloc, vmemfree, vmemrealloc, vmemcalloc, vmemalign, 1},
+    {"libc", malloc, free, realloc, calloc, libcAlign, 0}
+};
+
+static void* mapPages(uint64_t length, int flags) {
+    void* array = mmap(0, length > 0 ? length : 1, PROT_READ|PROT_WRITE, flags|MAP_ANONYMOUS, -1, 0);
+    if (array == MAP_FAILED) {
+        perror("Error mapping benchmark array");
+        exit(EXIT_FAILURE);
+    }
+    return array;
+}
+
+void* mapArray(uint64_t count, uint64_t size) {
+    return mapPages(count * size, MAP_PRIVATE);
+}
+
+void* mapSharedArray(uint64_t count, uint64_t size) {
+    return mapPages(count * size, MAP_SHARED);
+}
+
+int64_t timeInNanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+uint64_t readTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return timeInNanos();
+#endif
+}
+
+long readRssKB(void) {
+    long pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return pages * (getpagesize() / 1024);
+}
+
+long readPeakRssKB(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void touchChunk(void* ptr, size_t size) {
+    for (size_t offset = 0; offset < size; offset += 4096) {
+        ((volatile unsigned char*)ptr)[offset] = 1;
+    }
+}
+
+void startBenchResult(BenchResult* result, const char* workload, const char* allocator) {
+    memset(result, 0, sizeof(BenchResult));
+    strncpy(result->workload, workload, NAME_LENGTH - 1);
+    strncpy(result->allocator, allocator, NAME_LENGTH - 1);
+}
+
+uint32_t nextRandom(uint64_t* state) {
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 33;
+}
+
+static int compareLatencies(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+void summariseLatencies(uint32_t* latencies, uint64_t count, double nanosPerTick, LatencySummary* summary) {
+    if (count == 0) {
+        summary->p50 = summary->p90 = summary->p99 = summary->p999 = summary->max = 0;
+        return;
+    }
+    qsort(latencies, count, sizeof(uint32_t), compareLatencies);
+    summary->p50 = latencies[(uint64_t)(0.5 * (count - 1))] * nanosPerTick;
+    summary->p90 = latencies[(uint64_t)(0.9 * (count - 1))] * nanosPerTick;
+    summary->p99 = latencies[(uint64_t)(0.99 * (count - 1))] * nanosPerTick;
+    summary->p999 = latencies[(uint64_t)(0.999 * (count - 1))] * nanosPerTick;
+    summary->max = latencies[count - 1] * nanosPerTick;
+}
+
+int runInChild(void (*function)(void*), void* arg) {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        function(arg);
+        fflush(NULL);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        return -1;
+    }
+    return 0;
+}
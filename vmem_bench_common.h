@@ -0,0 +1,84 @@
+#ifndef VMEM_BENCH_COMMON_GUARD
+#define VMEM_BENCH_COMMON_GUARD
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Support shared by the benchmark tools (vmem_bench, vmem_bench_containers and vmem_replay), which
+// run the same workload against vmemalloc and against other allocators.
+
+// The functions of an allocator being measured.
+typedef struct Allocator {
+    const char* name;
+    void* (*alloc)(size_t size);
+    void (*free)(void* ptr);
+    void* (*realloc)(void* ptr, size_t size);
+    void* (*calloc)(size_t count, size_t size);
+    void* (*align)(size_t alignment, size_t size);
+    // Whether the vmemalloc statistics describe this allocator.
+    int hasStats;
+} Allocator;
+
+#define NUM_ALLOCATORS 2
+extern const Allocator allocators[NUM_ALLOCATORS];
+
+// Latency percentiles in nanoseconds.
+typedef struct LatencySummary {
+    double p50;
+    double p90;
+    double p99;
+    double p999;
+    double max;
+} LatencySummary;
+
+#define NAME_LENGTH 32
+
+// Results of a workload with one allocator. Each tool fills in the fields it measures and leaves the
+// rest 0.
+typedef struct BenchResult {
+    char workload[NAME_LENGTH];
+    char allocator[NAME_LENGTH];
+    uint64_t ops;
+    double opsPerSec;
+    LatencySummary latency;
+    long peakLiveKB;
+    long peakRssKB;
+    // Peak RSS over peak live bytes.
+    double overhead;
+    // Computed by the workload, so runs with different allocators can be checked against each other.
+    uint64_t checksum;
+} BenchResult;
+
+// Starts a result for a workload run with an allocator.
+extern void startBenchResult(BenchResult* result, const char* workload, const char* allocator);
+
+// A fixed sequence of pseudo-random numbers, so every allocator gets exactly the same workload.
+extern uint32_t nextRandom(uint64_t* state);
+
+// Maps an array with mmap, so the tools' own memory doesn't disturb the allocator being measured.
+// Shared arrays are seen by the parent after a child process writes to them. Exits on failure.
+extern void* mapArray(uint64_t count, uint64_t size);
+extern void* mapSharedArray(uint64_t count, uint64_t size);
+
+extern int64_t timeInNanos(void);
+
+// Cheap timestamp: the time stamp counter where there is one, or nanoseconds.
+extern uint64_t readTicks(void);
+
+// Current resident set size in KB.
+extern long readRssKB(void);
+
+// Peak resident set size of the process in KB.
+extern long readPeakRssKB(void);
+
+// Writes to every page of a new chunk, as a program would, so it counts towards the RSS.
+extern void touchChunk(void* ptr, size_t size);
+
+// Sorts the latencies (in ticks) and works out the percentiles.
+extern void summariseLatencies(uint32_t* latencies, uint64_t count, double nanosPerTick, LatencySummary* summary);
+
+// Runs function(arg) in a child process, so each allocator starts from a fresh heap and has its own RSS.
+// Returns 0 if the child succeeded.
+extern int runInChild(void (*function)(void*), void* arg);
+
+#endif
@@ -0,0 +1,253 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "vmemalloc.hpp"
+
+extern "C" {
+#include "vmem_bench_common.h"
+}
+
+// Standard library containers run with std::allocator and with the adapters in vmemalloc.hpp, each
+// in its own process. Reports the time per operation and the peak RSS of every combination, and checks
+// they all computed the same result.
+// Usage: vmem_bench_containers [-w workload-prefix] [-r rounds]
+
+// Number of allocators each workload is run with.
+#define NUM_SETUPS 5
+
+// Operations in each round of a workload.
+#define ROUND_OPS 100000
+
+// Allocators under test. Each gives an allocator of char, which the workloads rebind, and is told
+// when a round ends, which is when an arena gives back everything the round used.
+struct StdSetup {
+    static constexpr const char* name = "std";
+    std::allocator<char> get() { return {}; }
+    void endRound() {}
+};
+
+struct VmemSetup {
+    static constexpr const char* name = "vmem";
+    vmem::allocator<char> get() { return {}; }
+    void endRound() {}
+};
+
+struct PmrSetup {
+    static constexpr const char* name = "vmem_pmr";
+    std::pmr::polymorphic_allocator<char> get() { return {vmem::get_memory_resource()}; }
+    void endRound() {}
+};
+
+struct ArenaSetup {
+    static constexpr const char* name = "vmem_arena";
+    vmem::arena_resource resource;
+    vmem::arena_allocator<char> get() { return vmem::arena_allocator<char>(resource); }
+    void endRound() { resource.release(); }
+};
+
+struct ArenaPmrSetup {
+    static constexpr const char* name = "vmem_arena_pmr";
+    vmem::arena_resource resource;
+    std::pmr::polymorphic_allocator<char> get() { return {&resource}; }
+    void endRound() { resource.release(); }
+};
+
+template <class Alloc, class T>
+using Rebind = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+template <class Alloc>
+using String = std::basic_string<char, std::char_traits<char>, Rebind<Alloc, char>>;
+
+// Fills a tree with random keys, looks half of them up, and erases them in a different order.
+template <class Setup>
+uint64_t runMap(Setup& setup, int rounds) {
+    using Alloc = decltype(setup.get());
+    using Map = std::map<uint32_t, uint64_t, std::less<uint32_t>, Rebind<Alloc, std::pair<const uint32_t, uint64_t>>>;
+    uint64_t random = 1;
+    uint64_t checksum = 0;
+    for (int round = 0; round < rounds; round++) {
+        {
+            Map map(setup.get());
+            std::vector<uint32_t> keys(ROUND_OPS);
+            for (int i = 0; i < ROUND_OPS; i++) {
+                keys[i] = nextRandom(&random);
+                map[keys[i]] += i;
+            }
+            for (int i = 0; i < ROUND_OPS; i += 2) {
+                checksum += map.find(keys[i])->second;
+            }
+            for (int i = ROUND_OPS - 1; i >= 0; i -= 2) {
+                map.erase(keys[i]);
+            }
+            checksum += map.size();
+        }
+        setup.endRound();
+    }
+    return checksum;
+}
+
+// Fills a hash table with random keys, which rehashes as it grows, then looks them up and erases half.
+template <class Setup>
+uint64_t runUnorderedMap(Setup& setup, int rounds) {
+    using Alloc = decltype(setup.get());
+    using Map = std::unordered_map<uint32_t, uint64_t, std::hash<uint32_t>, std::equal_to<uint32_t>,
+        Rebind<Alloc, std::pair<const uint32_t, uint64_t>>>;
+    uint64_t random = 1;
+    uint64_t checksum = 0;
+    for (int round = 0; round < rounds; round++) {
+        {
+            Map map(0, std::hash<uint32_t>(), std::equal_to<uint32_t>(), setup.get());
+            std::vector<uint32_t> keys(ROUND_OPS);
+            for (int i = 0; i < ROUND_OPS; i++) {
+                keys[i] = nextRandom(&random);
+                map[keys[i]] += i;
+            }
+            for (int i = 0; i < ROUND_OPS; i++) {
+                checksum += map.find(keys[i])->second;
+            }
+            for (int i = 0; i < ROUND_OPS; i += 2) {
+                map.erase(keys[i]);
+            }
+            checksum += map.size();
+        }
+        setup.endRound();
+    }
+    return checksum;
+}
+
+// Appends strings too long for the small string buffer to a vector, then replaces some of them.
+template <class Setup>
+uint64_t runVectorString(Setup& setup, int rounds) {
+    using Alloc = decltype(setup.get());
+    using Vector = std::vector<String<Alloc>, Rebind<Alloc, String<Alloc>>>;
+    uint64_t random = 1;
+    uint64_t checksum = 0;
+    char text[128];
+    memset(text, 'x', sizeof(text));
+    for (int round = 0; round < rounds; round++) {
+        {
+            Vector strings(setup.get());
+            for (int i = 0; i < ROUND_OPS; i++) {
+                // Strings are given the vector's allocator, as arena allocators have no default.
+                strings.push_back(String<Alloc>(text, 16 + nextRandom(&random) % 100, setup.get()));
+            }
+            for (int i = 0; i < ROUND_OPS; i += 4) {
+                strings[nextRandom(&random) % ROUND_OPS].assign(text, 16 + nextRandom(&random) % 100);
+            }
+            for (const auto& string : strings) {
+                checksum += string.size();
+            }
+        }
+        setup.endRound();
+    }
+    return checksum;
+}
+
+struct Workload {
+    const char* name;
+    // Operations in each round, counting lookups and erases as well as inserts.
+    uint64_t roundOps;
+    uint64_t (*run[NUM_SETUPS])(int rounds);
+};
+
+// Runs a workload against a new setup, so arenas are created and destroyed in the child.
+template <class Setup, uint64_t (*Run)(Setup&, int)>
+uint64_t runWith(int rounds) {
+    Setup setup;
+    return Run(setup, rounds);
+}
+
+#define WORKLOAD(name, ops, function) {name, ops, {runWith<StdSetup, function<StdSetup>>, \
+        runWith<VmemSetup, function<VmemSetup>>, runWith<PmrSetup, function<PmrSetup>>, \
+        runWith<ArenaSetup, function<ArenaSetup>>, runWith<ArenaPmrSetup, function<ArenaPmrSetup>>}}
+
+static const char* allocatorNames[NUM_SETUPS] = {StdSetup::name, VmemSetup::name, PmrSetup::name, ArenaSetup::name,
+    ArenaPmrSetup::name};
+
+static const Workload workloads[] = {
+    WORKLOAD("map", 2 * ROUND_OPS, runMap),
+    WORKLOAD("unordered_map", 5 * ROUND_OPS / 2, runUnorderedMap),
+    WORKLOAD("vector_string", 5 * ROUND_OPS / 4, runVectorString),
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+// A workload and allocator to run in a child process.
+struct ContainerRun {
+    const Workload* workload;
+    int setup;
+    int rounds;
+    BenchResult* result;
+};
+
+static void runWorkload(void* arg) {
+    ContainerRun* run = (ContainerRun*)arg;
+    long baselineRss = readPeakRssKB();
+    int64_t startNanos = timeInNanos();
+    uint64_t checksum = run->workload->run[run->setup](run->rounds);
+    int64_t nanos = timeInNanos() - startNanos;
+
+    BenchResult* result = run->result;
+    startBenchResult(result, run->workload->name, allocatorNames[run->setup]);
+    result->ops = run->workload->roundOps * run->rounds;
+    result->opsPerSec = result->ops * 1e9 / nanos;
+    result->peakRssKB = readPeakRssKB() - baselineRss;
+    result->checksum = checksum;
+}
+
+int main(int argc, char** argv) {
+    const char* prefix = "";
+    int rounds = 10;
+    int option;
+    while ((option = getopt(argc, argv, "w:r:")) != -1) {
+        switch (option) {
+            case 'w':
+                prefix = optarg;
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w workload-prefix] [-r rounds]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (rounds < 1) {
+        fprintf(stderr, "rounds must be at least 1 (%d)\n", rounds);
+        return EXIT_FAILURE;
+    }
+
+    BenchResult* results = (BenchResult*)mapSharedArray(NUM_WORKLOADS * NUM_SETUPS, sizeof(BenchResult));
+    printf("%-16s %-16s %10s %8s %10s %8s\n", "workload", "allocator", "ops/s", "ns/op", "rssKB", "speedup");
+    for (int i = 0; i < (int)NUM_WORKLOADS; i++) {
+        if (strncmp(workloads[i].name, prefix, strlen(prefix))) {
+            continue;
+        }
+        BenchResult* baseline = &results[i * NUM_SETUPS];
+        for (int j = 0; j < NUM_SETUPS; j++) {
+            BenchResult* result = &results[i * NUM_SETUPS + j];
+            ContainerRun run = {&workloads[i], j, rounds, result};
+            if (runInChild(runWorkload, &run)) {
+                fprintf(stderr, "%s failed with %s\n", workloads[i].name, allocatorNames[j]);
+                return EXIT_FAILURE;
+            }
+            // The first setup is std::allocator, which the others are compared with.
+            if (result->checksum != baseline->checksum) {
+                fprintf(stderr, "%s gave a different result with %s\n", workloads[i].name, allocatorNames[j]);
+                return EXIT_FAILURE;
+            }
+            printf("%-16s %-16s %10.0f %8.1f %10ld %7.2fx\n", result->workload, result->allocator,
+                    result->opsPerSec, 1e9 / result->opsPerSec, result->peakRssKB,
+                    result->opsPerSec / baseline->opsPerSec);
+            fflush(stdout);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,306 @@
+// Needed for getopt.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vmemalloc.h"
+#include "vmem_bench_common.h"
+
+// Replays a trace captured by vmemalloc (with setTraceFile, or VMEM_TRACE_FILE and libvmemalloc.so)
+// against vmemalloc and against the C library's malloc, and reports throughput, latency and memory use.
+// Usage: vmem_replay [-a vmem|libc|both] [-t timeline.csv] [-s sample-interval] trace-file
+//
+// Pointers in the trace are turned into object IDs, so an object keeps its ID through reallocs and
+// a reused address gets a new one. Operations from every thread are replayed in the order they were
+// recorded, on a single thread. Each allocator is replayed in its own process, so their RSS is separate.
+
+// An operation to replay.
+typedef struct ReplayOp {
+    uint8_t op;
+    uint32_t id;
+    uint64_t size;
+    // Alignment for TRACE_ALIGN.
+    uint64_t alignment;
+} ReplayOp;
+
+// Hash table from the address of a live object to its ID, with linear probing.
+typedef struct ObjectTable {
+    uint64_t* keys;
+    uint32_t* ids;
+    uint64_t mask;
+} ObjectTable;
+
+static uint64_t hashPointer(uint64_t ptr) {
+    return (ptr >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+static void insertObject(ObjectTable* table, uint64_t ptr, uint32_t id) {
+    uint64_t i = hashPointer(ptr) & table->mask;
+    while (table->keys[i] != 0 && table->keys[i] != ptr) {
+        i = (i + 1) & table->mask;
+    }
+    table->keys[i] = ptr;
+    table->ids[i] = id;
+}
+
+// Removes an object from the table. Returns its ID, or 0 if it isn't there.
+static uint32_t removeObject(ObjectTable* table, uint64_t ptr) {
+    uint64_t i = hashPointer(ptr) & table->mask;
+    while (table->keys[i] != ptr) {
+        if (table->keys[i] == 0) {
+            return 0;
+        }
+        i = (i + 1) & table->mask;
+    }
+    uint32_t id = table->ids[i];
+    // Shift later entries of the same run back, so no lookup stops at the gap.
+    uint64_t gap = i;
+    for (uint64_t j = (i + 1) & table->mask; table->keys[j] != 0; j = (j + 1) & table->mask) {
+        uint64_t home = hashPointer(table->keys[j]) & table->mask;
+        if (((j - home) & table->mask) >= ((j - gap) & table->mask)) {
+            table->keys[gap] = table->keys[j];
+            table->ids[gap] = table->ids[j];
+            gap = j;
+        }
+    }
+    table->keys[gap] = 0;
+    return id;
+}
+
+// Turns the records of a trace file into operations on object IDs. IDs start at 1.
+// Returns the number of operations, and sets *objectCount to the number of IDs used.
+static uint64_t loadTrace(const char* path, ReplayOp** opsOut, uint32_t* objectCount) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open trace file");
+        exit(EXIT_FAILURE);
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) || (size_t)fileStat.st_size < sizeof(TraceFileHeader)) {
+        fprintf(stderr, "%s is not a trace file\n", path);
+        exit(EXIT_FAILURE);
+    }
+    void* mapping = mmap(0, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("Failed to map trace file");
+        exit(EXIT_FAILURE);
+    }
+    TraceFileHeader* header = (TraceFileHeader*)mapping;
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION || header->recordSize != sizeof(TraceRecord)
+            || sizeof(TraceFileHeader) + header->capacity * sizeof(TraceRecord) > (size_t)fileStat.st_size) {
+        fprintf(stderr, "%s is not a trace file of version %d\n", path, TRACE_VERSION);
+        exit(EXIT_FAILURE);
+    }
+    TraceRecord* records = (TraceRecord*)(header + 1);
+    uint64_t count = header->nextRecord < header->capacity ? header->nextRecord : header->capacity;
+    uint64_t first = header->nextRecord - count;
+    if (first > 0) {
+        fprintf(stderr, "Trace ring wrapped: the first %llu operations were lost, and frees of objects "
+                "allocated by them are skipped\n", (unsigned long long)first);
+    }
+
+    ReplayOp* ops = mapArray(count, sizeof(ReplayOp));
+    ObjectTable table;
+    uint64_t tableSize = 16;
+    while (tableSize < 2 * count) {
+        tableSize <<= 1;
+    }
+    table.keys = mapArray(tableSize, sizeof(uint64_t));
+    table.ids = mapArray(tableSize, sizeof(uint32_t));
+    table.mask = tableSize - 1;
+
+    uint32_t nextId = 1;
+    uint64_t opCount = 0;
+    uint64_t skipped = 0;
+    for (uint64_t i = first; i < header->nextRecord; i++) {
+        TraceRecord* record = &records[i & (header->capacity - 1)];
+        ReplayOp* op = &ops[opCount];
+        op->op = record->op;
+        op->size = record->size;
+        op->alignment = 0;
+        switch (record->op) {
+            case TRACE_ALIGN:
+                op->alignment = record->arg;
+                // Fall through.
+            case TRACE_ALLOC:
+            case TRACE_CALLOC:
+                op->id = nextId++;
+                insertObject(&table, record->ptr, op->id);
+                break;
+            case TRACE_FREE:
+                op->id = removeObject(&table, record->ptr);
+                break;
+            case TRACE_REALLOC:
+                // The object keeps its ID, unless it was allocated before the trace started.
+                op->id = removeObject(&table, record->arg);
+                if (op->id == 0) {
+                    op->id = nextId++;
+                }
+                insertObject(&table, record->ptr, op->id);
+                break;
+            default:
+                op->id = 0;
+        }
+        if (op->id == 0) {
+            skipped++;
+        } else {
+            opCount++;
+        }
+    }
+    if (skipped > 0) {
+        fprintf(stderr, "Skipped %llu operations on objects allocated before the trace started\n",
+                (unsigned long long)skipped);
+    }
+    munmap(table.keys, tableSize * sizeof(uint64_t));
+    munmap(table.ids, tableSize * sizeof(uint32_t));
+    munmap(mapping, fileStat.st_size);
+    *opsOut = ops;
+    *objectCount = nextId;
+    return opCount;
+}
+
+// A replay of the operations with one allocator.
+typedef struct ReplayRun {
+    const Allocator* allocator;
+    ReplayOp* ops;
+    uint64_t opCount;
+    uint32_t objectCount;
+    FILE* timeline;
+    uint64_t sampleInterval;
+} ReplayRun;
+
+// Replays the operations with one allocator, and prints a line of results. Runs in its own process.
+static void runReplay(void* arg) {
+    ReplayRun* run = (ReplayRun*)arg;
+    const Allocator* allocator = run->allocator;
+    ReplayOp* ops = run->ops;
+    uint64_t opCount = run->opCount;
+    FILE* timeline = run->timeline;
+    void** objects = mapArray(run->objectCount, sizeof(void*));
+    uint32_t* latencies = mapArray(opCount, sizeof(uint32_t));
+    long baselineRss = readRssKB();
+    uint64_t failures = 0;
+
+    int64_t startNanos = timeInNanos();
+    uint64_t startTicks = readTicks();
+    for (uint64_t i = 0; i < opCount; i++) {
+        ReplayOp* op = &ops[i];
+        void* ptr;
+        uint64_t before = readTicks();
+        switch (op->op) {
+            case TRACE_ALLOC:
+                ptr = objects[op->id] = allocator->alloc(op->size);
+                break;
+            case TRACE_CALLOC:
+                ptr = objects[op->id] = allocator->calloc(1, op->size);
+                break;
+            case TRACE_ALIGN:
+                ptr = objects[op->id] = allocator->align(op->alignment, op->size);
+                break;
+            case TRACE_REALLOC:
+                ptr = allocator->realloc(objects[op->id], op->size);
+                if (ptr != NULL) {
+                    objects[op->id] = ptr;
+                }
+                break;
+            default:
+                ptr = objects[op->id];
+                // The allocation may have failed.
+                if (ptr != NULL) {
+                    allocator->free(ptr);
+                    objects[op->id] = NULL;
+                }
+        }
+        latencies[i] = readTicks() - before;
+        if (op->op != TRACE_FREE) {
+            if (ptr == NULL) {
+                failures++;
+            } else {
+                touchChunk(ptr, op->size);
+            }
+        }
+        if (timeline != NULL && i % run->sampleInterval == 0) {
+            fprintf(timeline, "%s,%llu,%.6f,%ld", allocator->name, (unsigned long long)i,
+                    (timeInNanos() - startNanos) / 1e9, readRssKB() - baselineRss);
+            if (allocator->hasStats) {
+                fprintf(timeline, ",%lld,%lld,%lld\n", (long long)regionsUsed, (long long)freeSpace,
+                        (long long)allocatedSpace);
+            } else {
+                fprintf(timeline, ",,,\n");
+            }
+        }
+    }
+    double seconds = (timeInNanos() - startNanos) / 1e9;
+    double nanosPerTick = seconds * 1e9 / (double)(readTicks() - startTicks);
+
+    LatencySummary summary;
+    summariseLatencies(latencies, opCount, nanosPerTick, &summary);
+    printf("allocator=%s ops=%llu seconds=%.6f opsPerSec=%.0f p50Ns=%.0f p90Ns=%.0f p99Ns=%.0f p999Ns=%.0f maxNs=%.0f "
+            "peakRssKB=%ld failures=%llu\n", allocator->name, (unsigned long long)opCount, seconds, opCount / seconds,
+            summary.p50, summary.p90, summary.p99, summary.p999, summary.max, readPeakRssKB() - baselineRss,
+            (unsigned long long)failures);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv) {
+    const char* which = "both";
+    const char* timelinePath = NULL;
+    uint64_t sampleInterval = 10000;
+    int option;
+    while ((option = getopt(argc, argv, "a:t:s:")) != -1) {
+        switch (option) {
+            case 'a':
+                which = optarg;
+                break;
+            case 't':
+                timelinePath = optarg;
+                break;
+            case 's':
+                sampleInterval = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                optind = argc;
+        }
+    }
+    if (optind != argc - 1 || sampleInterval == 0
+            || (strcmp(which, "vmem") && strcmp(which, "libc") && strcmp(which, "both"))) {
+        fprintf(stderr, "Usage: %s [-a vmem|libc|both] [-t timeline.csv] [-s sample-interval] trace-file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    ReplayOp* ops;
+    uint32_t objectCount;
+    uint64_t opCount = loadTrace(argv[optind], &ops, &objectCount);
+
+    FILE* timeline = NULL;
+    if (timelinePath != NULL) {
+        if ((timeline = fopen(timelinePath, "w")) == NULL) {
+            perror("Failed to open timeline file");
+            return EXIT_FAILURE;
+        }
+        fprintf(timeline, "Allocator,Op,Time(s),RSS(KB),Regions,Free Space,Alloc'd Space\n");
+        fflush(timeline);
+    }
+
+    for (int i = 0; i < NUM_ALLOCATORS; i++) {
+        if ((i == 0 && !strcmp(which, "libc")) || (i == 1 && !strcmp(which, "vmem"))) {
+            continue;
+        }
+        ReplayRun run = {&allocators[i], ops, opCount, objectCount, timeline, sampleInterval};
+        if (runInChild(runReplay, &run)) {
+            fprintf(stderr, "Replay with %s failed\n", allocators[i].name);
+            return EXIT_FAILURE;
+        }
+    }
+    if (timeline != NULL) {
+        fclose(timeline);
+    }
+    return EXIT_SUCCESS;
+}
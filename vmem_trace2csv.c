@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vmemalloc_trace.h"
+
+// Converts a binary trace file written by vmemalloc to the CSV columns of the original text trace.
+// Usage: vmem_trace2csv trace-file [csv-file]
+
+static const char* opNames[TRACE_OP_COUNT] = {
+    "vmemalloc", "vmemfree", "vmemrealloc", "vmemcalloc", "vmemalign", "failed"
+};
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s trace-file [csv-file]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open trace file");
+        return EXIT_FAILURE;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) || (size_t)fileStat.st_size < sizeof(TraceFileHeader)) {
+        fprintf(stderr, "%s is not a trace file\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    void* mapping = mmap(0, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("Failed to map trace file");
+        return EXIT_FAILURE;
+    }
+    TraceFileHeader* header = (TraceFileHeader*)mapping;
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION || header->recordSize != sizeof(TraceRecord)
+            || sizeof(TraceFileHeader) + header->capacity * sizeof(TraceRecord) > (size_t)fileStat.st_size) {
+        fprintf(stderr, "%s is not a trace file of version %d\n", argv[1], TRACE_VERSION);
+        return EXIT_FAILURE;
+    }
+    FILE* out = stdout;
+    if (argc == 3 && (out = fopen(argv[2], "w")) == NULL) {
+        perror("Failed to open CSV file");
+        return EXIT_FAILURE;
+    }
+
+    // Work out the tick rate from the two times recorded in both units.
+    double nanosPerTick = 1.0;
+    if (header->endNanos > header->startNanos && header->endTicks > header->startTicks) {
+        nanosPerTick = (double)(header->endNanos - header->startNanos) / (header->endTicks - header->startTicks);
+    } else {
+        fprintf(stderr, "Trace was not closed, so times are in ticks instead of microseconds\n");
+        nanosPerTick = 1000.0;
+    }
+
+    // Once the ring has wrapped, the oldest record kept is the one after the newest.
+    TraceRecord* records = (TraceRecord*)(header + 1);
+    uint64_t count = header->nextRecord < header->capacity ? header->nextRecord : header->capacity;
+    uint64_t first = header->nextRecord - count;
+    if (first > 0) {
+        fprintf(stderr, "Trace ring wrapped: the first %llu operations were overwritten\n", (unsigned long long)first);
+    }
+
+    fprintf(out, "Function,Time(us),Alloc'd Space,Alloc'd Chunks,Free Space,Free Chunks,Regions\n");
+    for (uint64_t i = first; i < header->nextRecord; i++) {
+        TraceRecord* record = &records[i & (header->capacity - 1)];
+        const char* op = record->op < TRACE_OP_COUNT ? opNames[record->op] : "unknown";
+        long micros = (long)((int64_t)(record->ticks - header->startTicks) * nanosPerTick / 1000);
+        fprintf(out, "%s,%ld,%lld,%lld,%lld,%lld,%lld\n", op, micros, (long long)record->allocatedSpace,
+                (long long)record->allocatedChunkCount, (long long)record->freeSpace,
+                (long long)record->freeChunkCount, (long long)record->regionsUsed);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    munmap(mapping, fileStat.st_size);
+    return EXIT_SUCCESS;
+}
@@ -1,56 +1,489 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
 #include "vmemalloc.h"
 #include "vmemalloc_large.h"
 #include "vmemalloc_small.h"
+#include "vmemalloc_pagemap.h"
+#include "vmemalloc_thread.h"
+#include "vmemalloc_huge.h"
+#include "vmemalloc_profile.h"
+#include "vmemalloc_latency.h"
 
-#define VMEMALLOC_OP "vmemalloc"
-#define VMEMFREE_OP "vmemfree"
+// Records an operation on a chunk in the trace file, if tracing is on.
+#define TRACE(op, ptr, size, arg) do { \
+        if (TRACING()) { \
+            traceChunk((op), (ptr), (size), (arg)); \
+        } \
+    } while (0)
 
-/*  Allocate 'size' bytes of memory. On success the function returns a pointer to 
-    the start of the allocated region. On failure NULL is returned. */
-void* vmemalloc(int size) {
-    if (size <= 0) {
-        fprintf(stderr, "size passed to vmemalloc was too small (%d)\n", size);
-        return NULL;
+// Gets a chunk from the small, large or huge allocator, depending on its size.
+// If zeroed isn't NULL, it is set to true if the chunk is known to be filled with zeros.
+void* allocChunk(size_t size, Word* zeroed) {
+    if (zeroed != NULL) {
+        *zeroed = false;
     }
     void* chunk;
     // Treat small chunks differently.
     if (size < SMALL_CHUNK_LIMIT) {
-        chunk = vmemallocSmall(size);
+        Word start = LATENCY_START();
+        chunk = vmemallocSmall((int)size);
+        LATENCY_END(VMEM_LATENCY_SMALL_ALLOC, start);
         if (chunk == NULL) {
-            fprintf(stderr, "error in vmemallocSmall(%i)\n", size);
-            return NULL;
+            fprintf(stderr, "error in vmemallocSmall(%zu)\n", size);
+        }
+    } else if (size < hugeChunkThreshold) {
+        Word start = LATENCY_START();
+        chunk = vmemallocLarge(size, zeroed);
+        LATENCY_END(VMEM_LATENCY_LARGE_ALLOC, start);
+        if (chunk == NULL) {
+            fprintf(stderr, "error in vmemallocLarge(%zu)\n", size);
         }
     } else {
-        chunk = vmemallocLarge(size);
+        chunk = vmemallocHuge(size);
         if (chunk == NULL) {
-            fprintf(stderr, "error in vmemallocLarge(%d)\n", size);
-            return NULL;
+            fprintf(stderr, "error in vmemallocHuge(%zu)\n", size);
+        } else if (zeroed != NULL) {
+            // Huge chunks always have a fresh mapping.
+            *zeroed = true;
         }
     }
-    allocatedChunkCount++;
-    outputTraceData(VMEMALLOC_OP);
     return chunk;
 }
 
+// Returns a chunk to the allocator that owns it, which is given by the page map entry of the chunk.
+// Returns the amount of space freed, or 0 on error.
+Word freeChunk(void* ptr, PageMapEntry owner) {
+    Word spaceFreed;
+    Word start;
+    switch (GET_PAGE_KIND(owner)) {
+        case PAGE_CONTAINER:
+            start = LATENCY_START();
+            spaceFreed = vmemfreeSmall(GET_PAGE_OWNER(owner), ptr);
+            LATENCY_END(VMEM_LATENCY_SMALL_FREE, start);
+            if (spaceFreed == 0) {
+                fprintf(stderr, "error in vmemfreeSmall(%p)\n", ptr);
+                return 0;
+            }
+            break;
+        case PAGE_LARGE:
+            start = LATENCY_START();
+            spaceFreed = vmemfreeLarge(ptr);
+            LATENCY_END(VMEM_LATENCY_LARGE_FREE, start);
+            if (spaceFreed == 0) {
+                fprintf(stderr, "error in vmemfreeLarge(%p)\n", ptr);
+                return 0;
+            }
+            break;
+        case PAGE_HUGE:
+            spaceFreed = vmemfreeHuge(ptr);
+            if (spaceFreed == 0) {
+                fprintf(stderr, "error in vmemfreeHuge(%p)\n", ptr);
+                return 0;
+            }
+            break;
+        default:
+            fprintf(stderr, "pointer passed to vmemfree was not allocated by vmemalloc (%p)\n", ptr);
+            return 0;
+    }
+    return spaceFreed;
+}
+
+// The number of bytes that can be used in an allocated chunk.
+Word getChunkSize(void* ptr, PageMapEntry owner) {
+    if (GET_PAGE_KIND(owner) == PAGE_CONTAINER) {
+        return 1 << ((ContainerHeader*)GET_PAGE_OWNER(owner))->bin;
+    }
+    return GET_SIZE(ptr - sizeof(ChunkHeader));
+}
+
+// The bin of an allocated chunk for the trace: the small bin of a container chunk, or the
+// bin * NUM_SUB_BINS + sub-bin of a large chunk.
+int getTraceBin(void* ptr, PageMapEntry owner) {
+    switch (GET_PAGE_KIND(owner)) {
+        case PAGE_CONTAINER:
+            return ((ContainerHeader*)GET_PAGE_OWNER(owner))->bin;
+        case PAGE_LARGE: {
+            int bin, subBin;
+            getBin(GET_SIZE(ptr - sizeof(ChunkHeader)), &bin, &subBin);
+            return bin * NUM_SUB_BINS + subBin;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Records an operation that returned ptr in the trace file.
+void traceChunk(TraceOp op, void* ptr, Word size, Word arg) {
+    PageMapEntry owner = getPageOwner(ptr);
+    recordTrace(op, ptr, size, arg, GET_PAGE_KIND(owner), getTraceBin(ptr, owner));
+}
+
+// Fills in the record claimed for a free, or marks it failed if nothing was freed.
+static void traceFree(uint64_t index, void* ptr, Word spaceFreed, int kind, int bin) {
+    if (spaceFreed == 0) {
+        writeTrace(index, TRACE_FAILED, NULL, 0, (Word)ptr, kind, bin);
+    } else {
+        writeTrace(index, TRACE_FREE, ptr, spaceFreed, 0, kind, bin);
+    }
+}
+
+/*  Allocate 'size' bytes of memory. On success the function returns a pointer to 
+    the start of the allocated region. On failure NULL is returned. */
+void* vmemalloc(size_t size) {
+    if (size == 0) {
+        fprintf(stderr, "size passed to vmemalloc was too small (%zu)\n", size);
+        return NULL;
+    }
+    Word start = LATENCY_START();
+    void* chunk = allocChunk(size, NULL);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    STAT_ADD(allocatedChunkCount, 1);
+    TRACE(TRACE_ALLOC, chunk, size, 0);
+    PROFILE_ALLOC(chunk, size);
+    LATENCY_END(VMEM_LATENCY_ALLOC, start);
+    return chunk;
+}
+
+// Frees a chunk whose owner has been looked up in the page map, recording the free since 'start'.
+static void freeOwnedChunk(void* ptr, PageMapEntry owner, Word start) {
+    // Find the bin before the chunk is freed, as its container may be unmapped.
+    Word traced = TRACING();
+    int bin = traced ? getTraceBin(ptr, owner) : 0;
+    // Forget the sample and claim the trace record first, as another thread may get the same address
+    // once the chunk is freed.
+    uint64_t traceIndex = traced ? claimTrace() : 0;
+    PROFILE_FREE(ptr);
+    Word spaceFreed = freeChunk(ptr, owner);
+    if (spaceFreed != 0) {
+        STAT_SUB(allocatedChunkCount, 1);
+    }
+    if (traced) {
+        traceFree(traceIndex, ptr, spaceFreed, GET_PAGE_KIND(owner), bin);
+    }
+    LATENCY_END(VMEM_LATENCY_FREE, start);
+}
+
 /*  Release the region of memory pointed to by 'ptr'. */
 void vmemfree(void* ptr) {
     if (ptr == NULL) {
         fprintf(stderr, "pointer passed to vmemfree was NULL\n");
         return;
     }
-    int spaceFreed = vmemfreeSmall(ptr);
-    if (spaceFreed < 0) {
-        fprintf(stderr, "error in vmemfreeSmall(%p)\n", ptr);
+    Word start = LATENCY_START();
+    // The page map says which allocator owns the chunk.
+    freeOwnedChunk(ptr, getPageOwner(ptr), start);
+}
+
+/*  Release the chunk pointed to by 'ptr' if vmemalloc allocated it. Returns 1 if it was freed, and
+    0 for NULL and pointers the page map doesn't know. */
+int vmemfree_owned(void* ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    Word start = LATENCY_START();
+    PageMapEntry owner = getPageOwner(ptr);
+    if (GET_PAGE_KIND(owner) == PAGE_FOREIGN) {
+        return 0;
+    }
+    freeOwnedChunk(ptr, owner, start);
+    return 1;
+}
+
+/*  Release the chunk pointed to by 'ptr', which was allocated with 'size' bytes by vmemalloc,
+    vmemcalloc (with the total size) or vmemrealloc. */
+void vmemfree_sized(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        fprintf(stderr, "pointer passed to vmemfree_sized was NULL\n");
         return;
     }
-    // vmemfreeSmall returns 0 if the chunk is not a small chunk.
-    if (spaceFreed == 0) {
-        spaceFreed = vmemfreeLarge(ptr);
-        if (spaceFreed <= 0) {
-            fprintf(stderr, "error in vmemfreeLarge(%p)\n", ptr);
+    // Frees passed on to vmemfree are recorded there.
+    if (size == 0 || size >= SMALL_CHUNK_LIMIT) {
+#ifdef VMEM_CHECK_SIZED_FREE
+        if (vmemusablesize(ptr) < size) {
+            fprintf(stderr, "size passed to vmemfree_sized is bigger than the chunk (%p, %zu)\n", ptr, size);
             return;
         }
+#endif
+        // Large and huge chunks are told apart by the page map, as the huge chunk threshold can change.
+        vmemfree(ptr);
+        return;
+    }
+    Word start = LATENCY_START();
+    // Small chunks skip the page map, as their container is found from the address alone.
+    ContainerHeader* container = GET_CONTAINER(ptr);
+#ifdef VMEM_CHECK_SIZED_FREE
+    PageMapEntry owner = getPageOwner(ptr);
+    if (GET_PAGE_KIND(owner) != PAGE_CONTAINER || (ContainerHeader*)GET_PAGE_OWNER(owner) != container
+            || getSmallBin((int)size) > container->bin) {
+        fprintf(stderr, "size passed to vmemfree_sized doesn't match the chunk (%p, %zu)\n", ptr, size);
+        return;
+    }
+#endif
+    // Find the bin before the chunk is freed, as its container may be unmapped.
+    int bin = container->bin;
+    Word traced = TRACING();
+    uint64_t traceIndex = traced ? claimTrace() : 0;
+    PROFILE_FREE(ptr);
+    Word smallStart = LATENCY_START();
+    Word spaceFreed = vmemfreeSmall(container, ptr);
+    LATENCY_END(VMEM_LATENCY_SMALL_FREE, smallStart);
+    if (spaceFreed == 0) {
+        fprintf(stderr, "error in vmemfreeSmall(%p)\n", ptr);
+    } else {
+        STAT_SUB(allocatedChunkCount, 1);
+    }
+    if (traced) {
+        traceFree(traceIndex, ptr, spaceFreed, PAGE_CONTAINER, bin);
+    }
+    LATENCY_END(VMEM_LATENCY_FREE, start);
+}
+
+/*  Allocate 'count' chunks of 'size' bytes each, storing them in 'ptrs'. Returns the number of
+    chunks allocated, which is less than 'count' if memory ran out. */
+size_t vmemalloc_batch(size_t size, size_t count, void** ptrs) {
+    if (size == 0 || ptrs == NULL) {
+        fprintf(stderr, "arguments passed to vmemalloc_batch were invalid (%zu, %p)\n", size, (void*)ptrs);
+        return 0;
+    }
+    size_t allocated;
+    if (size < SMALL_CHUNK_LIMIT) {
+        allocated = vmemallocSmallBatch((int)size, count, ptrs);
+    } else if (size < hugeChunkThreshold) {
+        allocated = vmemallocLargeBatch(size, count, ptrs);
+    } else {
+        // Every huge chunk has its own mapping, so there is nothing to share.
+        for (allocated = 0; allocated < count; allocated++) {
+            ptrs[allocated] = vmemallocHuge(size);
+            if (ptrs[allocated] == NULL) {
+                break;
+            }
+        }
     }
-    allocatedChunkCount--;
-    outputTraceData(VMEMFREE_OP);
+    if (allocated < count) {
+        fprintf(stderr, "vmemalloc_batch only allocated %zu of %zu chunks of %zu bytes\n", allocated, count, size);
+    }
+    STAT_ADD(allocatedChunkCount, (int64_t)allocated);
+    if (TRACING()) {
+        for (size_t i = 0; i < allocated; i++) {
+            traceChunk(TRACE_ALLOC, ptrs[i], size, 0);
+        }
+    }
+    if (profileSampleRate != 0) {
+        for (size_t i = 0; i < allocated; i++) {
+            PROFILE_ALLOC(ptrs[i], size);
+        }
+    }
+    return allocated;
+}
+
+// Orders pointers by address for vmemfree_batch.
+static int comparePointers(const void* a, const void* b) {
+    Word left = *(Word*)a;
+    Word right = *(Word*)b;
+    return (left > right) - (left < right);
+}
+
+/*  Release the 'count' chunks in 'ptrs', which is left sorted by address. */
+void vmemfree_batch(void** ptrs, size_t count) {
+    if (ptrs == NULL) {
+        fprintf(stderr, "array passed to vmemfree_batch was NULL\n");
+        return;
+    }
+    if (TRACING()) {
+        // The trace needs the bin and size of every chunk, so free them one at a time.
+        for (size_t i = 0; i < count; i++) {
+            vmemfree(ptrs[i]);
+        }
+        return;
+    }
+    if (STAT_GET(profileSampleCount) != 0) {
+        for (size_t i = 0; i < count; i++) {
+            PROFILE_FREE(ptrs[i]);
+        }
+    }
+    // Chunks of the same container, and neighbouring large chunks, end up next to each other.
+    qsort(ptrs, count, sizeof(void*), comparePointers);
+    size_t freed = 0;
+    size_t i = 0;
+    while (i < count) {
+        if (ptrs[i] == NULL || (i > 0 && ptrs[i] == ptrs[i - 1])) {
+            fprintf(stderr, "pointer passed to vmemfree_batch was NULL or repeated (%p)\n", ptrs[i]);
+            i++;
+            continue;
+        }
+        PageMapEntry owner = getPageOwner(ptrs[i]);
+        size_t end = i + 1;
+        switch (GET_PAGE_KIND(owner)) {
+            case PAGE_CONTAINER: {
+                // Containers are aligned to their size, so the rest of its chunks share the same base.
+                Word region = (Word)ptrs[i] & ~(Word)(CONTAINER_REGION_SIZE - 1);
+                while (end < count && ((Word)ptrs[end] & ~(Word)(CONTAINER_REGION_SIZE - 1)) == region
+                        && ptrs[end] != ptrs[end - 1]) {
+                    end++;
+                }
+                freed += vmemfreeSmallBatch((ContainerHeader*)GET_PAGE_OWNER(owner), ptrs + i, end - i);
+                break;
+            }
+            case PAGE_LARGE:
+                while (end < count && ptrs[end] != ptrs[end - 1] && GET_PAGE_KIND(getPageOwner(ptrs[end])) == PAGE_LARGE) {
+                    end++;
+                }
+                freed += vmemfreeLargeBatch(ptrs + i, end - i);
+                break;
+            default:
+                freed += freeChunk(ptrs[i], owner) != 0;
+                break;
+        }
+        i = end;
+    }
+    STAT_SUB(allocatedChunkCount, (int64_t)freed);
+}
+
+/*  Resize the chunk pointed to by 'ptr' to 'size' bytes. */
+void* vmemrealloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return vmemalloc(size);
+    }
+    if (size == 0) {
+        vmemfree(ptr);
+        return NULL;
+    }
+    PageMapEntry owner = getPageOwner(ptr);
+    if (GET_PAGE_KIND(owner) == PAGE_FOREIGN) {
+        fprintf(stderr, "pointer passed to vmemrealloc was not allocated by vmemalloc (%p)\n", ptr);
+        return NULL;
+    }
+    // The chunk is sampled again (or not) at its new size. Like a free, the trace record is claimed and
+    // the sample set aside before the chunk can be released, but the sample is only dropped once the
+    // resize has succeeded, as the old chunk is still live if it fails.
+    Word traced = TRACING();
+    uint64_t traceIndex = traced ? claimTrace() : 0;
+    void* sample = PROFILE_DETACH(ptr);
+    void* newPtr;
+    if (GET_PAGE_KIND(owner) == PAGE_CONTAINER && size < SMALL_CHUNK_LIMIT && size <= getChunkSize(ptr, owner)) {
+        // Still fits in its slot.
+        newPtr = ptr;
+    } else if (GET_PAGE_KIND(owner) == PAGE_LARGE && size >= SMALL_CHUNK_LIMIT && size < hugeChunkThreshold
+            && resizeLargeInPlace(ptr, size)) {
+        // Grown into the next chunk or shrunk by freeing the end.
+        newPtr = ptr;
+    } else if (GET_PAGE_KIND(owner) == PAGE_HUGE && size >= hugeChunkThreshold) {
+        // Huge chunks stay huge, and the kernel moves their pages instead of copying them.
+        newPtr = vmemreallocHuge(ptr, size);
+        if (newPtr == NULL) {
+            fprintf(stderr, "error in vmemreallocHuge(%p, %zu)\n", ptr, size);
+        }
+    } else {
+        newPtr = allocChunk(size, NULL);
+        if (newPtr != NULL) {
+            Word oldSize = getChunkSize(ptr, owner);
+            memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+            freeChunk(ptr, owner);
+        }
+    }
+    if (newPtr == NULL) {
+        PROFILE_REATTACH(sample, 1);
+        if (traced) {
+            writeTrace(traceIndex, TRACE_FAILED, NULL, size, (Word)ptr, GET_PAGE_KIND(owner), 0);
+        }
+        return NULL;
+    }
+    PROFILE_REATTACH(sample, 0);
+    if (traced) {
+        PageMapEntry newOwner = getPageOwner(newPtr);
+        writeTrace(traceIndex, TRACE_REALLOC, newPtr, size, (Word)ptr, GET_PAGE_KIND(newOwner),
+            getTraceBin(newPtr, newOwner));
+    }
+    PROFILE_ALLOC(newPtr, size);
+    return newPtr;
+}
+
+/*  Allocate an array of 'count' elements of 'size' bytes, filled with zeros.
+    On failure NULL is returned. */
+void* vmemcalloc(size_t count, size_t size) {
+    size_t totalSize;
+    if (count == 0 || size == 0 || __builtin_mul_overflow(count, size, &totalSize)) {
+        fprintf(stderr, "size passed to vmemcalloc was invalid (%zu * %zu)\n", count, size);
+        return NULL;
+    }
+    Word zeroed;
+    void* chunk = allocChunk(totalSize, &zeroed);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    // Fresh mappings are already zero, so only reused memory needs clearing.
+    if (!zeroed) {
+        memset(chunk, 0, totalSize);
+    }
+    STAT_ADD(allocatedChunkCount, 1);
+    TRACE(TRACE_CALLOC, chunk, totalSize, 0);
+    PROFILE_ALLOC(chunk, totalSize);
+    return chunk;
+}
+
+/*  Allocate 'size' bytes of memory at an address that is a multiple of 'alignment', which must be
+    a power of two. On failure NULL is returned. */
+void* vmemalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        fprintf(stderr, "alignment passed to vmemalign was not a power of two (%zu)\n", alignment);
+        return NULL;
+    }
+    if (size == 0) {
+        fprintf(stderr, "size passed to vmemalign was too small (%zu)\n", size);
+        return NULL;
+    }
+    void* chunk;
+    if (alignment <= LARGEST_ALIGNMENT) {
+        // Every chunk is aligned to LARGEST_ALIGNMENT or its own size, whichever is smaller.
+        chunk = allocChunk(size > alignment ? size : alignment, NULL);
+    } else {
+        // Split an aligned chunk out of a larger free chunk, even if the size is huge.
+        chunk = vmemallocLargeAligned(alignment, size);
+        if (chunk == NULL) {
+            fprintf(stderr, "error in vmemallocLargeAligned(%zu, %zu)\n", alignment, size);
+        }
+    }
+    if (chunk == NULL) {
+        return NULL;
+    }
+    STAT_ADD(allocatedChunkCount, 1);
+    TRACE(TRACE_ALIGN, chunk, size, alignment);
+    PROFILE_ALLOC(chunk, size);
+    return chunk;
+}
+
+/*  Like posix_memalign: 'alignment' must be a power of two multiple of sizeof(void*).
+    Returns 0 and sets '*ptr' on success, or EINVAL or ENOMEM on failure. */
+int vmemposixalign(void** ptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* chunk = vmemalign(alignment, size > 0 ? size : 1);
+    if (chunk == NULL) {
+        return ENOMEM;
+    }
+    *ptr = chunk;
+    return 0;
+}
+
+/*  The number of bytes that can be used in the chunk pointed to by 'ptr', or 0 if 'ptr' is NULL or
+    wasn't allocated by vmemalloc. */
+size_t vmemusablesize(void* ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    PageMapEntry owner = getPageOwner(ptr);
+    if (GET_PAGE_KIND(owner) == PAGE_FOREIGN) {
+        return 0;
+    }
+    return getChunkSize(ptr, owner);
+}
+
+/*  Allocations of at least 'size' bytes get their own mapping. */
+void setHugeChunkThreshold(size_t size) {
+    hugeChunkThreshold = size > SMALL_CHUNK_LIMIT ? size : SMALL_CHUNK_LIMIT;
 }
@@ -1,7 +1,6 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <math.h>
 #include <limits.h>
 
 #include "logger.h"
@@ -12,6 +11,11 @@ typedef uintptr_t Word;
 // Rounds up to a multiple.
 #define CEIL(x, multiple) (((((x) - 1) / (multiple)) + 1) * (multiple))
 
+// Bit scans on a Word. Results are undefined if word is 0.
+#define COUNT_TRAILING_ZEROS(word) __builtin_ctzl(word)
+#define COUNT_LEADING_ZEROS(word) __builtin_clzl(word)
+#define COUNT_SET_BITS(word) __builtin_popcountl(word)
+
 #define SMALL_CHUNK_LIMIT_POWER 5
 // chunks smaller than this are treated differently to minimise header size.
 #define SMALL_CHUNK_LIMIT (1 << SMALL_CHUNK_LIMIT_POWER)
@@ -32,18 +36,317 @@ typedef uintptr_t Word;
 
 /*	Allocate 'size' bytes of memory. On success the function returns a pointer to 
 	the start of the allocated region. On failure NULL is returned. */
-extern void *vmemalloc(int size);
+extern void *vmemalloc(size_t size);
 
 /*	Release the region of memory pointed to by 'ptr'. */
 extern void vmemfree(void *ptr);
 
+/*	Release the region of memory pointed to by 'ptr', which was allocated with 'size' bytes by
+	vmemalloc, vmemcalloc (with the total size) or vmemrealloc, but not vmemalign. Small regions are
+	found without looking 'ptr' up. Building with VMEM_CHECK_SIZED_FREE defined checks that 'size'
+	matches the region, and reports and ignores the call if it doesn't. */
+extern void vmemfree_sized(void *ptr, size_t size);
+
+/*	Release the region of memory pointed to by 'ptr' if vmemalloc allocated it, with a single page
+	map lookup. Returns 1 if it was freed, and 0 without reporting an error for NULL and pointers
+	vmemalloc doesn't know, so that callers can pass those on to another allocator or ignore them. */
+extern int vmemfree_owned(void *ptr);
+
+/*	Allocate 'count' regions of 'size' bytes each, storing them in 'ptrs'. Same-size chunks are
+	claimed together, so this is cheaper than calling vmemalloc 'count' times. Returns the number
+	of regions allocated, which is less than 'count' if memory ran out. */
+extern size_t vmemalloc_batch(size_t size, size_t count, void **ptrs);
+
+/*	Release the 'count' regions of memory in 'ptrs'. The array is sorted by address, so the chunks
+	of each container or region are released together. */
+extern void vmemfree_batch(void **ptrs, size_t count);
+
+/*	Resize the region of memory pointed to by 'ptr' to 'size' bytes, moving it if necessary.
+	The contents are kept up to the smaller of the old and new sizes. If 'ptr' is NULL this is the
+	same as vmemalloc, and if 'size' is 0 the region is released and NULL is returned. On failure
+	NULL is returned and the original region is unchanged. */
+extern void *vmemrealloc(void *ptr, size_t size);
+
+/*	Allocate an array of 'count' elements of 'size' bytes each, filled with zeros. Memory that is 
+	freshly mapped is known to be zero and is not cleared again. On failure, including when the 
+	total size overflows, NULL is returned. */
+extern void *vmemcalloc(size_t count, size_t size);
+
+/*	Allocate 'size' bytes of memory at an address that is a multiple of 'alignment', which must be
+	a power of two. Alignments above sizeof(long double) are carved out of free space in existing
+	regions. The result is released with vmemfree. On failure NULL is returned. */
+extern void *vmemalign(size_t alignment, size_t size);
+
+/*	posix_memalign-style version of vmemalign. 'alignment' must be a power of two multiple of
+	sizeof(void *). Returns 0 and sets '*ptr' on success, or EINVAL or ENOMEM on failure. */
+extern int vmemposixalign(void **ptr, size_t alignment, size_t size);
+
+/*	The number of bytes that can be used in the region pointed to by 'ptr', which is at least the
+	size requested. Returns 0 if 'ptr' is NULL or wasn't allocated by vmemalloc. */
+extern size_t vmemusablesize(void *ptr);
+
+/*	An arena hands out memory by bumping a pointer through large blocks, and frees it all at once.
+	Objects from an arena have no headers and can't be freed one at a time, so they must not be
+	passed to vmemfree or vmemrealloc. An arena must only be used by one thread at a time. */
+typedef struct VmemArena VmemArena;
+
+/*	Create an arena which takes blocks of 'blockSize' bytes from the allocator, or 64KB if
+	'blockSize' is 0. On failure NULL is returned. */
+extern VmemArena *vmemarena_create(size_t blockSize);
+
+/*	Allocate 'size' bytes from 'arena', aligned like vmemalloc. Objects bigger than a quarter of
+	the block size get a block of their own. On failure NULL is returned. */
+extern void *vmemarena_alloc(VmemArena *arena, size_t size);
+
+/*	Free every object allocated from 'arena'. The blocks used since the last reset are kept for
+	reuse, and the rest (including the blocks of big objects) are given back. */
+extern void vmemarena_reset(VmemArena *arena);
+
+/*	Free every object allocated from 'arena', and the arena itself. */
+extern void vmemarena_destroy(VmemArena *arena);
+
+/*	A pool hands out objects of one size from blocks taken from the allocator. Freed objects go on
+	a free list threaded through the objects themselves and are reused last in, first out, so an
+	allocation or a free is a few instructions. A pool must only be used by one thread at a time. */
+typedef struct VmemPool VmemPool;
+
+/*	Counters of a pool, filled by vmempool_stats. */
+typedef struct VmemPoolStats {
+	/* Size of each object (rounded up to the alignment) and of each block. */
+	uint64_t objectSize;
+	uint64_t blockSize;
+	uint64_t blocks;
+	uint64_t objectsInUse;
+	uint64_t peakObjectsInUse;
+	/* Calls to vmempool_alloc and vmempool_free since the pool was created. */
+	uint64_t allocs;
+	uint64_t frees;
+	/* Blocks given back by vmempool_shrink. */
+	uint64_t blocksReleased;
+} VmemPoolStats;
+
+/*	Create a pool of objects of 'objectSize' bytes at a multiple of 'alignment', which must be a
+	power of two, or 0 to align like vmemalloc. Objects can be up to 64KB. On failure NULL is
+	returned. */
+extern VmemPool *vmempool_create(size_t objectSize, size_t alignment);
+
+/*	Allocate an object from 'pool'. On failure NULL is returned. */
+extern void *vmempool_alloc(VmemPool *pool);
+
+/*	Return an object to the pool it was allocated from. It must not be passed to vmemfree. */
+extern void vmempool_free(VmemPool *pool, void *ptr);
+
+/*	Give back every block of 'pool' with no objects in use. Returns the number of bytes released. */
+extern size_t vmempool_shrink(VmemPool *pool);
+
+/*	Fill 'stats' with the counters of 'pool'. Returns 0, or -1 if the counters aren't built in
+	(VMEM_NO_STATS), in which case only the sizes and the number of blocks are filled. */
+extern int vmempool_stats(VmemPool *pool, VmemPoolStats *stats);
+
+/*	Free every object allocated from 'pool', and the pool itself. */
+extern void vmempool_destroy(VmemPool *pool);
+
 /*	Set the file specified by the 'file' parameter as the target for trace data. 
-	If 'file' does not exist it will be created. 
+	If 'file' does not exist it will be created, and if it does it is overwritten. The file is a
+	binary ring of the most recent operations, converted to CSV by vmem_trace2csv.
 	If this function is not called then no trace output should be generated.*/
 extern void setTraceFile(char *file);
 
-/*	Initialise the timing mechanism. */
+/*	Set the number of operations kept in the trace file, rounded up to a power of two. Must be
+	called before setTraceFile. Defaults to 2^20. */
+extern void setTraceCapacity(int records);
+
+/*	Initialise the timing mechanism. Trace times are measured from this call. */
 extern void setupTimer(void);
 
 /* Closes the trace file in use. Should be called at the end of execution. */
 extern void closeTraceFile();
+
+/*	Empty regions are kept for reuse until they total more than 'maxBytes', or have been kept
+	for 'decayMillis' milliseconds. Setting either to 0 stops regions from being kept. */
+extern void setRegionCacheLimits(size_t maxBytes, int decayMillis);
+
+/*	Free large chunks have the pages inside them given back to the kernel once 'freedBytes' bytes
+	have been freed since the last time, if at least 'delayMillis' milliseconds have passed. The
+	chunks stay free, and fault their pages back in when they are reused. Setting 'freedBytes' to 0
+	only releases pages when vmemtrim is called. Defaults to 16MB and 1 second. */
+extern void setScavengeLimits(size_t freedBytes, int delayMillis);
+
+/*	Give the pages of every free large chunk and every cached region back to the kernel now. The
+	large chunks cached by the calling thread are returned to the bins first. Returns the number of
+	bytes released. */
+extern size_t vmemtrim(void);
+
+/*	Regions of large chunks are committed from 'bytes' of address space reserved at a time, growing
+	in place as the heap grows so that they can be coalesced across. 0 maps every region on its own,
+	as does any region needing more than a quarter of a reservation. Defaults to 64MB. */
+extern void setRegionReservation(size_t bytes);
+
+/*	Flags for vmemreserve. */
+#define VMEM_RESERVE_POPULATE 0x1
+#define VMEM_RESERVE_PIN 0x2
+/*	Also create containers for small bin 'bin', which holds chunks of 2^bin bytes. */
+#define VMEM_RESERVE_SMALL(bin) (0x100 << (bin))
+
+/*	Map 'bytes' of memory ahead of time, so that a program's first allocations don't have to. The
+	memory is added to the free large chunks, or shared equally between them and containers for each
+	small bin chosen with VMEM_RESERVE_SMALL (which go to the calling thread in the thread-safe build).
+	VMEM_RESERVE_POPULATE faults the pages in as well. The memory is freed like any other once the
+	heap is empty, unless VMEM_RESERVE_PIN is given, in which case it is never unmapped or released by
+	the scavenger. Needs region reservations and huge page mode off. Returns 0 on success, or -1. */
+extern int vmemreserve(size_t bytes, int flags);
+
+/*	Allocations of at least 'size' bytes each get their own mapping, which is resized in place
+	by vmemrealloc. Defaults to 1MB. */
+extern void setHugeChunkThreshold(size_t size);
+
+/*	Modes for setHugePageMode. */
+#define VMEM_HUGE_PAGES_OFF 0
+#define VMEM_HUGE_PAGES_TRANSPARENT 1
+#define VMEM_HUGE_PAGES_HUGETLB 2
+
+/*	Sets how memory is mapped. VMEM_HUGE_PAGES_TRANSPARENT aligns regions and huge chunks to 2MB and
+	asks for transparent huge pages, and packs containers into 2MB slabs. VMEM_HUGE_PAGES_HUGETLB takes
+	regions from the reserved hugetlbfs pool as well, using transparent huge pages once it runs out.
+	The mode can only be changed while nothing is allocated. Returns 0 on success, or -1. */
+extern int setHugePageMode(int mode);
+
+/*	Map regions and huge chunks with MAP_NORESERVE if 'enabled' is true. Allocations bigger than the
+	free memory then succeed, and the program is killed if it touches more pages than the kernel can
+	find. Off by default, so such allocations return NULL. Only affects new mappings. */
+extern void setMapNoReserve(int enabled);
+
+/*	Average number of bytes allocated between samples suggested for setProfileSampleRate. */
+#define VMEM_PROFILE_DEFAULT_RATE (512 * 1024)
+
+/*	Sample an allocation about once every 'bytes' bytes allocated (at random, so the cost doesn't
+	depend on how often the program allocates), recording a backtrace of each sampled chunk until it
+	is freed. 0 stops sampling, but keeps the samples of chunks that are still allocated. Returns 0,
+	or -1 if the profiler isn't built in (VMEM_NO_STATS). */
+extern int setProfileSampleRate(size_t bytes);
+
+/*	Write the sampled chunks that are still allocated to 'path' as a heap profile, which pprof reads
+	and scales up to estimate the whole heap. Returns 0 on success, or -1. */
+extern int vmemprofile_dump(const char *path);
+
+/*	Write a heap profile to 'path' every time the process receives 'signal'. If the handler
+	interrupts a change to the samples, the profile is written by the next sampled allocation or
+	free instead. Returns 0 on success, or -1. */
+extern int vmemprofile_dump_on_signal(int signal, const char *path);
+
+/*	Version of the VmemStats layout. Fields are only ever added to the end of the struct. */
+#define VMEM_STATS_VERSION 3
+
+/*	Number of bins of free large chunks. Bin n holds chunks of 2^n to 2^(n + 1) - 1 bytes. */
+#define VMEM_STATS_LARGE_BINS (sizeof(void *) * CHAR_BIT)
+
+/*	Number of bins of small chunks. Bin n holds chunks of 2^n bytes. */
+#define VMEM_STATS_SMALL_BINS (SMALL_CHUNK_LIMIT_POWER + 1)
+
+/*	Flag for vmemstats: count the resident bytes of every mapping with mincore. This takes time
+	proportional to the memory mapped and holds the allocator's lock while it runs. */
+#define VMEM_STATS_RESIDENT 0x1
+
+typedef struct VmemLargeBinStats {
+	uint64_t freeChunks;
+	uint64_t freeBytes;
+} VmemLargeBinStats;
+
+typedef struct VmemSmallBinStats {
+	uint64_t chunkSize;
+	uint64_t containers;
+	/* Chunks in all of the containers, and how many of them are in use. */
+	uint64_t chunks;
+	uint64_t chunksInUse;
+} VmemSmallBinStats;
+
+typedef struct VmemStats {
+	/* Set by vmemstats to VMEM_STATS_VERSION and the size of the struct it filled. */
+	uint32_t version;
+	uint32_t size;
+	/* Allocated chunks, in total and of each kind. Small chunks count their whole slot. */
+	uint64_t allocatedBytes;
+	uint64_t allocatedChunks;
+	uint64_t smallAllocatedBytes;
+	uint64_t hugeAllocatedBytes;
+	uint64_t hugeChunks;
+	/* Free large chunks in the bins, free large chunks kept by thread caches, and free
+	   slots in containers of small chunks. */
+	uint64_t freeBytes;
+	uint64_t freeChunks;
+	uint64_t threadCacheBytes;
+	uint64_t smallFreeBytes;
+	/* Regions in use, and empty regions kept mapped for reuse. */
+	uint64_t regions;
+	uint64_t regionCacheBytes;
+	uint64_t regionCacheHits;
+	uint64_t regionCacheMisses;
+	/* Bytes mapped for regions and huge chunks, and for the allocator's own bookkeeping.
+	   residentBytes is only counted with VMEM_STATS_RESIDENT, and is 0 otherwise. */
+	uint64_t mappedBytes;
+	uint64_t metadataBytes;
+	uint64_t residentBytes;
+	/* Calls made to mmap, munmap and mremap since the program started. */
+	uint64_t mmapCalls;
+	uint64_t munmapCalls;
+	uint64_t mremapCalls;
+	/* Fraction of mappedBytes not holding allocated chunks, from 0 to 1. */
+	double fragmentation;
+	VmemLargeBinStats largeBins[VMEM_STATS_LARGE_BINS];
+	VmemSmallBinStats smallBins[VMEM_STATS_SMALL_BINS];
+	/* Added in version 2: bytes mapped from the hugetlbfs pool, and bytes mapped with MADV_HUGEPAGE
+	   (which the kernel backs with huge pages when it can). Both are part of mappedBytes. */
+	uint64_t hugePageBytes;
+	uint64_t transparentHugePageBytes;
+	/* Added in version 3: bytes of free chunks given back to the kernel by the scavenger (counted
+	   again each time a reused chunk is released), and the number of passes it has made. */
+	uint64_t scavengedBytes;
+	uint64_t scavengePasses;
+} VmemStats;
+
+/*	Fill 'stats' with a snapshot of the allocator's counters. The caller sets 'stats->size' to
+	sizeof(VmemStats), and no more than that many bytes are written, so programs built against an
+	older version keep working. Without flags the snapshot only reads counters, so it is cheap to
+	call often, but counters updated by other threads at the same time may not agree exactly.
+	'flags' is 0 or VMEM_STATS_RESIDENT. Returns 0 on success, or -1 if 'stats' is NULL or too
+	small. The counters are all 0 in the VMEM_NO_STATS build. */
+extern int vmemstats(VmemStats *stats, int flags);
+
+/*	Operations timed by the latency histograms. ALLOC and FREE cover whole calls to vmemalloc and
+	vmemfree, SMALL and LARGE cover the allocator doing the work, and NEW_REGION and REMOVE_REGION
+	cover getting and giving back the memory of a region. */
+#define VMEM_LATENCY_ALLOC 0
+#define VMEM_LATENCY_FREE 1
+#define VMEM_LATENCY_SMALL_ALLOC 2
+#define VMEM_LATENCY_SMALL_FREE 3
+#define VMEM_LATENCY_LARGE_ALLOC 4
+#define VMEM_LATENCY_LARGE_FREE 5
+#define VMEM_LATENCY_NEW_REGION 6
+#define VMEM_LATENCY_REMOVE_REGION 7
+#define VMEM_LATENCY_OPS 8
+
+/*	Latency of an operation in nanoseconds. Percentiles are the upper bound of the histogram bucket
+	they fall in, which is at most an eighth above the true value. */
+typedef struct VmemLatencyStats {
+	uint64_t count;
+	double mean;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+} VmemLatencyStats;
+
+/*	Time every operation with the CPU's timestamp counter and keep a histogram for each. Turning
+	tracking on clears the histograms. It adds a few nanoseconds to each call, and nothing while it
+	is off. Returns 0, or -1 if the histograms aren't built in (VMEM_NO_STATS). */
+extern int setLatencyTracking(int enabled);
+
+/*	Fill 'stats' with the latency of 'op' (one of VMEM_LATENCY_ALLOC and so on) since tracking was
+	turned on. The first call may wait up to 10ms to measure the timestamp counter against the clock.
+	Returns 0 on success, or -1. */
+extern int vmemlatency(int op, VmemLatencyStats *stats);
+
+/*	Write every histogram to 'path' as text: a summary line per operation, followed by the range
+	in nanoseconds and count of each bucket that isn't empty. Returns 0 on success, or -1. */
+extern int vmemlatency_dump(const char *path);
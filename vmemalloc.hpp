@@ -0,0 +1,206 @@
+#ifndef VMEMALLOC_HPP_GUARD
+#define VMEMALLOC_HPP_GUARD
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+extern "C" {
+#include "vmemalloc.h"
+}
+
+// C++ adapters for vmemalloc: an STL allocator and a std::pmr::memory_resource, each with an arena
+// variant that never frees. Frees pass on the size the container gives back, so small chunks skip the
+// page map lookup. Failures throw std::bad_alloc, as the standard library expects. Needs C++17.
+
+namespace vmem {
+
+// Size actually requested for an allocation, so every chunk is at least as big as its alignment.
+// Small chunks are aligned to their size, so this is all it takes for alignments up to LARGEST_ALIGNMENT.
+inline std::size_t chunk_size(std::size_t bytes, std::size_t alignment) noexcept {
+    if (bytes < alignment) {
+        bytes = alignment;
+    }
+    return bytes == 0 ? 1 : bytes;
+}
+
+// Allocates bytes aligned to alignment, which must be a power of two.
+inline void* allocate_bytes(std::size_t bytes, std::size_t alignment) {
+    std::size_t size = chunk_size(bytes, alignment);
+    void* ptr = alignment <= LARGEST_ALIGNMENT ? vmemalloc(size) : vmemalign(alignment, size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+// Frees a chunk from allocate_bytes, given the same size and alignment.
+inline void deallocate_bytes(void* ptr, std::size_t bytes, std::size_t alignment) noexcept {
+    if (alignment <= LARGEST_ALIGNMENT) {
+        vmemfree_sized(ptr, chunk_size(bytes, alignment));
+    } else {
+        // Aligned chunks may have been carved out of the middle of a free chunk, so their size isn't known.
+        vmemfree(ptr);
+    }
+}
+
+// Allocates bytes aligned to alignment from an arena. Arena objects are aligned to LARGEST_ALIGNMENT,
+// so bigger alignments take extra space and round up.
+inline void* allocate_arena_bytes(VmemArena* arena, std::size_t bytes, std::size_t alignment) {
+    std::size_t padding = alignment > LARGEST_ALIGNMENT ? alignment - LARGEST_ALIGNMENT : 0;
+    void* ptr = vmemarena_alloc(arena, (bytes == 0 ? 1 : bytes) + padding);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return (void*)CEIL((Word)ptr, alignment);
+}
+
+// Checks the number of objects in an allocation doesn't overflow, and gives its size in bytes.
+template <class T>
+std::size_t array_bytes(std::size_t count) {
+    if (count > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+        throw std::bad_array_new_length();
+    }
+    return count * sizeof(T);
+}
+
+// STL allocator using vmemalloc. Every instance is interchangeable, so containers can swap and move
+// their memory freely.
+template <class T>
+class allocator {
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using is_always_equal = std::true_type;
+
+    allocator() noexcept = default;
+    template <class U>
+    allocator(const allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t count) {
+        return static_cast<T*>(allocate_bytes(array_bytes<T>(count), alignof(T)));
+    }
+
+    void deallocate(T* ptr, std::size_t count) noexcept {
+        deallocate_bytes(ptr, count * sizeof(T), alignof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept {
+    return false;
+}
+
+// Memory resource using vmemalloc, for std::pmr containers. Stateless, so one instance (from
+// get_memory_resource) serves every container.
+class memory_resource : public std::pmr::memory_resource {
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        return allocate_bytes(bytes, alignment);
+    }
+
+    void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override {
+        deallocate_bytes(ptr, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return dynamic_cast<const memory_resource*>(&other) != nullptr;
+    }
+};
+
+// The shared vmemalloc memory resource.
+inline memory_resource* get_memory_resource() noexcept {
+    static memory_resource resource;
+    return &resource;
+}
+
+// Memory resource handing out memory from an arena it owns, for containers that live as long as a
+// request. Deallocation does nothing; release (or destroying the resource) frees everything at once.
+// Like the arena, it must only be used by one thread at a time.
+class arena_resource : public std::pmr::memory_resource {
+public:
+    // Takes blocks of block_size bytes from vmemalloc, or 64KB if block_size is 0.
+    explicit arena_resource(std::size_t block_size = 0) : arena_(vmemarena_create(block_size)) {
+        if (arena_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    arena_resource(const arena_resource&) = delete;
+    arena_resource& operator=(const arena_resource&) = delete;
+
+    ~arena_resource() override {
+        vmemarena_destroy(arena_);
+    }
+
+    // Frees every object allocated from the resource, keeping the blocks for reuse.
+    void release() noexcept {
+        vmemarena_reset(arena_);
+    }
+
+    VmemArena* arena() const noexcept {
+        return arena_;
+    }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        return allocate_arena_bytes(arena_, bytes, alignment);
+    }
+
+    void do_deallocate(void*, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    VmemArena* arena_;
+};
+
+// STL allocator taking memory from an arena_resource, which must outlive the containers using it.
+// Deallocation does nothing, and memory is only given back when the resource is released.
+template <class T>
+class arena_allocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    explicit arena_allocator(arena_resource& resource) noexcept : arena_(resource.arena()) {}
+    template <class U>
+    arena_allocator(const arena_allocator<U>& other) noexcept : arena_(other.arena()) {}
+
+    T* allocate(std::size_t count) {
+        return static_cast<T*>(allocate_arena_bytes(arena_, array_bytes<T>(count), alignof(T)));
+    }
+
+    void deallocate(T*, std::size_t) noexcept {}
+
+    VmemArena* arena() const noexcept {
+        return arena_;
+    }
+
+private:
+    VmemArena* arena_;
+};
+
+template <class T, class U>
+bool operator==(const arena_allocator<T>& left, const arena_allocator<U>& right) noexcept {
+    return left.arena() == right.arena();
+}
+
+template <class T, class U>
+bool operator!=(const arena_allocator<T>& left, const arena_allocator<U>& right) noexcept {
+    return left.arena() != right.arena();
+}
+
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+
+// Arenas take their blocks from the large allocator, and bump a pointer through them. A block starts
+// with an ArenaBlock header, padded so the objects after it are aligned to LARGEST_ALIGNMENT.
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    // Bytes in the block after the header.
+    Word size;
+} ArenaBlock;
+
+#define ARENA_BLOCK_HEADER_SIZE CEIL(sizeof(ArenaBlock), LARGEST_ALIGNMENT)
+
+#define DEFAULT_ARENA_BLOCK_SIZE (64 * 1024)
+
+struct VmemArena {
+    // Blocks of blockSize bytes in the order they were first used. Blocks after the current one
+    // were kept by vmemarena_reset and haven't been used since.
+    ArenaBlock* blocks;
+    ArenaBlock* currentBlock;
+    // Blocks holding a single big object, given back by vmemarena_reset.
+    ArenaBlock* bigBlocks;
+    // The free part of the current block.
+    void* next;
+    void* end;
+    Word blockSize;
+};
+
+// Gets a block with room for size bytes from the large allocator.
+static ArenaBlock* newArenaBlock(Word size) {
+    ArenaBlock* block = vmemallocLarge(ARENA_BLOCK_HEADER_SIZE + size, NULL);
+    if (block == NULL) {
+        fprintf(stderr, "error in vmemallocLarge(%zu) for an arena block\n", (size_t)(ARENA_BLOCK_HEADER_SIZE + size));
+        return NULL;
+    }
+    STAT_ADD(allocatedChunkCount, 1);
+    block->next = NULL;
+    block->size = size;
+    return block;
+}
+
+// Gives a list of blocks back to the large allocator.
+static void freeArenaBlocks(ArenaBlock* block) {
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        vmemfreeLarge(block);
+        STAT_SUB(allocatedChunkCount, 1);
+        block = next;
+    }
+}
+
+// Makes a block the one that objects are bumped out of.
+static void useArenaBlock(VmemArena* arena, ArenaBlock* block) {
+    arena->currentBlock = block;
+    arena->next = (void*)block + ARENA_BLOCK_HEADER_SIZE;
+    arena->end = arena->next + block->size;
+}
+
+/*  Create an arena which takes blocks of 'blockSize' bytes from the allocator, or 64KB if
+    'blockSize' is 0. On failure NULL is returned. */
+VmemArena* vmemarena_create(size_t blockSize) {
+    if (blockSize == 0) {
+        blockSize = DEFAULT_ARENA_BLOCK_SIZE;
+    }
+    if (blockSize > SIZE_MASK >> 2) {
+        fprintf(stderr, "block size passed to vmemarena_create was too big (%zu)\n", blockSize);
+        return NULL;
+    }
+    VmemArena* arena = vmemalloc(sizeof(VmemArena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->blocks = NULL;
+    arena->currentBlock = NULL;
+    arena->bigBlocks = NULL;
+    arena->next = NULL;
+    arena->end = NULL;
+    arena->blockSize = CEIL(blockSize, LARGEST_ALIGNMENT);
+    return arena;
+}
+
+/*  Allocate 'size' bytes from 'arena', aligned like vmemalloc. On failure NULL is returned. */
+void* vmemarena_alloc(VmemArena* arena, size_t size) {
+    if (arena == NULL || size == 0 || size > SIZE_MASK >> 2) {
+        fprintf(stderr, "arguments passed to vmemarena_alloc were invalid (%p, %zu)\n", (void*)arena, size);
+        return NULL;
+    }
+    size = CEIL(size, LARGEST_ALIGNMENT);
+    // The common case: the object fits in the current block.
+    if (size <= (Word)(arena->end - arena->next)) {
+        void* ptr = arena->next;
+        arena->next += size;
+        return ptr;
+    }
+    if (size > arena->blockSize / 4) {
+        // Big objects would waste too much of a shared block.
+        ArenaBlock* block = newArenaBlock(size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = arena->bigBlocks;
+        arena->bigBlocks = block;
+        return (void*)block + ARENA_BLOCK_HEADER_SIZE;
+    }
+    // Move on to a block kept by the last reset, or add a new one to the end of the list.
+    ArenaBlock* block = arena->currentBlock == NULL ? arena->blocks : arena->currentBlock->next;
+    if (block == NULL) {
+        block = newArenaBlock(arena->blockSize);
+        if (block == NULL) {
+            return NULL;
+        }
+        if (arena->currentBlock == NULL) {
+            arena->blocks = block;
+        } else {
+            arena->currentBlock->next = block;
+        }
+    }
+    useArenaBlock(arena, block);
+    void* ptr = arena->next;
+    arena->next += size;
+    return ptr;
+}
+
+/*  Free every object allocated from 'arena', keeping the blocks used since the last reset. */
+void vmemarena_reset(VmemArena* arena) {
+    if (arena == NULL) {
+        fprintf(stderr, "arena passed to vmemarena_reset was NULL\n");
+        return;
+    }
+    freeArenaBlocks(arena->bigBlocks);
+    arena->bigBlocks = NULL;
+    if (arena->currentBlock == NULL) {
+        // Nothing was allocated since the last reset, so no blocks are needed.
+        freeArenaBlocks(arena->blocks);
+        arena->blocks = NULL;
+        arena->next = NULL;
+        arena->end = NULL;
+        return;
+    }
+    // Blocks after the current one weren't needed this time round.
+    freeArenaBlocks(arena->currentBlock->next);
+    arena->currentBlock->next = NULL;
+    arena->currentBlock = NULL;
+    arena->next = NULL;
+    arena->end = NULL;
+}
+
+/*  Free every object allocated from 'arena', and the arena itself. */
+void vmemarena_destroy(VmemArena* arena) {
+    if (arena == NULL) {
+        fprintf(stderr, "arena passed to vmemarena_destroy was NULL\n");
+        return;
+    }
+    freeArenaBlocks(arena->bigBlocks);
+    freeArenaBlocks(arena->blocks);
+    vmemfree(arena);
+}
@@ -0,0 +1,138 @@
+#include <sys/mman.h>
+
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+#include "vmemalloc_small.h"
+#include "vmemalloc_pagemap.h"
+#include "vmemalloc_thread.h"
+#include "vmemalloc_huge.h"
+#include "vmemalloc_stats.h"
+#include "vmemalloc_hugepage.h"
+
+// Chunks of at least this size are huge chunks.
+Word hugeChunkThreshold = DEFAULT_HUGE_CHUNK_THRESHOLD;
+
+// Size of the mapping needed for a huge chunk of the given size.
+Word getHugeMappingSize(Word size) {
+    return getMappingSize(ALIGNMENT_OFFSET + sizeof(ChunkHeader) + size);
+}
+
+// Sets up the header of a huge chunk at the start of a mapping and records it in the page map.
+// Returns a pointer to the chunk, or NULL if it couldn't be recorded.
+void* initHugeChunk(void* mapping, Word mappingSize) {
+    ChunkHeader* chunk = (ChunkHeader*)(mapping + ALIGNMENT_OFFSET);
+    RESET_HEADER(chunk);
+    SET_LAST_CHUNK_OF_REGION(chunk, true);
+    SET_SIZE(chunk, mappingSize - ALIGNMENT_OFFSET - sizeof(ChunkHeader));
+    LOCK_BACKEND();
+    int error = setPageOwner(mapping, PAGE_MAP_PAGE_SIZE, chunk, PAGE_HUGE);
+    UNLOCK_BACKEND();
+    if (error) {
+        fprintf(stderr, "Failed to add huge chunk to the page map\n");
+        return NULL;
+    }
+    return (void*)chunk + sizeof(ChunkHeader);
+}
+
+// Forgets the page map entry of a huge chunk.
+void forgetHugeChunk(void* mapping) {
+    LOCK_BACKEND();
+    clearPageOwner(mapping, PAGE_MAP_PAGE_SIZE);
+    UNLOCK_BACKEND();
+}
+
+// Maps a new huge chunk of at least size bytes.
+void* vmemallocHuge(Word size) {
+    // Rounding up to the page size mustn't overflow, and the size must fit in a chunk header.
+    if (size > (SIZE_MASK >> 1)) {
+        fprintf(stderr, "Too big to allocate\n");
+        return NULL;
+    }
+    Word mappingSize = getHugeMappingSize(size);
+    // Huge chunks never come from the hugetlbfs pool, as they are resized with mremap.
+    void* mapping = mapPages(mappingSize, PROT_READ|PROT_WRITE, NULL);
+    if (mapping == NULL) {
+        perror("Error mapping huge chunk");
+        return NULL;
+    }
+    void* ptr = initHugeChunk(mapping, mappingSize);
+    if (ptr == NULL) {
+        unmapPages(mapping, mappingSize, false);
+        return NULL;
+    }
+    STAT_ADD(allocatedSpace, GET_SIZE(ptr - sizeof(ChunkHeader)));
+    STAT_ADD(hugeChunkBytes, GET_SIZE(ptr - sizeof(ChunkHeader)));
+    STAT_ADD(hugeChunkCount, 1);
+    STAT_ADD(regionsUsed, 1);
+    return ptr;
+}
+
+// Unmaps a huge chunk. Returns the amount of space saved, or 0 on failure.
+Word vmemfreeHuge(void* ptr) {
+    ChunkHeader* chunk = (ChunkHeader*)(ptr - sizeof(ChunkHeader));
+    void* mapping = (void*)chunk - ALIGNMENT_OFFSET;
+    Word size = GET_SIZE(chunk);
+    forgetHugeChunk(mapping);
+    if (unmapPages(mapping, ALIGNMENT_OFFSET + sizeof(ChunkHeader) + size, false)) {
+        return 0;
+    }
+    STAT_SUB(allocatedSpace, size);
+    STAT_SUB(hugeChunkBytes, size);
+    STAT_SUB(hugeChunkCount, 1);
+    STAT_SUB(regionsUsed, 1);
+    return size;
+}
+
+// Resizes a huge chunk with mremap, which may move it. Returns the new location or NULL on failure,
+// in which case the chunk is unchanged.
+void* vmemreallocHuge(void* ptr, Word size) {
+    if (size > (SIZE_MASK >> 1)) {
+        fprintf(stderr, "Too big to allocate\n");
+        return NULL;
+    }
+    ChunkHeader* chunk = (ChunkHeader*)(ptr - sizeof(ChunkHeader));
+    void* mapping = (void*)chunk - ALIGNMENT_OFFSET;
+    Word oldSize = GET_SIZE(chunk);
+    Word oldMappingSize = ALIGNMENT_OFFSET + sizeof(ChunkHeader) + oldSize;
+    Word newMappingSize = getHugeMappingSize(size);
+    Word newSize = newMappingSize - ALIGNMENT_OFFSET - sizeof(ChunkHeader);
+    if (newMappingSize == oldMappingSize) {
+        return ptr;
+    }
+    // The lock is held until the old address is forgotten, as once it is unmapped another thread could
+    // map it and record it in the page map.
+    LOCK_BACKEND();
+    if (remapPages(mapping, oldMappingSize, newMappingSize) == 0) {
+        UNLOCK_BACKEND();
+        SET_SIZE(chunk, newSize);
+    } else {
+        // The new place is mapped and recorded first, so a failure leaves the chunk where it was.
+        void* newMapping = mapPages(newMappingSize, PROT_READ|PROT_WRITE, NULL);
+        if (newMapping == NULL) {
+            UNLOCK_BACKEND();
+            perror("Error mapping huge chunk");
+            return NULL;
+        }
+        chunk = (ChunkHeader*)(newMapping + ALIGNMENT_OFFSET);
+        if (setPageOwner(newMapping, PAGE_MAP_PAGE_SIZE, chunk, PAGE_HUGE)) {
+            UNLOCK_BACKEND();
+            fprintf(stderr, "Failed to add huge chunk to the page map\n");
+            unmapPages(newMapping, newMappingSize, false);
+            return NULL;
+        }
+        if (movePages(mapping, oldMappingSize, newMapping, newMappingSize)) {
+            clearPageOwner(newMapping, PAGE_MAP_PAGE_SIZE);
+            UNLOCK_BACKEND();
+            perror("Error in mremap");
+            unmapPages(newMapping, newMappingSize, false);
+            return NULL;
+        }
+        clearPageOwner(mapping, PAGE_MAP_PAGE_SIZE);
+        UNLOCK_BACKEND();
+        // The header moved with the rest of the chunk.
+        SET_SIZE(chunk, newSize);
+    }
+    STAT_ADD(allocatedSpace, (int64_t)newSize - (int64_t)oldSize);
+    STAT_ADD(hugeChunkBytes, (int64_t)newSize - (int64_t)oldSize);
+    return (void*)chunk + sizeof(ChunkHeader);
+}
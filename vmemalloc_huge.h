@@ -0,0 +1,25 @@
+#ifndef VMEMALLOC_HUGE_GUARD
+#define VMEMALLOC_HUGE_GUARD
+
+// Huge chunks each have their own mapping, which holds the chunk header (at ALIGNMENT_OFFSET, as in a
+// region) and the chunk. They are never split, binned or cached, and are resized with mremap.
+// Only the first page of the mapping is recorded in the page map, as huge chunks are only ever
+// looked up by the pointer returned by vmemallocHuge.
+
+// Chunks of at least this size are huge chunks by default.
+#define DEFAULT_HUGE_CHUNK_THRESHOLD (1024 * 1024)
+
+// Chunks of at least this size are huge chunks.
+extern Word hugeChunkThreshold;
+
+// Maps a new huge chunk of at least size bytes.
+extern void* vmemallocHuge(Word size);
+
+// Unmaps a huge chunk. Returns the amount of space saved, or 0 on failure.
+extern Word vmemfreeHuge(void* ptr);
+
+// Resizes a huge chunk with mremap, which may move it. Returns the new location or NULL on failure,
+// in which case the chunk is unchanged.
+extern void* vmemreallocHuge(void* ptr, Word size);
+
+#endif
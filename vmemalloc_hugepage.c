@@ -0,0 +1,291 @@
+// Needed for MAP_HUGETLB, MADV_HUGEPAGE and mremap.
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+#include "vmemalloc_small.h"
+#include "vmemalloc_pagemap.h"
+#include "vmemalloc_thread.h"
+#include "vmemalloc_regioncache.h"
+#include "vmemalloc_stats.h"
+#include "vmemalloc_hugepage.h"
+
+// A slab of containers in huge page mode. The header fills the first slot, and the other slots each
+// hold a container. Slabs are aligned to HUGE_PAGE_SIZE, so the slab of a slot is found by rounding down.
+typedef struct ContainerSlab {
+    // Part of the list of slabs with free slots.
+    struct ContainerSlab* nextSlab;
+    struct ContainerSlab* lastSlab;
+    // Stack of freed slots, linked through their first word.
+    void* freeSlots;
+    // Slots from this one onwards have never been used.
+    int nextUnusedSlot;
+    int slotsInUse;
+    // Set if the slab came from the hugetlbfs pool.
+    Word hugetlb;
+} ContainerSlab;
+
+// Number of slots in a slab, including the one holding the header.
+#define SLAB_SLOTS ((int)(HUGE_PAGE_SIZE / CONTAINER_REGION_SIZE))
+
+int hugePageMode = VMEM_HUGE_PAGES_OFF;
+
+int noReserveFlag = 0;
+
+// Cleared when MAP_HUGETLB fails, after which transparent huge pages are used instead.
+static int hugetlbAvailable = 1;
+
+// Number of mappings made by mapPages and not yet unmapped. The mode can only change when this is 0.
+static Word mappingCount = 0;
+
+// Slabs with free slots. Protected by the backend lock.
+static ContainerSlab* partialSlabs = NULL;
+
+// Rounds the size of a mapping up to a whole number of pages, or of huge pages in huge page mode.
+Word getMappingSize(Word size) {
+    return CEIL(size, hugePageMode == VMEM_HUGE_PAGES_OFF ? (Word)getpagesize() : HUGE_PAGE_SIZE);
+}
+
+// Maps size bytes aligned to HUGE_PAGE_SIZE, by mapping an extra huge page and unmapping the ends,
+// and asks for transparent huge pages.
+static void* mapAlignedPages(Word size, int prot) {
+    Word mappingSize = size + HUGE_PAGE_SIZE;
+    void* mapping = mmap(0, mappingSize, prot, MAP_PRIVATE|MAP_ANONYMOUS|noReserveFlag, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    void* start = (void*)CEIL((Word)mapping, HUGE_PAGE_SIZE);
+    Word head = start - mapping;
+    Word tail = mappingSize - head - size;
+    if (head > 0) {
+        munmap(mapping, head);
+        STAT_ADD(munmapCount, 1);
+    }
+    if (tail > 0) {
+        munmap(start + size, tail);
+        STAT_ADD(munmapCount, 1);
+    }
+    // Fails if transparent huge pages are disabled, in which case the mapping uses normal pages.
+    madvise(start, size, MADV_HUGEPAGE);
+    STAT_ADD(transparentHugePageBytes, size);
+    return start;
+}
+
+// Maps size bytes, which must have been rounded by getMappingSize. Returns NULL on failure.
+void* mapPages(Word size, int prot, Word* hugetlb) {
+    void* mapping = NULL;
+    if (hugetlb != NULL) {
+        *hugetlb = false;
+    }
+    if (hugePageMode == VMEM_HUGE_PAGES_HUGETLB && hugetlb != NULL && hugetlbAvailable) {
+        // MAP_NORESERVE would let this succeed without reserved pages, and fail on first touch instead.
+        mapping = mmap(0, size, prot, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (mapping != MAP_FAILED) {
+            *hugetlb = true;
+            STAT_ADD(hugetlbBytes, size);
+        } else {
+            // The pool is empty or was never reserved, so stop trying.
+            fprintf(stderr, "No hugetlbfs pages are available, using transparent huge pages instead\n");
+            hugetlbAvailable = 0;
+            mapping = NULL;
+        }
+    }
+    if (mapping == NULL) {
+        if (hugePageMode == VMEM_HUGE_PAGES_OFF) {
+            mapping = mmap(0, size, prot, MAP_PRIVATE|MAP_ANONYMOUS|noReserveFlag, -1, 0);
+            if (mapping == MAP_FAILED) {
+                mapping = NULL;
+            }
+        } else {
+            mapping = mapAlignedPages(size, prot);
+        }
+    }
+    if (mapping == NULL) {
+        return NULL;
+    }
+    COUNT_MMAP(size);
+    __atomic_add_fetch(&mappingCount, 1, __ATOMIC_RELAXED);
+    return mapping;
+}
+
+// Unmaps a mapping made by mapPages. Returns 0, or -1 if munmap failed.
+int unmapPages(void* start, Word size, Word hugetlb) {
+    if (munmap(start, size)) {
+        perror("Error in munmap");
+        return -1;
+    }
+    COUNT_MUNMAP(size);
+    if (hugetlb) {
+        STAT_SUB(hugetlbBytes, size);
+    } else if (hugePageMode != VMEM_HUGE_PAGES_OFF) {
+        STAT_SUB(transparentHugePageBytes, size);
+    }
+    __atomic_sub_fetch(&mappingCount, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Resizes a mapping made by mapPages without the hugetlbfs pool, without moving it.
+int remapPages(void* start, Word oldSize, Word newSize) {
+    // Shrinking always works, and growing works if the pages after the mapping are free.
+    if (mremap(start, oldSize, newSize, 0) == MAP_FAILED) {
+        return -1;
+    }
+    COUNT_MREMAP(oldSize, newSize);
+    if (hugePageMode != VMEM_HUGE_PAGES_OFF) {
+        STAT_ADD(transparentHugePageBytes, (int64_t)newSize - (int64_t)oldSize);
+    }
+    return 0;
+}
+
+// Moves the pages of a mapping onto target, which they replace.
+int movePages(void* start, Word oldSize, void* target, Word newSize) {
+    // The kernel moves the pages rather than copying the data, and keeps the MADV_HUGEPAGE advice.
+    if (mremap(start, oldSize, newSize, MREMAP_MAYMOVE|MREMAP_FIXED, target) == MAP_FAILED) {
+        return -1;
+    }
+    // Target was counted when it was mapped, so only the old mapping has gone.
+    COUNT_MREMAP(oldSize, 0);
+    if (hugePageMode != VMEM_HUGE_PAGES_OFF) {
+        STAT_SUB(transparentHugePageBytes, oldSize);
+    }
+    __atomic_sub_fetch(&mappingCount, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Adds a slab to the list of slabs with free slots.
+static void pushSlab(ContainerSlab* slab) {
+    slab->lastSlab = NULL;
+    slab->nextSlab = partialSlabs;
+    if (partialSlabs != NULL) {
+        partialSlabs->lastSlab = slab;
+    }
+    partialSlabs = slab;
+}
+
+// Removes a slab from the list of slabs with free slots.
+static void unlinkSlab(ContainerSlab* slab) {
+    if (partialSlabs == slab) {
+        partialSlabs = slab->nextSlab;
+    }
+    if (slab->nextSlab != NULL) {
+        slab->nextSlab->lastSlab = slab->lastSlab;
+    }
+    if (slab->lastSlab != NULL) {
+        slab->lastSlab->nextSlab = slab->nextSlab;
+    }
+}
+
+// Creates a slab with every slot free, reusing a cached region if there is one.
+static ContainerSlab* newSlab(void) {
+    Word size = HUGE_PAGE_SIZE;
+    Word hugetlb = false;
+    // Cached regions are never from the hugetlbfs pool.
+    void* mapping = hugePageMode == VMEM_HUGE_PAGES_HUGETLB && hugetlbAvailable ? NULL : takeCachedRegion(size, &size);
+    if (mapping == NULL) {
+        mapping = mapPages(size, PROT_READ|PROT_WRITE, &hugetlb);
+        if (mapping == NULL) {
+            perror("Error creating container slab");
+            return NULL;
+        }
+    }
+    ContainerSlab* slab = (ContainerSlab*)mapping;
+    slab->freeSlots = NULL;
+    slab->nextUnusedSlot = 1;
+    slab->slotsInUse = 0;
+    slab->hugetlb = hugetlb;
+    pushSlab(slab);
+    STAT_ADD(regionsUsed, 1);
+    return slab;
+}
+
+// Gets CONTAINER_REGION_SIZE bytes for a container.
+void* takeContainerRegion(void) {
+    if (hugePageMode == VMEM_HUGE_PAGES_OFF) {
+        ChunkHeader* chunk = mapRegion(CONTAINER_SIZE, NULL);
+        return chunk == NULL ? NULL : (void*)chunk - ALIGNMENT_OFFSET;
+    }
+    ContainerSlab* slab = partialSlabs;
+    if (slab == NULL && (slab = newSlab()) == NULL) {
+        return NULL;
+    }
+    void* slot;
+    if (slab->freeSlots != NULL) {
+        slot = slab->freeSlots;
+        slab->freeSlots = *(void**)slot;
+    } else {
+        slot = (void*)slab + slab->nextUnusedSlot++ * CONTAINER_REGION_SIZE;
+    }
+    if (++slab->slotsInUse == SLAB_SLOTS - 1) {
+        unlinkSlab(slab);
+    }
+    return slot;
+}
+
+// Maps count container regions with one call, each laid out as a region of its own so it can be
+// removed on its own. Only used with huge page mode off.
+void* mapContainerRegions(int count) {
+    Word size = (Word)count * CONTAINER_REGION_SIZE;
+    void* block = mapPages(size, PROT_READ|PROT_WRITE, NULL);
+    if (block == NULL) {
+        perror("Error creating container regions");
+        return NULL;
+    }
+    // Each region is unmapped separately.
+    __atomic_add_fetch(&mappingCount, count - 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < count; i++) {
+        initRegion(block + i * CONTAINER_REGION_SIZE, CONTAINER_REGION_SIZE);
+    }
+    STAT_ADD(regionsUsed, count);
+    return block;
+}
+
+// Gives back the memory of a container, unmapping (or caching) its slab once the slab is empty.
+void releaseContainerRegion(void* region) {
+    if (hugePageMode == VMEM_HUGE_PAGES_OFF) {
+        removeRegion((FreeChunkHeader*)(region + ALIGNMENT_OFFSET));
+        return;
+    }
+    clearPageOwner(region, CONTAINER_REGION_SIZE);
+    ContainerSlab* slab = (ContainerSlab*)((Word)region & ~(HUGE_PAGE_SIZE - 1));
+    *(void**)region = slab->freeSlots;
+    slab->freeSlots = region;
+    if (slab->slotsInUse-- == SLAB_SLOTS - 1) {
+        pushSlab(slab);
+    }
+    if (slab->slotsInUse == 0) {
+        unlinkSlab(slab);
+        STAT_SUB(regionsUsed, 1);
+        if (slab->hugetlb || !cacheRegion(slab, HUGE_PAGE_SIZE)) {
+            unmapPages(slab, HUGE_PAGE_SIZE, slab->hugetlb);
+        }
+    }
+}
+
+/*  Map regions and huge chunks with MAP_NORESERVE if 'enabled' is true, so mappings bigger than the
+    free memory succeed and fail when their pages are touched instead. Only affects new mappings. */
+void setMapNoReserve(int enabled) {
+    __atomic_store_n(&noReserveFlag, enabled ? MAP_NORESERVE : 0, __ATOMIC_RELAXED);
+}
+
+// Sets how regions are mapped. Fails unless everything has been freed.
+int setHugePageMode(int mode) {
+    if (mode != VMEM_HUGE_PAGES_OFF && mode != VMEM_HUGE_PAGES_TRANSPARENT && mode != VMEM_HUGE_PAGES_HUGETLB) {
+        fprintf(stderr, "mode passed to setHugePageMode was invalid (%d)\n", mode);
+        return -1;
+    }
+    LOCK_BACKEND();
+    // Cached regions follow the old mode, and aren't in use.
+    releaseCachedRegions();
+    if (__atomic_load_n(&mappingCount, __ATOMIC_RELAXED) != 0) {
+        UNLOCK_BACKEND();
+        fprintf(stderr, "Huge page mode can only be changed while nothing is allocated\n");
+        return -1;
+    }
+    hugePageMode = mode;
+    hugetlbAvailable = 1;
+    UNLOCK_BACKEND();
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef VMEMALLOC_HUGEPAGE_GUARD
+#define VMEMALLOC_HUGEPAGE_GUARD
+
+// Maps the memory for regions and huge chunks. In huge page mode (set with setHugePageMode) mappings are
+// sized and aligned to HUGE_PAGE_SIZE and advised with MADV_HUGEPAGE, or taken from the reserved hugetlbfs
+// pool with MAP_HUGETLB, and containers are packed into slabs of HUGE_PAGE_SIZE instead of having a region
+// each. The mode can only change while nothing is mapped, so every mapping follows the current mode.
+
+// Size of a huge page on x86-64 and aarch64 with 4KB pages.
+#define HUGE_PAGE_SIZE ((Word)2 * 1024 * 1024)
+
+// The current mode: one of VMEM_HUGE_PAGES_OFF, VMEM_HUGE_PAGES_TRANSPARENT or VMEM_HUGE_PAGES_HUGETLB.
+extern int hugePageMode;
+
+// MAP_NORESERVE if setMapNoReserve has turned it on, or 0. Added to the flags of every data mapping.
+extern int noReserveFlag;
+
+// Rounds the size of a mapping up to a whole number of pages, or of huge pages in huge page mode.
+extern Word getMappingSize(Word size);
+
+// Maps size bytes, which must have been rounded by getMappingSize. If hugetlb isn't NULL the mapping
+// may come from the hugetlbfs pool, in which case *hugetlb is set to true. Returns NULL on failure.
+extern void* mapPages(Word size, int prot, Word* hugetlb);
+
+// Unmaps a mapping made by mapPages, or a region that was cached instead of being unmapped.
+// Returns 0, or -1 if munmap failed.
+extern int unmapPages(void* start, Word size, Word hugetlb);
+
+// Resizes a mapping made by mapPages without the hugetlbfs pool, without moving it.
+// Returns 0, or -1 if it couldn't be resized in place.
+extern int remapPages(void* start, Word oldSize, Word newSize);
+
+// Moves the pages of a mapping made by mapPages without the hugetlbfs pool onto target, a mapping of
+// newSize bytes made by mapPages, which they replace. Returns 0, or -1 if both mappings are unchanged.
+extern int movePages(void* start, Word oldSize, void* target, Word newSize);
+
+// Gets CONTAINER_REGION_SIZE bytes for a container: a region of its own, or a slot of a slab in
+// huge page mode. The caller must hold the backend lock.
+extern void* takeContainerRegion(void);
+
+// Maps count regions of CONTAINER_REGION_SIZE bytes in one block, each of which can be given back
+// with releaseContainerRegion. Only used with huge page mode off. The caller must hold the backend lock.
+extern void* mapContainerRegions(int count);
+
+// Gives back the memory of a container. The caller must hold the backend lock.
+extern void releaseContainerRegion(void* region);
+
+#endif
@@ -4,18 +4,38 @@
 
 #include "vmemalloc.h"
 #include "vmemalloc_large.h"
+#include "vmemalloc_pagemap.h"
+#include "vmemalloc_small.h"
+#include "vmemalloc_thread.h"
+#include "vmemalloc_regioncache.h"
+#include "vmemalloc_stats.h"
+#include "vmemalloc_huge.h"
+#include "vmemalloc_hugepage.h"
+#include "vmemalloc_scavenge.h"
+#include "vmemalloc_reservation.h"
+#include "vmemalloc_latency.h"
 
-// Linked lists of free chunks with sizes in the same order of magnitude.
-FreeChunkHeader* bins[NUM_BINS]; // {1, 2, 3-4, 5-8...}
+// Number of chunks of a sub-bin checked for one with resident pages before taking a decommitted one.
+#define RESIDENT_SEARCH_LIMIT 4
 
-// Index of the largest bin with a free chunk. -1 if there are no free chunks.
-int largestBinInUse = -1;
+// Linked lists of free chunks. bins[n][m] holds chunks with sizes between 2^n + m * 2^(n - SUB_BIN_BITS)
+// and 2^n + (m + 1) * 2^(n - SUB_BIN_BITS) - 1 bytes.
+FreeChunkHeader* bins[NUM_BINS][NUM_SUB_BINS];
+
+// Bit n is set if bins[n] has a free chunk.
+Word binBitmap = 0;
+
+// Bit m of subBinBitmaps[n] is set if bins[n][m] has a free chunk.
+Word subBinBitmaps[NUM_BINS];
 
 // Converts a free chunk into an allocated chunk.
 ChunkHeader* makeChunkAllocated(FreeChunkHeader* chunk) {
     SET_CHUNK_FREE(chunk, false);
+    // The program is about to touch the pages. Any part of the chunk that is freed again counts as
+    // resident, and is released again by the next scavenge.
+    SET_DECOMMITTED(chunk, false);
     if (!GET_LAST_CHUNK_OF_REGION(chunk)) {
-        ChunkHeader* nextChunk = (ChunkHeader*)((void*)chunk + GET_SIZE(chunk));
+        ChunkHeader* nextChunk = (ChunkHeader*)((void*)chunk + sizeof(ChunkHeader) + GET_SIZE(chunk));
         SET_PREVIOUS_CHUNK_FREE(nextChunk, false);
     }
     return (ChunkHeader*) chunk;
@@ -50,43 +70,59 @@ void initFreeChunk(FreeChunkHeader* chunk, Word size, Word lastChunkOfRegion, Wo
     makeChunkFree((ChunkHeader*)chunk);
 }
 
-// Gets the bin index for the corresponding size.
-int getBin(int size) {
-    int sizeInWords = size / sizeof(Word);
-    // Special case to avoid log(0).
-    if (sizeInWords == 1) {
-        return 0;
-    }
-    return (int)log2(sizeInWords - 1) + 1;
+// Gets the bin and sub-bin holding free chunks of the given size.
+void getBin(Word size, int* bin, int* subBin) {
+    // Position of the highest set bit. Chunks are never smaller than 2^SUB_BIN_BITS bytes.
+    *bin = NUM_BINS - 1 - COUNT_LEADING_ZEROS(size);
+    // The next SUB_BIN_BITS bits below the highest bit choose the sub-bin.
+    *subBin = (size >> (*bin - SUB_BIN_BITS)) & (NUM_SUB_BINS - 1);
+}
+
+// Gets the first bin and sub-bin where every chunk is at least the given size.
+void getBinForAllocation(Word size, int* bin, int* subBin) {
+    // Round up to the start of the next sub-bin, unless size is already at the start of one.
+    int highestBit = NUM_BINS - 1 - COUNT_LEADING_ZEROS(size);
+    size += ((Word)1 << (highestBit - SUB_BIN_BITS)) - 1;
+    getBin(size, bin, subBin);
 }
 
 // Add a free chunk to the correct bin.
 void addChunkToBin(FreeChunkHeader* chunk) {
-    int chunkSize = (int)GET_SIZE(chunk);
-    int bin = getBin(chunkSize);
+    Word chunkSize = GET_SIZE(chunk);
+    int bin, subBin;
+    getBin(chunkSize, &bin, &subBin);
     // Add to the linked list.
-    chunk->nextFree = bins[bin];
+    chunk->nextFree = bins[bin][subBin];
     if (chunk->nextFree != NULL) {
         chunk->nextFree->lastFree = chunk;
     }
-    bins[bin] = chunk;
+    bins[bin][subBin] = chunk;
     chunk->lastFree = NULL;
-    // Update largest bin in use.
-    if (bin > largestBinInUse) {
-        largestBinInUse = bin;
-    }
-    freeSpace += chunkSize;
-    freeChunkCount++;
+    // Mark the bin as in use.
+    binBitmap |= (Word)1 << bin;
+    subBinBitmaps[bin] |= (Word)1 << subBin;
+    STAT_ADD(freeSpace, chunkSize);
+    STAT_ADD(freeChunkCount, 1);
+    STAT_ADD(largeBinChunks[bin], 1);
+    STAT_ADD(largeBinBytes[bin], chunkSize);
 }
 
 // Remove a free chunk from its bin.
 void removeChunkFromBin(FreeChunkHeader* chunk) {
-    int chunkSize = (int)GET_SIZE(chunk);
-    int bin = getBin(chunkSize);
+    Word chunkSize = GET_SIZE(chunk);
+    int bin, subBin;
+    getBin(chunkSize, &bin, &subBin);
 
     // Update linked list.
-    if (bins[bin] == chunk) {
-        bins[bin] = chunk->nextFree;
+    if (bins[bin][subBin] == chunk) {
+        bins[bin][subBin] = chunk->nextFree;
+        // Mark the bin as empty if this was the last chunk.
+        if (bins[bin][subBin] == NULL) {
+            subBinBitmaps[bin] &= ~((Word)1 << subBin);
+            if (subBinBitmaps[bin] == 0) {
+                binBitmap &= ~((Word)1 << bin);
+            }
+        }
     }
     if (chunk->nextFree != NULL) {
         chunk->nextFree->lastFree = chunk->lastFree;
@@ -96,102 +132,141 @@ void removeChunkFromBin(FreeChunkHeader* chunk) {
     }
     chunk->nextFree = NULL;
     chunk->lastFree = NULL;
-
-    // If it was removed from the largest bin, there may be a new largest bin.
-    if (bin == largestBinInUse) {
-        // Find the largest non-empty bin.
-        while (largestBinInUse >= 0 && bins[largestBinInUse] == NULL) {
-            largestBinInUse--;
-        }
-    }
-    freeSpace -= chunkSize;
-    freeChunkCount--;
+    STAT_SUB(freeSpace, chunkSize);
+    STAT_SUB(freeChunkCount, 1);
+    STAT_SUB(largeBinChunks[bin], 1);
+    STAT_SUB(largeBinBytes[bin], chunkSize);
 }
 
-// Use mmap to create a new region containing an allocated chunk.
-ChunkHeader* newRegion(int size) {
-    // Regions created by mmap are always a multiple of the page size.
-    Word regionSize = CEIL(size + sizeof(FreeChunkHeader*), getpagesize());
-    // For some reason, mapping without PROT_EXEC creates regions that are larger than requested.
-    ChunkHeader* region = (ChunkHeader*) mmap(0, (int)regionSize, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-    if (region == NULL) {
-        perror("Error creating new region");
-        return NULL;
-    }
+// Use mmap to create a new region of its own containing an allocated chunk.
+// If zeroed isn't NULL, it is set to true if the chunk is known to be filled with zeros.
+ChunkHeader* initRegion(void* region, Word regionSize) {
     // Offset start of chunk so that chunk (after header) is aligned to LARGEST_ALIGNMENT.
-    ChunkHeader* chunk = (ChunkHeader*)((void*)region + ALIGNMENT_OFFSET);
-    int chunkSize = regionSize - sizeof(RegionFooter) - sizeof(ChunkHeader) - ALIGNMENT_OFFSET;
+    ChunkHeader* chunk = (ChunkHeader*)(region + ALIGNMENT_OFFSET);
+    Word chunkSize = regionSize - sizeof(RegionFooter) - sizeof(ChunkHeader) - ALIGNMENT_OFFSET;
     initAllocdChunk(chunk, chunkSize, true, false);
     // Region footer points to chunk at start of region.
     CREATE_REGION_FOOTER(region, regionSize, chunk);
-    regionsUsed++;
     return chunk;
 }
 
-// Use munmap to remove a region previously created by mmap.
+ChunkHeader* mapRegion(Word size, Word* zeroed) {
+    // Regions created by mmap are always a multiple of the page size (or the huge page size).
+    Word regionSize = getMappingSize(size + ALIGNMENT_OFFSET + sizeof(ChunkHeader) + sizeof(RegionFooter));
+    Word hugetlb = false;
+    // Reuse a recently emptied region of about the right size if there is one.
+    ChunkHeader* region = (ChunkHeader*) takeCachedRegion(regionSize, &regionSize);
+    if (region == NULL) {
+        // For some reason, mapping without PROT_EXEC creates regions that are larger than requested.
+        region = (ChunkHeader*) mapPages(regionSize, PROT_READ|PROT_WRITE|PROT_EXEC, &hugetlb);
+        if (region == NULL) {
+            perror("Error creating new region");
+            return NULL;
+        }
+        // Anonymous mappings are always filled with zeros.
+        if (zeroed != NULL) {
+            *zeroed = true;
+        }
+    }
+    ChunkHeader* chunk = initRegion(region, regionSize);
+    // Record the region so vmemfree can recognise its chunks.
+    if (setPageOwner(region, regionSize, chunk, PAGE_LARGE | (hugetlb & PAGE_HUGETLB))) {
+        fprintf(stderr, "Failed to add region to the page map\n");
+        unmapPages(region, regionSize, hugetlb);
+        return NULL;
+    }
+    STAT_ADD(regionsUsed, 1);
+    return chunk;
+}
+
+// Creates a new region containing an allocated chunk, or grows the region of the newest reservation.
+// If zeroed isn't NULL, it is set to true if the chunk is known to be filled with zeros.
+ChunkHeader* newRegion(Word size, Word* zeroed) {
+    Word start = LATENCY_START();
+    ChunkHeader* chunk = commitRegion(size, zeroed);
+    if (chunk == NULL) {
+        chunk = mapRegion(size, zeroed);
+    }
+    LATENCY_END(VMEM_LATENCY_NEW_REGION, start);
+    return chunk;
+}
+
+// Use munmap to remove a region previously created by mmap, unless it can be cached for reuse.
 void removeRegion(FreeChunkHeader* chunk) {
+    Word start = LATENCY_START();
     makeChunkAllocated(chunk);
+    if (removeReservedRegion(chunk)) {
+        LATENCY_END(VMEM_LATENCY_REMOVE_REGION, start);
+        return;
+    }
     void* region = (void*)chunk - ALIGNMENT_OFFSET;
-    int regionSize = ALIGNMENT_OFFSET + sizeof(ChunkHeader) + GET_SIZE(chunk) + sizeof(RegionFooter);
-    if (munmap(region, regionSize)) {
-        perror("Error in munmap");
+    Word regionSize = ALIGNMENT_OFFSET + sizeof(ChunkHeader) + GET_SIZE(chunk) + sizeof(RegionFooter);
+    // Pages from the hugetlbfs pool go straight back to it rather than being cached.
+    Word hugetlb = (getPageOwner(region) & PAGE_HUGETLB) ? true : false;
+    clearPageOwner(region, regionSize);
+    if (hugetlb || !cacheRegion(region, regionSize)) {
+        unmapPages(region, regionSize, hugetlb);
     }
-    regionsUsed--;
+    STAT_SUB(regionsUsed, 1);
+    LATENCY_END(VMEM_LATENCY_REMOVE_REGION, start);
 }
 
 // Returns true if the chunk fills a whole region created by mmap.
 Word chunkFillsRegion(FreeChunkHeader* chunk) {
-    // Only the last chunk can possibly fill the region.
+    // Only the last chunk can possibly fill the region, or the last before the fence in a reservation.
     if (!GET_LAST_CHUNK_OF_REGION(chunk)) {
-        return false;
+        ChunkHeader* nextChunk = (ChunkHeader*)((void*)chunk + sizeof(ChunkHeader) + GET_SIZE(chunk));
+        if (!GET_LAST_CHUNK_OF_REGION(nextChunk) || GET_SIZE(nextChunk) != FENCE_SIZE) {
+            return false;
+        }
+        // Regions pinned by vmemreserve are kept even when they are empty.
+        return *GET_REGION_FOOTER(nextChunk) == (ChunkHeader*)chunk && !isPinned(chunk);
     }
     RegionFooter* footer = GET_REGION_FOOTER(chunk);
     return *footer == (ChunkHeader*)chunk;
 }
 
 // Finds (or creates) an chunk where GET_SIZE(chunk) >= size.
-// Chunk is removed from bins and allocated.
-ChunkHeader* findFreeChunk(Word minSize) {
-    int bestFitBin = getBin(minSize);
-    if (largestBinInUse >= bestFitBin) {
-        // First search the bin with the right sized chunks (best-fit).
-        FreeChunkHeader* chunk = bins[bestFitBin];
-        while (chunk != NULL) {
-            Word chunkSize = GET_SIZE(chunk);
-            // Best-fit is only efficient if the block will not be split.
-            if (chunkSize >= minSize && chunkSize < minSize + MIN_CHUNK_SIZE) {
-                removeChunkFromBin(chunk);
-                return makeChunkAllocated(chunk);
-            }
-            chunk = chunk->nextFree;
+// Chunk is removed from bins and allocated. zeroed is set to true if the chunk is filled with zeros.
+ChunkHeader* findFreeChunk(Word minSize, Word* zeroed) {
+    int bin, subBin;
+    getBinForAllocation(minSize, &bin, &subBin);
+    // Look for a non-empty sub-bin in the same bin with chunks that are big enough.
+    Word subBins = subBinBitmaps[bin] & (~(Word)0 << subBin);
+    if (subBins == 0) {
+        // Otherwise use the smallest sub-bin of the next bin in use.
+        Word largerBins = (bin + 1 < (int)NUM_BINS) ? binBitmap & (~(Word)0 << (bin + 1)) : 0;
+        if (largerBins != 0) {
+            bin = COUNT_TRAILING_ZEROS(largerBins);
+            subBins = subBinBitmaps[bin];
         }
-
-        if (largestBinInUse > bestFitBin) {
-            // Take a chunk from the largest bin (worst-fit).
-            chunk = bins[largestBinInUse];
-            removeChunkFromBin(chunk);
-            return makeChunkAllocated(chunk);
-        } else {
-            // Search the bin with the right sized chunks (best-fit), but less fussily.
-            chunk = bins[bestFitBin];
-            while (chunk != NULL) {
-                Word chunkSize = GET_SIZE(chunk);
-                // Consider blocks that would be split this time.
-                if (chunkSize >= minSize) {
-                    removeChunkFromBin(chunk);
-                    return makeChunkAllocated(chunk);
-                }
-                chunk = chunk->nextFree;
-            }
+    }
+    if (subBins != 0) {
+        // Every chunk in the sub-bin is big enough, so take the first whose pages are still resident,
+        // to save the page faults of touching released pages.
+        FreeChunkHeader* chunk = bins[bin][COUNT_TRAILING_ZEROS(subBins)];
+        FreeChunkHeader* resident = chunk;
+        for (int i = 0; i < RESIDENT_SEARCH_LIMIT && resident != NULL && GET_DECOMMITTED(resident); i++) {
+            resident = resident->nextFree;
+        }
+        if (resident != NULL && !GET_DECOMMITTED(resident)) {
+            chunk = resident;
         }
+        removeChunkFromBin(chunk);
+        return makeChunkAllocated(chunk);
     }
     // If there are no suitable chunks, create a new region.
-    return newRegion(minSize);
+    return newRegion(minSize, zeroed);
 }
 
-// Returns a suitable chunk for use by a program.
-void* vmemallocLarge(int sizeRequested) {
-    Word size = (Word)sizeRequested;
+// The size of the chunk used for an allocation of sizeRequested bytes, or 0 if it is too big.
+Word getLargeChunkSize(Word size) {
+    // Highest bit of the chunk size must be zero to allow chunk headers to function, and a region
+    // needs room for the chunk plus its header and footer.
+    if (size > (SIZE_MASK >> 1)) {
+        fprintf(stderr, "Too big to allocate\n");
+        return 0;
+    }
 
     // Enforce minimum size.
     if (size < MIN_CHUNK_SIZE) {
@@ -201,15 +276,33 @@ void* vmemallocLarge(int sizeRequested) {
     // size = LARGEST_ALIGNMENT * n + ALIGNMENT_OFFSET
     // This is required to ensure that chunks (not headers) are aligned.
     size = CEIL(size - ALIGNMENT_OFFSET, LARGEST_ALIGNMENT) + ALIGNMENT_OFFSET;
+    return size;
+}
 
-    // Highest bit of the chunk size must be zero to allow chunk headers to function.
-    if (GET_CHUNK_FREE(&size)) {
-        fprintf(stderr, "Too big to allocate\n");
+// Returns a suitable chunk for use by a program.
+// If zeroed isn't NULL, it is set to true if the chunk is known to be filled with zeros.
+void* vmemallocLarge(Word sizeRequested, Word* zeroed) {
+    Word size = getLargeChunkSize(sizeRequested);
+    if (size == 0) {
         return NULL;
     }
+    if (zeroed != NULL) {
+        *zeroed = false;
+    }
 
-    ChunkHeader* chunk = findFreeChunk(size);
+#ifdef VMEM_THREAD_SAFE
+    // Reuse a chunk freed by this thread without taking the lock.
+    ChunkHeader* cachedChunk = takeCachedChunk(size);
+    if (cachedChunk != NULL) {
+        STAT_ADD(allocatedSpace, GET_SIZE(cachedChunk));
+        return (void*)cachedChunk + sizeof(ChunkHeader);
+    }
+#endif
+
+    LOCK_BACKEND();
+    ChunkHeader* chunk = findFreeChunk(size, zeroed);
     if (chunk == NULL) {
+        UNLOCK_BACKEND();
         fprintf(stderr, "Free chunk returned by findFreeChunk to vmemallocLarge was NULL\n");
         return NULL;
     }
@@ -225,26 +318,104 @@ void* vmemallocLarge(int sizeRequested) {
         SET_SIZE(chunk, size);
         chunkSize = size;
     }
-    allocatedSpace += chunkSize;
+    UNLOCK_BACKEND();
+    STAT_ADD(allocatedSpace, chunkSize);
     // Use the free memory after the header.
     return (void*)chunk + sizeof(ChunkHeader);
 }
 
-// Frees a chunk used by a program so it can be reused.
-// Returns the amount of space saved.
-int vmemfreeLarge(void* ptr) {
-    // Find the header.
-    ChunkHeader* allocdChunk = ptr - sizeof(ChunkHeader);
-    if(GET_CHUNK_FREE(allocdChunk)) {
-        fprintf(stderr, "Tried to free a free block\n");
-        return -1;
+// Allocates count chunks of size bytes, splitting them out of as few free chunks as possible.
+// Returns the number of chunks allocated, which is less than count if no more regions could be created.
+Word vmemallocLargeBatch(Word sizeRequested, Word count, void** chunks) {
+    Word size = getLargeChunkSize(sizeRequested);
+    if (size == 0) {
+        return 0;
+    }
+    // Split at most hugeChunkThreshold bytes out of each free chunk, so one region doesn't have to
+    // wait for a whole batch to be freed before it can be unmapped.
+    Word groupCount = hugeChunkThreshold / (size + sizeof(ChunkHeader));
+    if (groupCount == 0) {
+        groupCount = 1;
+    }
+    Word allocated = 0;
+    Word spaceUsed = 0;
+    LOCK_BACKEND();
+    while (allocated < count) {
+        Word pieces = count - allocated < groupCount ? count - allocated : groupCount;
+        ChunkHeader* chunk = findFreeChunk(pieces * (size + sizeof(ChunkHeader)) - sizeof(ChunkHeader), NULL);
+        if (chunk == NULL) {
+            fprintf(stderr, "Free chunk returned by findFreeChunk to vmemallocLargeBatch was NULL\n");
+            break;
+        }
+        Word chunkSize = GET_SIZE(chunk);
+        Word lastChunkOfRegion = GET_LAST_CHUNK_OF_REGION(chunk);
+        // Every piece but the last is size bytes. The last takes what's left, and gives back the rest.
+        for (Word i = 0; i + 1 < pieces; i++) {
+            initAllocdChunk(chunk, size, false, false);
+            chunks[allocated++] = (void*)chunk + sizeof(ChunkHeader);
+            chunk = (ChunkHeader*)((void*)chunk + sizeof(ChunkHeader) + size);
+            chunkSize -= size + sizeof(ChunkHeader);
+            spaceUsed += size;
+        }
+        initAllocdChunk(chunk, chunkSize, lastChunkOfRegion, false);
+        if (chunkSize >= size + MIN_CHUNK_SIZE) {
+            FreeChunkHeader* nextChunk = (FreeChunkHeader*)((void*)chunk + sizeof(ChunkHeader) + size);
+            initFreeChunk(nextChunk, chunkSize - size - sizeof(ChunkHeader), lastChunkOfRegion, false);
+            addChunkToBin(nextChunk);
+            SET_LAST_CHUNK_OF_REGION(chunk, false);
+            SET_SIZE(chunk, size);
+            chunkSize = size;
+        }
+        chunks[allocated++] = (void*)chunk + sizeof(ChunkHeader);
+        spaceUsed += chunkSize;
+    }
+    UNLOCK_BACKEND();
+    STAT_ADD(allocatedSpace, spaceUsed);
+    return allocated;
+}
+
+// Frees chunks sorted by address under one lock, merging the chunks of the batch that are next to
+// each other before coalescing them. Returns the number of chunks freed.
+Word vmemfreeLargeBatch(void** chunks, Word count) {
+    Word freed = 0;
+    Word spaceSaved = 0;
+    LOCK_BACKEND();
+    Word i = 0;
+    while (i < count) {
+        ChunkHeader* chunk = chunks[i++] - sizeof(ChunkHeader);
+        if (GET_CHUNK_FREE(chunk)) {
+            fprintf(stderr, "Tried to free a free block\n");
+            continue;
+        }
+        spaceSaved += GET_SIZE(chunk);
+        freed++;
+        // Take over the next chunk while it is the next one in the batch too.
+        while (i < count && !GET_LAST_CHUNK_OF_REGION(chunk)) {
+            ChunkHeader* nextChunk = (ChunkHeader*)((void*)chunk + sizeof(ChunkHeader) + GET_SIZE(chunk));
+            if (chunks[i] != (void*)nextChunk + sizeof(ChunkHeader) || GET_CHUNK_FREE(nextChunk)) {
+                break;
+            }
+            spaceSaved += GET_SIZE(nextChunk);
+            freed++;
+            i++;
+            SET_SIZE(chunk, GET_SIZE(chunk) + sizeof(ChunkHeader) + GET_SIZE(nextChunk));
+            SET_LAST_CHUNK_OF_REGION(chunk, GET_LAST_CHUNK_OF_REGION(nextChunk));
+        }
+        releaseChunk(chunk);
     }
+    scavengeAfterFree(spaceSaved);
+    UNLOCK_BACKEND();
+    STAT_SUB(allocatedSpace, spaceSaved);
+    return freed;
+}
+
+// Returns an allocated chunk to the bins, coalescing it with its neighbours.
+void releaseChunk(ChunkHeader* allocdChunk) {
     FreeChunkHeader* chunk = makeChunkFree(allocdChunk);
-    int spaceSaved = (int)GET_SIZE(chunk);
 
     if (! GET_LAST_CHUNK_OF_REGION(chunk)) {
         // Coalesce forwards if possible.
-        ChunkHeader* nextChunk = (ChunkHeader*)((void*)chunk + sizeof(chunk) + GET_SIZE(chunk));
+        ChunkHeader* nextChunk = (ChunkHeader*)((void*)chunk + sizeof(ChunkHeader) + GET_SIZE(chunk));
         if (GET_CHUNK_FREE(nextChunk)) {
             removeChunkFromBin((FreeChunkHeader*)nextChunk);
             Word newSize = GET_SIZE(chunk) + sizeof(ChunkHeader) + GET_SIZE(nextChunk);
@@ -261,6 +432,8 @@ int vmemfreeLarge(void* ptr) {
         Word newSize = GET_SIZE(previousChunk) + sizeof(ChunkHeader) + GET_SIZE(chunk);
         SET_SIZE(previousChunk, newSize);
         SET_LAST_CHUNK_OF_REGION(previousChunk, GET_LAST_CHUNK_OF_REGION(chunk));
+        // The pages of the chunk being freed are resident, so the whole chunk is scavenged again.
+        SET_DECOMMITTED(previousChunk, false);
         chunk = previousChunk;
     }
     // Make a footer for the chunk.
@@ -273,6 +446,123 @@ int vmemfreeLarge(void* ptr) {
         // Add to the bins for reuse.
         addChunkToBin(chunk);
     }
-    allocatedSpace -= spaceSaved;
+}
+
+// Cuts an allocated chunk down to size bytes, if the rest is big enough to be a chunk, and frees the rest.
+// The caller must hold the backend lock.
+void trimChunk(ChunkHeader* chunk, Word size) {
+    Word chunkSize = GET_SIZE(chunk);
+    if (chunkSize < size + sizeof(ChunkHeader) + MIN_CHUNK_SIZE) {
+        return;
+    }
+    ChunkHeader* rest = (ChunkHeader*)((void*)chunk + sizeof(ChunkHeader) + size);
+    initAllocdChunk(rest, chunkSize - size - sizeof(ChunkHeader), GET_LAST_CHUNK_OF_REGION(chunk), false);
+    SET_LAST_CHUNK_OF_REGION(chunk, false);
+    SET_SIZE(chunk, size);
+    // Coalesces the rest with the next chunk if it is free.
+    releaseChunk(rest);
+}
+
+// Returns a chunk for use by a program, where the chunk is a multiple of alignment bytes from the start
+// of the address space. alignment must be a power of two larger than LARGEST_ALIGNMENT.
+void* vmemallocLargeAligned(Word alignment, Word sizeRequested) {
+    Word size = getLargeChunkSize(sizeRequested);
+    if (size == 0 || alignment > (SIZE_MASK >> 2)) {
+        return NULL;
+    }
+    // The chunk searched for must still fit in the size bits of a header.
+    if (size > SIZE_MASK - alignment - sizeof(ChunkHeader) - MIN_CHUNK_SIZE) {
+        fprintf(stderr, "Too big to allocate\n");
+        return NULL;
+    }
+    LOCK_BACKEND();
+    // Leave room to move the start of the chunk forward by up to alignment bytes, and for the
+    // space skipped to be a free chunk of its own.
+    ChunkHeader* chunk = findFreeChunk(size + alignment + sizeof(ChunkHeader) + MIN_CHUNK_SIZE, NULL);
+    if (chunk == NULL) {
+        UNLOCK_BACKEND();
+        fprintf(stderr, "Free chunk returned by findFreeChunk to vmemallocLargeAligned was NULL\n");
+        return NULL;
+    }
+    void* ptr = (void*)chunk + sizeof(ChunkHeader);
+    if ((Word)ptr % alignment != 0) {
+        // Split off the start of the chunk as a free chunk. Both ptr and the aligned address are multiples
+        // of LARGEST_ALIGNMENT, so the leading chunk's size is a multiple of it plus ALIGNMENT_OFFSET.
+        void* alignedPtr = (void*)CEIL((Word)ptr + sizeof(ChunkHeader) + MIN_CHUNK_SIZE, alignment);
+        ChunkHeader* alignedChunk = (ChunkHeader*)(alignedPtr - sizeof(ChunkHeader));
+        Word leadingSize = (void*)alignedChunk - ptr;
+        initAllocdChunk(alignedChunk, GET_SIZE(chunk) - leadingSize - sizeof(ChunkHeader),
+            GET_LAST_CHUNK_OF_REGION(chunk), false);
+        SET_LAST_CHUNK_OF_REGION(chunk, false);
+        SET_SIZE(chunk, leadingSize);
+        // Coalesces the leading chunk with the previous chunk if it is free.
+        releaseChunk(chunk);
+        chunk = alignedChunk;
+    }
+    // Give back the end of the chunk.
+    trimChunk(chunk, size);
+    Word chunkSize = GET_SIZE(chunk);
+    UNLOCK_BACKEND();
+    STAT_ADD(allocatedSpace, chunkSize);
+    return (void*)chunk + sizeof(ChunkHeader);
+}
+
+// Resizes an allocated chunk without moving it. It shrinks by freeing its end, and grows by taking
+// over the next chunk (found with the boundary tags) if that is free and big enough.
+// Returns true on success, or false if the chunk would have to move.
+Word resizeLargeInPlace(void* ptr, Word sizeRequested) {
+    ChunkHeader* chunk = (ChunkHeader*)(ptr - sizeof(ChunkHeader));
+    Word size = getLargeChunkSize(sizeRequested);
+    if (size == 0) {
+        return false;
+    }
+    LOCK_BACKEND();
+    Word oldSize = GET_SIZE(chunk);
+    if (size > oldSize) {
+        if (GET_LAST_CHUNK_OF_REGION(chunk)) {
+            UNLOCK_BACKEND();
+            return false;
+        }
+        ChunkHeader* nextChunk = (ChunkHeader*)((void*)chunk + sizeof(ChunkHeader) + oldSize);
+        Word combinedSize = oldSize + sizeof(ChunkHeader) + GET_SIZE(nextChunk);
+        if (!GET_CHUNK_FREE(nextChunk) || combinedSize < size) {
+            UNLOCK_BACKEND();
+            return false;
+        }
+        removeChunkFromBin((FreeChunkHeader*)nextChunk);
+        SET_SIZE(chunk, combinedSize);
+        SET_LAST_CHUNK_OF_REGION(chunk, GET_LAST_CHUNK_OF_REGION(nextChunk));
+        // The chunk after the next chunk now follows an allocated chunk.
+        makeChunkAllocated((FreeChunkHeader*)chunk);
+    }
+    trimChunk(chunk, size);
+    Word newSize = GET_SIZE(chunk);
+    UNLOCK_BACKEND();
+    STAT_ADD(allocatedSpace, (int64_t)newSize - (int64_t)oldSize);
+    return true;
+}
+
+// Frees a chunk used by a program so it can be reused.
+// Returns the amount of space saved, or 0 if the chunk is already free.
+Word vmemfreeLarge(void* ptr) {
+    // Find the header.
+    ChunkHeader* chunk = ptr - sizeof(ChunkHeader);
+    if(GET_CHUNK_FREE(chunk)) {
+        fprintf(stderr, "Tried to free a free block\n");
+        return 0;
+    }
+    Word spaceSaved = GET_SIZE(chunk);
+#ifdef VMEM_THREAD_SAFE
+    // Keep the chunk for this thread to reuse without taking the lock.
+    if (cacheChunk(chunk)) {
+        STAT_SUB(allocatedSpace, spaceSaved);
+        return spaceSaved;
+    }
+#endif
+    LOCK_BACKEND();
+    releaseChunk(chunk);
+    scavengeAfterFree(spaceSaved);
+    UNLOCK_BACKEND();
+    STAT_SUB(allocatedSpace, spaceSaved);
     return spaceSaved;
 }
@@ -33,8 +33,11 @@ typedef ChunkHeader* RegionFooter;
 #define PREVIOUS_CHUNK_FREE_MASK 0x2 // 0x0...010
 // Highest bit indicates whether the chunk is free.
 #define CHUNK_FREE_MASK ~(~(Word)0 >> 1) // 0x10...0
+// Second highest bit indicates whether the scavenger has released the pages inside a free chunk.
+// Sizes are limited to a quarter of the address space, so it is never part of the size.
+#define DECOMMITTED_MASK (~(Word)0 >> 1 & ~(~(Word)0 >> 2)) // 0x010...0
 // The other bits are used to define the size of the chunk.
-#define SIZE_MASK ~(LAST_CHUNK_OF_REGION_MASK | PREVIOUS_CHUNK_FREE_MASK | CHUNK_FREE_MASK)
+#define SIZE_MASK ~(LAST_CHUNK_OF_REGION_MASK | PREVIOUS_CHUNK_FREE_MASK | CHUNK_FREE_MASK | DECOMMITTED_MASK)
 
 
 #define RESET_HEADER(chunk) *(ChunkHeader*)chunk = (ChunkHeader)0
@@ -44,16 +47,18 @@ typedef ChunkHeader* RegionFooter;
 #define MODIFY_HEADER(chunk, mask, value) chunk = (((ChunkHeader)(chunk)) & ~(mask)) | ((mask) & (value))
 
 // Getters for the header.
-#define GET_LAST_CHUNK_OF_REGION(chunkPtr) GET_FROM_HEADER(*(ChunkHeader*)chunkPtr, LAST_CHUNK_OF_REGION_MASK)
-#define GET_PREVIOUS_CHUNK_FREE(chunkPtr) GET_FROM_HEADER(*(ChunkHeader*)chunkPtr, PREVIOUS_CHUNK_FREE_MASK)
-#define GET_CHUNK_FREE(chunkPtr) GET_FROM_HEADER(*(ChunkHeader*)chunkPtr, CHUNK_FREE_MASK)
-#define GET_SIZE(chunkPtr) GET_FROM_HEADER(*(ChunkHeader*)chunkPtr, SIZE_MASK)
+#define GET_LAST_CHUNK_OF_REGION(chunkPtr) GET_FROM_HEADER(*(ChunkHeader*)(chunkPtr), LAST_CHUNK_OF_REGION_MASK)
+#define GET_PREVIOUS_CHUNK_FREE(chunkPtr) GET_FROM_HEADER(*(ChunkHeader*)(chunkPtr), PREVIOUS_CHUNK_FREE_MASK)
+#define GET_CHUNK_FREE(chunkPtr) GET_FROM_HEADER(*(ChunkHeader*)(chunkPtr), CHUNK_FREE_MASK)
+#define GET_DECOMMITTED(chunkPtr) GET_FROM_HEADER(*(ChunkHeader*)(chunkPtr), DECOMMITTED_MASK)
+#define GET_SIZE(chunkPtr) GET_FROM_HEADER(*(ChunkHeader*)(chunkPtr), SIZE_MASK)
 
 // Setters for the header.
-#define SET_LAST_CHUNK_OF_REGION(chunkPtr, value) MODIFY_HEADER(*(ChunkHeader*)chunkPtr, LAST_CHUNK_OF_REGION_MASK, (Word)value)
-#define SET_PREVIOUS_CHUNK_FREE(chunkPtr, value) MODIFY_HEADER(*(ChunkHeader*)chunkPtr, PREVIOUS_CHUNK_FREE_MASK, (Word)value)
-#define SET_CHUNK_FREE(chunkPtr, value) MODIFY_HEADER(*(ChunkHeader*)chunkPtr, CHUNK_FREE_MASK, (Word)value)
-#define SET_SIZE(chunkPtr, value) MODIFY_HEADER(*(ChunkHeader*)chunkPtr, SIZE_MASK, (Word)value)
+#define SET_LAST_CHUNK_OF_REGION(chunkPtr, value) MODIFY_HEADER(*(ChunkHeader*)(chunkPtr), LAST_CHUNK_OF_REGION_MASK, (Word)value)
+#define SET_PREVIOUS_CHUNK_FREE(chunkPtr, value) MODIFY_HEADER(*(ChunkHeader*)(chunkPtr), PREVIOUS_CHUNK_FREE_MASK, (Word)value)
+#define SET_CHUNK_FREE(chunkPtr, value) MODIFY_HEADER(*(ChunkHeader*)(chunkPtr), CHUNK_FREE_MASK, (Word)value)
+#define SET_DECOMMITTED(chunkPtr, value) MODIFY_HEADER(*(ChunkHeader*)(chunkPtr), DECOMMITTED_MASK, (Word)value)
+#define SET_SIZE(chunkPtr, value) MODIFY_HEADER(*(ChunkHeader*)(chunkPtr), SIZE_MASK, (Word)value)
 
 // Footer is at end of free chunk or region.
 #define GET_FREE_CHUNK_FOOTER(chunk) (FreeChunkFooter*)((void*)chunk + sizeof(ChunkHeader) + GET_SIZE(chunk) - sizeof(FreeChunkFooter))
@@ -66,14 +71,81 @@ typedef ChunkHeader* RegionFooter;
 // Number of bins to store chunks with sizes in the same order of magnitude.
 #define NUM_BINS (sizeof(Word) * CHAR_BIT)
 
+// Each bin is split into sub-bins covering equal ranges of sizes (two-level segregated fit).
+#define SUB_BIN_BITS 4
+#define NUM_SUB_BINS (1 << SUB_BIN_BITS)
+
 // A chunk must be able to hold all data stored in a free chunk.
 #define MIN_CHUNK_SIZE (sizeof(FreeChunkHeader) - sizeof(ChunkHeader) + sizeof(FreeChunkFooter))
 
+// Lists of free chunks for each bin and sub-bin, and bitmaps of the ones in use. Protected by the backend lock.
+extern FreeChunkHeader* bins[NUM_BINS][NUM_SUB_BINS];
+extern Word binBitmap;
+extern Word subBinBitmaps[NUM_BINS];
+
+// Create a new region containing an allocated chunk of at least size bytes, committing it from a
+// reservation where possible. If zeroed isn't NULL, it is set to true if the chunk is known to be
+// filled with zeros. The caller must hold the backend lock.
+extern ChunkHeader* newRegion(Word size, Word* zeroed);
+
+// Lays out regionSize bytes at region as a region holding one allocated chunk, and returns the chunk.
+extern ChunkHeader* initRegion(void* region, Word regionSize);
+
+// Use mmap to create a region of its own, containing an allocated chunk of at least size bytes.
+// The caller must hold the backend lock.
+extern ChunkHeader* mapRegion(Word size, Word* zeroed);
+
+// Use munmap to remove a region previously created by mmap, unless it can be cached for reuse.
+// The caller must hold the backend lock.
+extern void removeRegion(FreeChunkHeader* chunk);
+
+// Returns an allocated chunk to the bins, coalescing it with its neighbours.
+// The caller must hold the backend lock.
+extern void releaseChunk(ChunkHeader* chunk);
+
+// Converts an allocated chunk into a free chunk, and returns it.
+extern FreeChunkHeader* makeChunkFree(ChunkHeader* chunk);
+
+// Adds a free chunk to the bin for its size. The caller must hold the backend lock.
+extern void addChunkToBin(FreeChunkHeader* chunk);
+
+// Converts a free chunk into an allocated chunk, and returns it.
+extern ChunkHeader* makeChunkAllocated(FreeChunkHeader* chunk);
+
+// Creates a new allocated chunk at the given location.
+extern void initAllocdChunk(ChunkHeader* chunk, Word size, Word lastChunkOfRegion, Word previousChunkFree);
+
+// Removes a free chunk from its bin. The caller must hold the backend lock.
+extern void removeChunkFromBin(FreeChunkHeader* chunk);
+
+// Gets the bin and sub-bin holding free chunks of the given size.
+extern void getBin(Word size, int* bin, int* subBin);
+
 // Returns a suitable chunk for use by a program.
-extern void* vmemallocLarge(int size);
+// If zeroed isn't NULL, it is set to true if the chunk is known to be filled with zeros.
+extern void* vmemallocLarge(Word size, Word* zeroed);
+
+// Allocates count chunks of size bytes, splitting them out of as few free chunks as possible.
+// Returns the number of chunks allocated, which is less than count if no more regions could be created.
+extern Word vmemallocLargeBatch(Word size, Word count, void** chunks);
+
+// Frees chunks sorted by address under one lock. Chunks of the batch that are next to each other are
+// merged first, so each run is coalesced with its neighbours once. Returns the number of chunks freed.
+extern Word vmemfreeLargeBatch(void** chunks, Word count);
+
+// Returns a chunk for use by a program whose address is a multiple of alignment,
+// which must be a power of two larger than LARGEST_ALIGNMENT.
+extern void* vmemallocLargeAligned(Word alignment, Word size);
+
+// Resizes an allocated chunk without moving it.
+// Returns true on success, or false if the chunk would have to move.
+extern Word resizeLargeInPlace(void* ptr, Word size);
+
+// The size of the chunk used for an allocation of size bytes, or 0 if it is too big.
+extern Word getLargeChunkSize(Word size);
 
 // Frees a chunk used by a program so it can be re-used.
-// Returns the amount of space saved.
-extern int vmemfreeLarge(void* ptr);
+// Returns the amount of space saved, or 0 if the chunk is already free.
+extern Word vmemfreeLarge(void* ptr);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,230 @@
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+#include "vmemalloc_small.h"
+#include "vmemalloc_latency.h"
+#include "vmemalloc_stats.h"
+
+// Set while the histograms are on.
+int latencyTracking = 0;
+
+// Every thread's histograms. Threads only push onto the list, so it is read without a lock.
+static LatencyHistogram* latencyHistograms = NULL;
+
+// Timer and clock readings taken when tracking started, to measure the timer's rate against.
+static Word startTicks;
+static int64_t startNanos;
+
+// Minimum time to measure the rate of the timer over.
+#define CALIBRATION_NANOS 10000000
+
+static const char* latencyOpNames[VMEM_LATENCY_OPS] = {
+    "alloc", "free", "small_alloc", "small_free", "large_alloc", "large_free", "new_region", "remove_region"
+};
+
+// Claims histograms no thread is recording into, or maps new ones. Returns NULL if mapping fails.
+// Histograms are never unmapped, as they hold the counts of threads that have exited.
+LatencyHistogram* claimLatencyHistogram(void) {
+    LatencyHistogram* histogram = __atomic_load_n(&latencyHistograms, __ATOMIC_ACQUIRE);
+    for (; histogram != NULL; histogram = histogram->next) {
+        if (!__atomic_load_n(&histogram->inUse, __ATOMIC_RELAXED)
+                && !__atomic_exchange_n(&histogram->inUse, 1, __ATOMIC_ACQUIRE)) {
+            return histogram;
+        }
+    }
+    histogram = mmap(0, sizeof(LatencyHistogram), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (histogram == MAP_FAILED) {
+        perror("Error mapping latency histograms");
+        return NULL;
+    }
+    COUNT_METADATA_MMAP(sizeof(LatencyHistogram));
+    histogram->inUse = 1;
+    histogram->next = __atomic_load_n(&latencyHistograms, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&latencyHistograms, &histogram->next, histogram, 1,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return histogram;
+}
+
+// Gives back histograms claimed by a thread that is exiting. Their counts are kept.
+void releaseLatencyHistogram(LatencyHistogram* histogram) {
+    __atomic_store_n(&histogram->inUse, 0, __ATOMIC_RELEASE);
+}
+
+// Current time in nanoseconds, from the clock the time stamp counter is measured against.
+static int64_t timeInNanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// The most ticks an operation in the bucket can have taken.
+static Word getLatencyBucketLimit(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    Word lowest = (Word)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << shift;
+    return lowest + (((Word)1 << shift) - 1);
+}
+
+#ifndef VMEM_NO_STATS
+// The bucket for an operation that took ticks.
+static int getLatencyBucket(Word ticks) {
+    if (ticks < LATENCY_SUB_BUCKETS) {
+        return (int)ticks;
+    }
+    int shift = (int)(CHAR_BIT * sizeof(Word)) - 1 - COUNT_LEADING_ZEROS(ticks) - LATENCY_SUB_BUCKET_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + (int)((ticks >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+#ifndef VMEM_THREAD_SAFE
+// The only histograms, used by the whole program.
+static LatencyHistogram* mainLatency = NULL;
+
+static LatencyHistogram* getThreadLatency(void) {
+    if (mainLatency == NULL) {
+        mainLatency = claimLatencyHistogram();
+    }
+    return mainLatency;
+}
+#endif
+
+// Adds to a counter that only the calling thread changes. Readers may load it at the same time, so it
+// is stored whole, but it needs no locked instruction.
+static inline void addOwnCounter(int64_t* counter, int64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+// Adds an operation that took ticks to the calling thread's histogram of op.
+void recordLatency(int op, Word ticks) {
+    LatencyHistogram* histogram = getThreadLatency();
+    if (histogram == NULL) {
+        return;
+    }
+    addOwnCounter(&histogram->buckets[op][getLatencyBucket(ticks)], 1);
+    addOwnCounter(&histogram->ticks[op], (int64_t)ticks);
+}
+#endif
+
+// Adds up the buckets of op over every thread's histograms, and returns their total ticks.
+static int64_t mergeLatencyBuckets(int op, int64_t* counts) {
+    memset(counts, 0, LATENCY_BUCKETS * sizeof(int64_t));
+    int64_t ticks = 0;
+    LatencyHistogram* histogram = __atomic_load_n(&latencyHistograms, __ATOMIC_ACQUIRE);
+    for (; histogram != NULL; histogram = histogram->next) {
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            counts[bucket] += __atomic_load_n(&histogram->buckets[op][bucket], __ATOMIC_RELAXED);
+        }
+        ticks += __atomic_load_n(&histogram->ticks[op], __ATOMIC_RELAXED);
+    }
+    return ticks;
+}
+
+// Nanoseconds per tick of the timer, measured since tracking started.
+static double getNanosPerTick(void) {
+    int64_t nanos;
+    // Wait until the measurement is long enough to be accurate.
+    while ((nanos = timeInNanos() - startNanos) < CALIBRATION_NANOS) {
+    }
+    Word ticks = readLatencyTicks() - startTicks;
+    return ticks == 0 ? 1.0 : (double)nanos / (double)ticks;
+}
+
+// Turns the histograms on, clearing them, or off.
+int setLatencyTracking(int enabled) {
+#ifdef VMEM_NO_STATS
+    (void)enabled;
+    fprintf(stderr, "Latency tracking is compiled out of the VMEM_NO_STATS build\n");
+    return -1;
+#else
+    if (enabled) {
+        __atomic_store_n(&latencyTracking, 0, __ATOMIC_RELAXED);
+        LatencyHistogram* histogram = __atomic_load_n(&latencyHistograms, __ATOMIC_ACQUIRE);
+        for (; histogram != NULL; histogram = histogram->next) {
+            memset(histogram->buckets, 0, sizeof(histogram->buckets));
+            memset(histogram->ticks, 0, sizeof(histogram->ticks));
+        }
+        startNanos = timeInNanos();
+        startTicks = readLatencyTicks();
+    }
+    __atomic_store_n(&latencyTracking, enabled != 0, __ATOMIC_RELAXED);
+    return 0;
+#endif
+}
+
+// Fills stats from the merged histogram of op, whose buckets are in counts.
+static void getLatencyStats(const int64_t* counts, int64_t ticks, double nanosPerTick, VmemLatencyStats* stats) {
+    memset(stats, 0, sizeof(VmemLatencyStats));
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        stats->count += counts[bucket];
+    }
+    if (stats->count == 0) {
+        return;
+    }
+    stats->mean = ticks * nanosPerTick / stats->count;
+    // Each percentile is the upper limit of the bucket holding the operation at that rank.
+    double fractions[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+    uint64_t* results[] = {&stats->p50, &stats->p90, &stats->p99, &stats->p999, &stats->max};
+    int bucket = 0;
+    uint64_t seen = counts[0];
+    for (int i = 0; i < 5; i++) {
+        uint64_t rank = (uint64_t)(fractions[i] * stats->count + 0.5);
+        if (rank == 0) {
+            rank = 1;
+        }
+        while (seen < rank) {
+            seen += counts[++bucket];
+        }
+        *results[i] = (uint64_t)(getLatencyBucketLimit(bucket) * nanosPerTick + 0.5);
+    }
+}
+
+// Fills stats with the latency of an operation.
+int vmemlatency(int op, VmemLatencyStats* stats) {
+    if (op < 0 || op >= VMEM_LATENCY_OPS || stats == NULL) {
+        fprintf(stderr, "arguments passed to vmemlatency were invalid (%d, %p)\n", op, (void*)stats);
+        return -1;
+    }
+    int64_t counts[LATENCY_BUCKETS];
+    int64_t ticks = mergeLatencyBuckets(op, counts);
+    getLatencyStats(counts, ticks, getNanosPerTick(), stats);
+    return 0;
+}
+
+// Writes a summary and the non-empty buckets of every histogram to a file.
+int vmemlatency_dump(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Error opening latency file");
+        return -1;
+    }
+    double nanosPerTick = getNanosPerTick();
+    for (int op = 0; op < VMEM_LATENCY_OPS; op++) {
+        int64_t counts[LATENCY_BUCKETS];
+        int64_t ticks = mergeLatencyBuckets(op, counts);
+        VmemLatencyStats stats;
+        getLatencyStats(counts, ticks, nanosPerTick, &stats);
+        fprintf(file, "%s count=%llu mean=%.1f p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n",
+            latencyOpNames[op], (unsigned long long)stats.count, stats.mean, (unsigned long long)stats.p50,
+            (unsigned long long)stats.p90, (unsigned long long)stats.p99, (unsigned long long)stats.p999,
+            (unsigned long long)stats.max);
+        // Buckets are given by the range of nanoseconds they cover, and their count.
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            int64_t count = counts[bucket];
+            if (count != 0) {
+                Word lowest = bucket == 0 ? 0 : getLatencyBucketLimit(bucket - 1) + 1;
+                fprintf(file, "  %.0f-%.0f %lld\n", lowest * nanosPerTick,
+                    (getLatencyBucketLimit(bucket) + 1) * nanosPerTick, (long long)count);
+            }
+        }
+    }
+    if (fclose(file)) {
+        perror("Error writing latency file");
+        return -1;
+    }
+    return 0;
+}
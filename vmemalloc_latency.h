@@ -0,0 +1,77 @@
+#ifndef VMEMALLOC_LATENCY_GUARD
+#define VMEMALLOC_LATENCY_GUARD
+
+#include <time.h>
+
+// Latency histograms. While setLatencyTracking has turned them on, timed operations read the time stamp
+// counter before and after, and add the difference to a log-linear histogram for the operation:
+// counts below LATENCY_SUB_BUCKETS ticks are exact, and each power of two above is split into
+// LATENCY_SUB_BUCKETS buckets, so a bucket is never more than an eighth wider than its lower bound. Ticks
+// are converted to nanoseconds when the histograms are read. Compiled out, like tracing, in the
+// VMEM_NO_STATS build.
+
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+
+// Enough buckets for any number of ticks that fits in a Word.
+#define LATENCY_BUCKETS ((int)(CHAR_BIT * sizeof(Word) - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+// Set while the histograms are on.
+extern int latencyTracking;
+
+// The histograms of every operation. Each thread records into its own, so timing never writes a cache
+// line that another thread writes, and they are merged when they are read.
+typedef struct LatencyHistogram {
+    // Number of operations in each bucket, and the total ticks, of each histogram.
+    int64_t buckets[VMEM_LATENCY_OPS][LATENCY_BUCKETS];
+    int64_t ticks[VMEM_LATENCY_OPS];
+    // Next in the list of all histograms, which only grows.
+    struct LatencyHistogram* next;
+    // Set while a thread records into the histograms.
+    int inUse;
+} LatencyHistogram;
+
+// Claims histograms no thread is recording into, or maps new ones. Returns NULL if mapping fails.
+extern LatencyHistogram* claimLatencyHistogram(void);
+
+// Gives back histograms claimed by a thread that is exiting. Their counts are kept.
+extern void releaseLatencyHistogram(LatencyHistogram* histogram);
+
+#ifdef VMEM_THREAD_SAFE
+// Returns the histograms of the calling thread, claiming them on its first timed operation.
+extern LatencyHistogram* getThreadLatency(void);
+#endif
+
+// Adds an operation that took ticks to the histogram of op (one of VMEM_LATENCY_ALLOC and so on).
+extern void recordLatency(int op, Word ticks);
+
+// Reads the time stamp counter, which takes a few cycles, or the monotonic clock where there isn't one.
+static inline Word readLatencyTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    Word ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (Word)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+#ifdef VMEM_NO_STATS
+#define LATENCY_START() ((Word)0)
+#define LATENCY_END(op, start) ((void)(start))
+#else
+// Gives the start time of an operation, or 0 if the histograms are off.
+#define LATENCY_START() (latencyTracking ? readLatencyTicks() : (Word)0)
+// Records an operation started by LATENCY_START.
+#define LATENCY_END(op, start) do { \
+        if ((start) != 0) { \
+            recordLatency((op), readLatencyTicks() - (start)); \
+        } \
+    } while (0)
+#endif
+
+#endif
@@ -0,0 +1,158 @@
+#include <sys/mman.h>
+
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+#include "vmemalloc_small.h"
+#include "vmemalloc_pagemap.h"
+#include "vmemalloc_stats.h"
+
+#define PAGE_MAP_LEAF_SIZE ((Word)1 << PAGE_MAP_LEAF_BITS)
+#define PAGE_MAP_MIDDLE_SIZE ((Word)1 << PAGE_MAP_MIDDLE_BITS)
+#define PAGE_MAP_ROOT_SIZE ((Word)1 << PAGE_MAP_ROOT_BITS)
+
+// Indexes into each level of the tree for a page number.
+#define LEAF_INDEX(page) ((page) & (PAGE_MAP_LEAF_SIZE - 1))
+#define MIDDLE_INDEX(page) (((page) >> PAGE_MAP_LEAF_BITS) & (PAGE_MAP_MIDDLE_SIZE - 1))
+#define ROOT_INDEX(page) (((page) >> (PAGE_MAP_LEAF_BITS + PAGE_MAP_MIDDLE_BITS)) & (PAGE_MAP_ROOT_SIZE - 1))
+
+typedef struct PageMapLeaf {
+    PageMapEntry entries[PAGE_MAP_LEAF_SIZE];
+} PageMapLeaf;
+
+typedef struct PageMapMiddle {
+    PageMapLeaf* leaves[PAGE_MAP_MIDDLE_SIZE];
+} PageMapMiddle;
+
+// Nodes below the root are created on demand and never removed.
+PageMapMiddle* pageMapRoot[PAGE_MAP_ROOT_SIZE];
+
+// Bytes mapped for nodes at a time. Only the pages of nodes that are used become resident.
+#define PAGE_MAP_NODE_BATCH (1024 * 1024)
+
+// The part of the newest batch that hasn't been used for nodes yet.
+static void* nextNode = NULL;
+static Word nodeSpaceLeft = 0;
+
+// Nodes are mapped directly, as the allocator cannot be used to allocate its own metadata. They are
+// carved out of bigger mappings, so a region growing into a new part of the address space doesn't
+// have to map its page map nodes one at a time.
+void* newPageMapNode(Word size) {
+    if (size > nodeSpaceLeft) {
+        void* batch = mmap(0, PAGE_MAP_NODE_BATCH, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (batch == MAP_FAILED) {
+            perror("Error creating page map node");
+            return NULL;
+        }
+        COUNT_METADATA_MMAP(PAGE_MAP_NODE_BATCH);
+        nextNode = batch;
+        nodeSpaceLeft = PAGE_MAP_NODE_BATCH;
+    }
+    void* node = nextNode;
+    nextNode += size;
+    nodeSpaceLeft -= size;
+    return node;
+}
+
+// Finds the leaf for a page number, creating it if create is set.
+// Nodes are only created with the backend lock held, but may be read by any thread at any time,
+// so they are published with release stores.
+PageMapLeaf* getPageMapLeaf(Word page, int create) {
+    PageMapMiddle** middlePtr = &pageMapRoot[ROOT_INDEX(page)];
+    PageMapMiddle* middle = __atomic_load_n(middlePtr, __ATOMIC_ACQUIRE);
+    if (middle == NULL) {
+        if (!create || (middle = newPageMapNode(sizeof(PageMapMiddle))) == NULL) {
+            return NULL;
+        }
+        __atomic_store_n(middlePtr, middle, __ATOMIC_RELEASE);
+    }
+    PageMapLeaf** leafPtr = &middle->leaves[MIDDLE_INDEX(page)];
+    PageMapLeaf* leaf = __atomic_load_n(leafPtr, __ATOMIC_ACQUIRE);
+    if (leaf == NULL) {
+        if (!create || (leaf = newPageMapNode(sizeof(PageMapLeaf))) == NULL) {
+            return NULL;
+        }
+        __atomic_store_n(leafPtr, leaf, __ATOMIC_RELEASE);
+    }
+    return leaf;
+}
+
+// Sets the entry of every page in [start, start + length), one leaf at a time.
+int fillPageMap(void* start, Word length, PageMapEntry entry, int create) {
+    Word page = (Word)start >> PAGE_MAP_SHIFT;
+    Word lastPage = ((Word)start + length - 1) >> PAGE_MAP_SHIFT;
+    while (page <= lastPage) {
+        PageMapLeaf* leaf = getPageMapLeaf(page, create);
+        Word index = LEAF_INDEX(page);
+        Word count = PAGE_MAP_LEAF_SIZE - index;
+        if (count > lastPage - page + 1) {
+            count = lastPage - page + 1;
+        }
+        if (leaf != NULL) {
+            for (Word i = 0; i < count; i++) {
+                leaf->entries[index + i] = entry;
+            }
+        } else if (create) {
+            return -1;
+        }
+        page += count;
+    }
+    return 0;
+}
+
+// Records owner as the owner of every page in [start, start + length).
+int setPageOwner(void* start, Word length, void* owner, Word kind) {
+    return fillPageMap(start, length, (Word)owner | kind, 1);
+}
+
+// Forgets the owner of every page in [start, start + length).
+void clearPageOwner(void* start, Word length) {
+    fillPageMap(start, length, PAGE_FOREIGN, 0);
+}
+
+// Returns the entry for the page containing ptr, or PAGE_FOREIGN.
+PageMapEntry getPageOwner(void* ptr) {
+    Word page = (Word)ptr >> PAGE_MAP_SHIFT;
+    // Pointers outside of the user address space can't be in the tree.
+    if (page >> (PAGE_MAP_ADDRESS_BITS - PAGE_MAP_SHIFT)) {
+        return PAGE_FOREIGN;
+    }
+    PageMapMiddle* middle = __atomic_load_n(&pageMapRoot[ROOT_INDEX(page)], __ATOMIC_ACQUIRE);
+    if (middle == NULL) {
+        return PAGE_FOREIGN;
+    }
+    PageMapLeaf* leaf = __atomic_load_n(&middle->leaves[MIDDLE_INDEX(page)], __ATOMIC_ACQUIRE);
+    if (leaf == NULL) {
+        return PAGE_FOREIGN;
+    }
+    return leaf->entries[LEAF_INDEX(page)];
+}
+
+// Calls visit for every run of consecutive pages with the same entry, other than PAGE_FOREIGN.
+void visitPageMap(void (*visit)(void* start, Word length, PageMapEntry entry, void* context), void* context) {
+    for (Word rootIndex = 0; rootIndex < PAGE_MAP_ROOT_SIZE; rootIndex++) {
+        PageMapMiddle* middle = __atomic_load_n(&pageMapRoot[rootIndex], __ATOMIC_ACQUIRE);
+        if (middle == NULL) {
+            continue;
+        }
+        for (Word middleIndex = 0; middleIndex < PAGE_MAP_MIDDLE_SIZE; middleIndex++) {
+            PageMapLeaf* leaf = __atomic_load_n(&middle->leaves[middleIndex], __ATOMIC_ACQUIRE);
+            if (leaf == NULL) {
+                continue;
+            }
+            Word firstPage = ((rootIndex << PAGE_MAP_MIDDLE_BITS) | middleIndex) << PAGE_MAP_LEAF_BITS;
+            Word index = 0;
+            while (index < PAGE_MAP_LEAF_SIZE) {
+                PageMapEntry entry = leaf->entries[index];
+                Word runEnd = index + 1;
+                while (runEnd < PAGE_MAP_LEAF_SIZE && leaf->entries[runEnd] == entry) {
+                    runEnd++;
+                }
+                if (entry != PAGE_FOREIGN) {
+                    visit((void*)((firstPage + index) << PAGE_MAP_SHIFT), (runEnd - index) << PAGE_MAP_SHIFT,
+                        entry, context);
+                }
+                index = runEnd;
+            }
+        }
+    }
+}
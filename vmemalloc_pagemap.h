@@ -0,0 +1,55 @@
+#ifndef VMEMALLOC_PAGEMAP_GUARD
+#define VMEMALLOC_PAGEMAP_GUARD
+
+// The page map is a three level radix tree mapping the number of every page mapped by the
+// allocator to its owner, so the owner of any pointer can be found in constant time.
+
+// Pages are tracked at this granularity, which divides the page size on every supported system.
+#define PAGE_MAP_SHIFT 12
+#define PAGE_MAP_PAGE_SIZE ((Word)1 << PAGE_MAP_SHIFT)
+
+// Bits of a virtual address in use - 48 on x86-64 and aarch64.
+#define PAGE_MAP_ADDRESS_BITS (sizeof(Word) == 8 ? 48 : 32)
+
+// Each level of the tree resolves a third of the page number.
+#define PAGE_MAP_LEAF_BITS ((PAGE_MAP_ADDRESS_BITS - PAGE_MAP_SHIFT) / 3)
+#define PAGE_MAP_MIDDLE_BITS PAGE_MAP_LEAF_BITS
+#define PAGE_MAP_ROOT_BITS (PAGE_MAP_ADDRESS_BITS - PAGE_MAP_SHIFT - PAGE_MAP_LEAF_BITS - PAGE_MAP_MIDDLE_BITS)
+
+// An entry is an owner pointer with the kind of owner packed into its low bits.
+// Owners are always aligned to at least LARGEST_ALIGNMENT, so the low bits are free.
+typedef Word PageMapEntry;
+
+// Page is not owned by the allocator.
+#define PAGE_FOREIGN ((Word)0)
+// Page is part of a region of large chunks. The owner is the first chunk of the region.
+#define PAGE_LARGE ((Word)1)
+// Page holds a container of small chunks. The owner is the container.
+#define PAGE_CONTAINER ((Word)2)
+// Page is the first page of the mapping of a huge chunk. The owner is the chunk.
+#define PAGE_HUGE ((Word)3)
+
+#define PAGE_KIND_MASK ((Word)3)
+
+// Set with PAGE_LARGE if the region was mapped from the hugetlbfs pool. Owners are aligned to at
+// least ALIGNMENT_OFFSET + sizeof(ChunkHeader), so there is room for one more bit.
+#define PAGE_HUGETLB ((Word)4)
+
+#define GET_PAGE_KIND(entry) ((entry) & PAGE_KIND_MASK)
+#define GET_PAGE_OWNER(entry) ((void*)((entry) & ~(PAGE_KIND_MASK | PAGE_HUGETLB)))
+
+// Records owner as the owner of every page in [start, start + length).
+// Returns 0 on success or -1 if the tree could not be extended. The caller must hold the backend lock.
+extern int setPageOwner(void* start, Word length, void* owner, Word kind);
+
+// Forgets the owner of every page in [start, start + length).
+extern void clearPageOwner(void* start, Word length);
+
+// Returns the entry for the page containing ptr, or PAGE_FOREIGN.
+extern PageMapEntry getPageOwner(void* ptr);
+
+// Calls visit for every run of consecutive pages with the same entry, other than PAGE_FOREIGN,
+// in address order. Runs never cross a leaf of the tree. The caller must hold the backend lock.
+extern void visitPageMap(void (*visit)(void* start, Word length, PageMapEntry entry, void* context), void* context);
+
+#endif
@@ -0,0 +1,223 @@
+#include <string.h>
+
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+
+// Pools take their blocks from the large allocator, aligned to the block size, so the block of an
+// object is found by rounding its address down. A block starts with a PoolBlock header, padded to the
+// alignment of the objects, and is carved into objects lazily as the pool grows. Free objects are kept
+// on one LIFO list per pool, linked through their first word.
+
+typedef struct PoolBlock {
+    struct PoolBlock* next;
+    // Objects of the block that are allocated. The block can be given back when this is 0.
+    Word inUse;
+} PoolBlock;
+
+#define DEFAULT_POOL_BLOCK_SIZE (64 * 1024)
+
+// Blocks are made bigger for big objects, so each holds at least this many.
+#define MIN_POOL_BLOCK_OBJECTS 16
+
+#define MAX_POOL_OBJECT_SIZE (64 * 1024)
+
+// Per-pool counters, compiled out of the VMEM_NO_STATS build.
+#ifdef VMEM_NO_STATS
+#define POOL_STAT(statement) ((void)0)
+#else
+#define POOL_STAT(statement) (statement)
+#endif
+
+#define GET_POOL_BLOCK(pool, ptr) ((PoolBlock*)((Word)(ptr) & ~((pool)->blockSize - 1)))
+
+struct VmemPool {
+    // Stack of freed objects.
+    void* freeList;
+    // The part of the newest block that hasn't been handed out yet.
+    void* next;
+    void* end;
+    PoolBlock* blocks;
+    Word objectSize;
+    Word blockSize;
+    // Offset of the first object in a block.
+    Word headerSize;
+    Word blockCount;
+#ifndef VMEM_NO_STATS
+    Word objectsInUse;
+    Word peakObjectsInUse;
+    Word allocCount;
+    Word freeCount;
+    Word blocksReleased;
+#endif
+};
+
+/*  Create a pool of objects of 'objectSize' bytes aligned to 'alignment', or like vmemalloc if
+    'alignment' is 0. On failure NULL is returned. */
+VmemPool* vmempool_create(size_t objectSize, size_t alignment) {
+    if (alignment == 0) {
+        alignment = LARGEST_ALIGNMENT;
+    }
+    if (objectSize == 0 || objectSize > MAX_POOL_OBJECT_SIZE || (alignment & (alignment - 1)) != 0
+            || alignment > MAX_POOL_OBJECT_SIZE) {
+        fprintf(stderr, "arguments passed to vmempool_create were invalid (%zu, %zu)\n", objectSize, alignment);
+        return NULL;
+    }
+    // Free objects hold a pointer to the next one.
+    if (alignment < sizeof(void*)) {
+        alignment = sizeof(void*);
+    }
+    VmemPool* pool = vmemalloc(sizeof(VmemPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->freeList = NULL;
+    pool->next = NULL;
+    pool->end = NULL;
+    pool->blocks = NULL;
+    pool->objectSize = CEIL(objectSize, alignment);
+    pool->headerSize = CEIL(sizeof(PoolBlock), alignment);
+    pool->blockSize = DEFAULT_POOL_BLOCK_SIZE;
+    while ((pool->blockSize - pool->headerSize) / pool->objectSize < MIN_POOL_BLOCK_OBJECTS) {
+        pool->blockSize *= 2;
+    }
+    pool->blockCount = 0;
+    POOL_STAT(pool->objectsInUse = 0);
+    POOL_STAT(pool->peakObjectsInUse = 0);
+    POOL_STAT(pool->allocCount = 0);
+    POOL_STAT(pool->freeCount = 0);
+    POOL_STAT(pool->blocksReleased = 0);
+    return pool;
+}
+
+// Gets a new block from the large allocator and hands out its first object.
+static void* allocFromNewPoolBlock(VmemPool* pool) {
+    PoolBlock* block = vmemallocLargeAligned(pool->blockSize, pool->blockSize);
+    if (block == NULL) {
+        fprintf(stderr, "error in vmemallocLargeAligned(%zu, %zu) for a pool block\n", (size_t)pool->blockSize,
+            (size_t)pool->blockSize);
+        return NULL;
+    }
+    STAT_ADD(allocatedChunkCount, 1);
+    block->next = pool->blocks;
+    block->inUse = 0;
+    pool->blocks = block;
+    pool->blockCount++;
+    void* ptr = (void*)block + pool->headerSize;
+    pool->next = ptr + pool->objectSize;
+    pool->end = ptr + (pool->blockSize - pool->headerSize) / pool->objectSize * pool->objectSize;
+    return ptr;
+}
+
+/*  Allocate an object from 'pool'. On failure NULL is returned. */
+void* vmempool_alloc(VmemPool* pool) {
+    if (pool == NULL) {
+        fprintf(stderr, "pool passed to vmempool_alloc was NULL\n");
+        return NULL;
+    }
+    void* ptr = pool->freeList;
+    if (ptr != NULL) {
+        pool->freeList = *(void**)ptr;
+    } else if (pool->next < pool->end) {
+        ptr = pool->next;
+        pool->next += pool->objectSize;
+    } else if ((ptr = allocFromNewPoolBlock(pool)) == NULL) {
+        return NULL;
+    }
+    GET_POOL_BLOCK(pool, ptr)->inUse++;
+    POOL_STAT(pool->allocCount++);
+#ifndef VMEM_NO_STATS
+    if (++pool->objectsInUse > pool->peakObjectsInUse) {
+        pool->peakObjectsInUse = pool->objectsInUse;
+    }
+#endif
+    return ptr;
+}
+
+/*  Return an object to 'pool'. */
+void vmempool_free(VmemPool* pool, void* ptr) {
+    if (pool == NULL || ptr == NULL) {
+        fprintf(stderr, "arguments passed to vmempool_free were invalid (%p, %p)\n", (void*)pool, ptr);
+        return;
+    }
+    GET_POOL_BLOCK(pool, ptr)->inUse--;
+    *(void**)ptr = pool->freeList;
+    pool->freeList = ptr;
+    POOL_STAT(pool->freeCount++);
+    POOL_STAT(pool->objectsInUse--);
+}
+
+/*  Give back every block of 'pool' with no objects in use, and return the bytes released. */
+size_t vmempool_shrink(VmemPool* pool) {
+    if (pool == NULL) {
+        fprintf(stderr, "pool passed to vmempool_shrink was NULL\n");
+        return 0;
+    }
+    // Take the objects of empty blocks off the free list first, while the blocks are still there.
+    void** link = &pool->freeList;
+    while (*link != NULL) {
+        if (GET_POOL_BLOCK(pool, *link)->inUse == 0) {
+            *link = *(void**)*link;
+        } else {
+            link = (void**)*link;
+        }
+    }
+    size_t released = 0;
+    PoolBlock** blockLink = &pool->blocks;
+    while (*blockLink != NULL) {
+        PoolBlock* block = *blockLink;
+        if (block->inUse != 0) {
+            blockLink = &block->next;
+            continue;
+        }
+        if (pool->next < pool->end && GET_POOL_BLOCK(pool, pool->next) == block) {
+            // The rest of the newest block goes with it.
+            pool->next = NULL;
+            pool->end = NULL;
+        }
+        *blockLink = block->next;
+        vmemfreeLarge(block);
+        STAT_SUB(allocatedChunkCount, 1);
+        pool->blockCount--;
+        POOL_STAT(pool->blocksReleased++);
+        released += pool->blockSize;
+    }
+    return released;
+}
+
+/*  Fill 'stats' with the counters of 'pool'. */
+int vmempool_stats(VmemPool* pool, VmemPoolStats* stats) {
+    if (pool == NULL || stats == NULL) {
+        fprintf(stderr, "arguments passed to vmempool_stats were invalid (%p, %p)\n", (void*)pool, (void*)stats);
+        return -1;
+    }
+    memset(stats, 0, sizeof(VmemPoolStats));
+    stats->objectSize = pool->objectSize;
+    stats->blockSize = pool->blockSize;
+    stats->blocks = pool->blockCount;
+#ifdef VMEM_NO_STATS
+    return -1;
+#else
+    stats->objectsInUse = pool->objectsInUse;
+    stats->peakObjectsInUse = pool->peakObjectsInUse;
+    stats->allocs = pool->allocCount;
+    stats->frees = pool->freeCount;
+    stats->blocksReleased = pool->blocksReleased;
+    return 0;
+#endif
+}
+
+/*  Free every object allocated from 'pool', and the pool itself. */
+void vmempool_destroy(VmemPool* pool) {
+    if (pool == NULL) {
+        fprintf(stderr, "pool passed to vmempool_destroy was NULL\n");
+        return;
+    }
+    PoolBlock* block = pool->blocks;
+    while (block != NULL) {
+        PoolBlock* next = block->next;
+        vmemfreeLarge(block);
+        STAT_SUB(allocatedChunkCount, 1);
+        block = next;
+    }
+    vmemfree(pool);
+}
@@ -0,0 +1,171 @@
+// Standard allocation functions implemented with vmemalloc, built into libvmemalloc.so so that
+// existing programs can use vmemalloc with LD_PRELOAD. The library is built from the thread-safe objects.
+// Needed for the declarations of aligned_alloc, memalign and malloc_usable_size.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <malloc.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vmemalloc.h"
+
+// The allocator gets all of its memory straight from mmap and keeps its state in static variables,
+// and trace data is only written once setTraceFile has been called, so these are safe to call
+// before main, from other libraries' constructors and from inside stdio.
+
+void* malloc(size_t size) {
+    // malloc(0) must return a pointer that can be freed.
+    void* ptr = vmemalloc(size > 0 ? size : 1);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void* ptr) {
+    // Pointers from the dynamic linker's own allocator, made before this library was loaded, are ignored.
+    vmemfree_owned(ptr);
+}
+
+// C23 sized free. The size is that of the malloc, calloc or realloc call. Like free, it has to ignore
+// pointers the page map doesn't know, as GET_CONTAINER would take any small foreign chunk for one of ours,
+// and once the page map has been asked it also gives the container, so the size isn't needed.
+void free_sized(void* ptr, size_t size) {
+    (void)size;
+    vmemfree_owned(ptr);
+}
+
+// C23 sized free for aligned_alloc, whose chunks may be large even when the size is small.
+void free_aligned_sized(void* ptr, size_t alignment, size_t size) {
+    (void)alignment;
+    (void)size;
+    free(ptr);
+}
+
+void* calloc(size_t count, size_t size) {
+    size_t totalSize;
+    if (__builtin_mul_overflow(count, size, &totalSize)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void* ptr = vmemcalloc(1, totalSize > 0 ? totalSize : 1);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    // realloc(NULL, size) is malloc(size), so realloc(NULL, 0) returns a pointer that can be freed.
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (vmemusablesize(ptr) == 0) {
+        // Can't tell how big a foreign chunk is, so it can't be copied.
+        errno = ENOMEM;
+        return NULL;
+    }
+    // Like glibc, realloc(ptr, 0) frees ptr and returns NULL.
+    void* newPtr = vmemrealloc(ptr, size);
+    if (newPtr == NULL && size > 0) {
+        errno = ENOMEM;
+    }
+    return newPtr;
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) {
+    return vmemposixalign(ptr, alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    if (alignment > SIZE_MAX / 2 + 1) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // Like glibc, round the alignment up to a power of two.
+    size_t powerOfTwoAlignment = 1;
+    while (powerOfTwoAlignment < alignment) {
+        powerOfTwoAlignment <<= 1;
+    }
+    void* ptr = vmemalign(powerOfTwoAlignment, size > 0 ? size : 1);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign(alignment, size);
+}
+
+void* valloc(size_t size) {
+    return memalign(getpagesize(), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t pageSize = getpagesize();
+    if (size > SIZE_MAX - pageSize) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(pageSize, CEIL(size > 0 ? size : 1, pageSize));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    return vmemusablesize(ptr);
+}
+
+// Setting VMEM_TRACE_FILE captures a trace of the program for vmem_replay, holding the last
+// VMEM_TRACE_RECORDS operations (2^20 by default). Allocations made before this runs aren't traced.
+__attribute__((constructor))
+static void startTraceFromEnvironment(void) {
+    char* path = getenv("VMEM_TRACE_FILE");
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    char* records = getenv("VMEM_TRACE_RECORDS");
+    if (records != NULL) {
+        setTraceCapacity(atoi(records));
+    }
+    setTraceFile(path);
+}
+
+// Setting VMEM_PROFILE_FILE turns on the heap profiler, sampling once every VMEM_PROFILE_RATE bytes
+// (VMEM_PROFILE_DEFAULT_RATE by default). The profile is written to the file on SIGUSR2 and at exit.
+static char* profilePath = NULL;
+
+__attribute__((constructor))
+static void startProfileFromEnvironment(void) {
+    char* path = getenv("VMEM_PROFILE_FILE");
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    char* rate = getenv("VMEM_PROFILE_RATE");
+    size_t bytes = rate != NULL ? strtoull(rate, NULL, 10) : 0;
+    if (setProfileSampleRate(bytes > 0 ? bytes : VMEM_PROFILE_DEFAULT_RATE) == 0
+            && vmemprofile_dump_on_signal(SIGUSR2, path) == 0) {
+        profilePath = path;
+    }
+}
+
+__attribute__((destructor))
+static void finishProfile(void) {
+    if (profilePath != NULL) {
+        vmemprofile_dump(profilePath);
+    }
+}
+
+// The trace file isn't closed at exit, as other threads may still be allocating, but the final time
+// is recorded so the tick rate can be worked out.
+__attribute__((destructor))
+static void finishTrace(void) {
+    if (TRACING()) {
+        checkpointTraceTime();
+    }
+}
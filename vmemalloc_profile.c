@@ -0,0 +1,443 @@
+#include <execinfo.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+#include "vmemalloc_small.h"
+#include "vmemalloc_stats.h"
+#include "vmemalloc_profile.h"
+
+// Deepest backtrace kept for a sample.
+#define PROFILE_MAX_FRAMES 32
+
+// Frames of profileAllocation and of the allocation function, left out of every backtrace.
+#define PROFILE_SKIPPED_FRAMES 2
+
+// Number of lists in the hash table of samples, and of entries in its filter. Both are powers of two.
+#define PROFILE_BUCKET_BITS 12
+#define PROFILE_FILTER_BITS 14
+
+// Number of samples mapped at a time.
+#define PROFILE_SAMPLES_PER_MAPPING 256
+
+// A sampled chunk that hasn't been freed yet.
+typedef struct ProfileSample {
+    struct ProfileSample* next;
+    void* ptr;
+    // The size the program asked for.
+    Word size;
+    int depth;
+    void* frames[PROFILE_MAX_FRAMES];
+} ProfileSample;
+
+// Average number of bytes allocated between samples, or 0 if the profiler is off.
+Word profileSampleRate = 0;
+
+// The rate written in the profile, which is still needed for the samples left after the profiler is turned off.
+static Word lastSampleRate = VMEM_PROFILE_DEFAULT_RATE;
+
+// Number of sampled chunks that haven't been freed.
+int64_t profileSampleCount = 0;
+
+// Hash table of samples, indexed by the address of the chunk.
+static ProfileSample* sampleBuckets[1 << PROFILE_BUCKET_BITS];
+
+// Number of samples whose address hashes to each entry. Frees read it without the lock, and only look
+// in the hash table if the entry of their address isn't 0.
+static uint16_t sampleFilter[1 << PROFILE_FILTER_BITS];
+
+// Samples that can be reused.
+static ProfileSample* freeSamples = NULL;
+
+// Set by the signal handler when it couldn't write the profile straight away. The next thread to
+// finish with the samples writes it instead.
+static volatile sig_atomic_t dumpPending = 0;
+static char signalDumpPath[256];
+
+// Protects the samples. The signal handler only tries to take it, so it never waits for the thread
+// it interrupted. It is a flag rather than a mutex, as pthread_mutex_trylock isn't async-signal-safe
+// but lock-free atomics are. Threads waiting for it yield, as it is held while the profile is written.
+#ifdef VMEM_THREAD_SAFE
+#include <sched.h>
+static int profileBusy = 0;
+#define TRY_LOCK_PROFILE() (__atomic_exchange_n(&profileBusy, 1, __ATOMIC_ACQUIRE) == 0)
+#define LOCK_PROFILE() do { \
+        while (!TRY_LOCK_PROFILE()) { \
+            sched_yield(); \
+        } \
+    } while (0)
+#define UNLOCK_PROFILE() __atomic_store_n(&profileBusy, 0, __ATOMIC_RELEASE)
+
+// Takes the profile lock across fork, like the backend lock.
+void lockProfileBeforeFork(void) {
+    LOCK_PROFILE();
+}
+
+void unlockProfileAfterFork(void) {
+    UNLOCK_PROFILE();
+}
+#else
+static volatile sig_atomic_t profileBusy = 0;
+#define LOCK_PROFILE() (profileBusy = 1)
+#define TRY_LOCK_PROFILE() (profileBusy ? 0 : (profileBusy = 1))
+#define UNLOCK_PROFILE() (profileBusy = 0)
+#endif
+
+// Bytes the thread has left to allocate before its next sample.
+static __thread int64_t bytesUntilSample = 0;
+// State of the thread's random number generator, or 0 before the thread's first allocation.
+static __thread uint64_t sampleRandom = 0;
+// Set while the thread is inside the profiler, so allocations made by backtrace aren't sampled.
+static __thread int inProfiler = 0;
+
+static uint64_t hashPointer(void* ptr) {
+    return ((uint64_t)(Word)ptr >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+#define GET_BUCKET(hash) ((hash) >> (64 - PROFILE_BUCKET_BITS))
+#define GET_FILTER_ENTRY(hash) ((hash) >> (64 - PROFILE_FILTER_BITS))
+
+// -ln(x / 2^53) for 0 < x <= 2^53, without needing libm. log2 of the mantissa is approximated with a
+// polynomial, which is accurate to 1e-4 - far closer than sampling needs.
+static double negativeLogOfFraction(uint64_t x) {
+    int exponent = 63 - __builtin_clzll(x);
+    double mantissa = (double)x / (double)((uint64_t)1 << exponent);
+    double log2Mantissa = -1.7417939 + (2.8212026 + (-1.4699568 + (0.44717955 - 0.056570851 * mantissa)
+            * mantissa) * mantissa) * mantissa;
+    double result = (53 - exponent - log2Mantissa) * 0.6931471805599453;
+    return result > 0 ? result : 0;
+}
+
+// Number of bytes until the next sample. Intervals are exponentially distributed (the continuous form
+// of geometric sampling), so every byte allocated has the same chance of being sampled.
+static int64_t nextSampleInterval(void) {
+    // xorshift64*
+    sampleRandom ^= sampleRandom >> 12;
+    sampleRandom ^= sampleRandom << 25;
+    sampleRandom ^= sampleRandom >> 27;
+    uint64_t bits = (sampleRandom * 0x2545F4914F6CDD1DULL) >> 11;
+    return (int64_t)(negativeLogOfFraction(bits + 1) * (double)profileSampleRate) + 1;
+}
+
+// Takes a sample off the free list, mapping more if there are none. The caller must hold the profile lock.
+static ProfileSample* takeSample(void) {
+    if (freeSamples == NULL) {
+        Word size = PROFILE_SAMPLES_PER_MAPPING * sizeof(ProfileSample);
+        ProfileSample* samples = mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (samples == MAP_FAILED) {
+            return NULL;
+        }
+        COUNT_METADATA_MMAP(size);
+        for (int i = 0; i < PROFILE_SAMPLES_PER_MAPPING; i++) {
+            samples[i].next = freeSamples;
+            freeSamples = &samples[i];
+        }
+    }
+    ProfileSample* sample = freeSamples;
+    freeSamples = sample->next;
+    return sample;
+}
+
+// Buffers the profile as it is written, using only calls that are safe in a signal handler.
+typedef struct ProfileWriter {
+    int fd;
+    int failed;
+    int length;
+    char buffer[4096];
+} ProfileWriter;
+
+static void flushProfile(ProfileWriter* writer) {
+    int written = 0;
+    while (written < writer->length && !writer->failed) {
+        ssize_t result = write(writer->fd, writer->buffer + written, writer->length - written);
+        if (result <= 0) {
+            writer->failed = 1;
+        } else {
+            written += result;
+        }
+    }
+    writer->length = 0;
+}
+
+static void writeBytes(ProfileWriter* writer, const char* bytes, int length) {
+    for (int i = 0; i < length; i++) {
+        if (writer->length == (int)sizeof(writer->buffer)) {
+            flushProfile(writer);
+        }
+        writer->buffer[writer->length++] = bytes[i];
+    }
+}
+
+static void writeString(ProfileWriter* writer, const char* string) {
+    writeBytes(writer, string, strlen(string));
+}
+
+static void writeNumber(ProfileWriter* writer, uint64_t value, int base) {
+    char digits[24];
+    int start = sizeof(digits);
+    do {
+        digits[--start] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
+    writeBytes(writer, digits + start, sizeof(digits) - start);
+}
+
+// Writes "count: bytes [count: bytes]". Freed samples aren't kept, so the allocated columns repeat
+// the in-use ones.
+static void writeCounts(ProfileWriter* writer, uint64_t count, uint64_t bytes) {
+    for (int column = 0; column < 2; column++) {
+        writeString(writer, column == 0 ? "" : " [");
+        writeNumber(writer, count, 10);
+        writeString(writer, ": ");
+        writeNumber(writer, bytes, 10);
+    }
+    writeString(writer, "]");
+}
+
+// Writes the live samples in the heap profile format read by pprof, followed by the mappings of the
+// process so pprof can find the symbols. Returns 0, or -1 if writing failed. The caller must hold
+// the profile lock.
+static int writeProfile(int fd) {
+    ProfileWriter writer;
+    writer.fd = fd;
+    writer.failed = 0;
+    writer.length = 0;
+    uint64_t totalCount = 0;
+    uint64_t totalBytes = 0;
+    for (int bucket = 0; bucket < (1 << PROFILE_BUCKET_BITS); bucket++) {
+        for (ProfileSample* sample = sampleBuckets[bucket]; sample != NULL; sample = sample->next) {
+            totalCount++;
+            totalBytes += sample->size;
+        }
+    }
+    writeString(&writer, "heap profile: ");
+    writeCounts(&writer, totalCount, totalBytes);
+    // pprof scales each sample up by the chance of it having been sampled at this rate.
+    writeString(&writer, " @ heap_v2/");
+    writeNumber(&writer, lastSampleRate, 10);
+    writeString(&writer, "\n");
+    for (int bucket = 0; bucket < (1 << PROFILE_BUCKET_BITS); bucket++) {
+        for (ProfileSample* sample = sampleBuckets[bucket]; sample != NULL; sample = sample->next) {
+            writeCounts(&writer, 1, sample->size);
+            writeString(&writer, " @");
+            for (int frame = 0; frame < sample->depth; frame++) {
+                writeString(&writer, " 0x");
+                writeNumber(&writer, (Word)sample->frames[frame], 16);
+            }
+            writeString(&writer, "\n");
+        }
+    }
+    writeString(&writer, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        char buffer[4096];
+        ssize_t length;
+        while ((length = read(maps, buffer, sizeof(buffer))) > 0) {
+            writeBytes(&writer, buffer, length);
+        }
+        close(maps);
+    }
+    flushProfile(&writer);
+    return writer.failed ? -1 : 0;
+}
+
+// Writes the profile to a new file at path. The caller must hold the profile lock.
+static int writeProfileFile(const char* path) {
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = writeProfile(fd);
+    close(fd);
+    return result;
+}
+
+// Writes the profile that the signal handler couldn't.
+static void writePendingProfile(void) {
+    LOCK_PROFILE();
+    if (dumpPending) {
+        dumpPending = 0;
+        writeProfileFile(signalDumpPath);
+    }
+    UNLOCK_PROFILE();
+}
+
+// Counts down the allocation towards the next sample, and records it if it is sampled.
+void profileAllocation(void* ptr, Word size) {
+    bytesUntilSample -= size;
+    if (bytesUntilSample > 0 || inProfiler) {
+        return;
+    }
+    inProfiler = 1;
+    if (sampleRandom == 0) {
+        // The first allocation of each thread seeds its generator and starts the countdown.
+        sampleRandom = (hashPointer(&sampleRandom) ^ (uint64_t)time(NULL)) | 1;
+        bytesUntilSample = nextSampleInterval();
+        inProfiler = 0;
+        return;
+    }
+    // The intervals are memoryless, so the countdown starts again rather than carrying the overshoot.
+    bytesUntilSample = nextSampleInterval();
+    void* frames[PROFILE_MAX_FRAMES + PROFILE_SKIPPED_FRAMES];
+    int depth = backtrace(frames, PROFILE_MAX_FRAMES + PROFILE_SKIPPED_FRAMES) - PROFILE_SKIPPED_FRAMES;
+    uint64_t hash = hashPointer(ptr);
+    LOCK_PROFILE();
+    ProfileSample* sample = takeSample();
+    if (sample != NULL) {
+        sample->ptr = ptr;
+        sample->size = size;
+        sample->depth = depth > 0 ? depth : 0;
+        memcpy(sample->frames, frames + PROFILE_SKIPPED_FRAMES, sample->depth * sizeof(void*));
+        sample->next = sampleBuckets[GET_BUCKET(hash)];
+        sampleBuckets[GET_BUCKET(hash)] = sample;
+        __atomic_add_fetch(&sampleFilter[GET_FILTER_ENTRY(hash)], 1, __ATOMIC_RELAXED);
+        STAT_ADD(profileSampleCount, 1);
+    }
+    UNLOCK_PROFILE();
+    if (dumpPending) {
+        writePendingProfile();
+    }
+    inProfiler = 0;
+}
+
+// Takes the sample of ptr out of the hash table, returning NULL if it has none. The caller must hold
+// the profile lock.
+static ProfileSample* unlinkSample(void* ptr, uint64_t hash) {
+    ProfileSample** link = &sampleBuckets[GET_BUCKET(hash)];
+    while (*link != NULL && (*link)->ptr != ptr) {
+        link = &(*link)->next;
+    }
+    ProfileSample* sample = *link;
+    if (sample != NULL) {
+        *link = sample->next;
+        __atomic_sub_fetch(&sampleFilter[GET_FILTER_ENTRY(hash)], 1, __ATOMIC_RELAXED);
+    }
+    return sample;
+}
+
+// Forgets the sample of a chunk that is about to be freed, if it has one.
+void profileFree(void* ptr) {
+    uint64_t hash = hashPointer(ptr);
+    if (__atomic_load_n(&sampleFilter[GET_FILTER_ENTRY(hash)], __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    LOCK_PROFILE();
+    ProfileSample* sample = unlinkSample(ptr, hash);
+    if (sample != NULL) {
+        sample->next = freeSamples;
+        freeSamples = sample;
+        STAT_SUB(profileSampleCount, 1);
+    }
+    UNLOCK_PROFILE();
+    if (dumpPending) {
+        writePendingProfile();
+    }
+}
+
+// Takes the sample of a chunk that is about to be resized out of the table, so that its address can
+// be reused while the resize runs. Returns the sample, or NULL if the chunk wasn't sampled.
+void* profileDetach(void* ptr) {
+    uint64_t hash = hashPointer(ptr);
+    if (__atomic_load_n(&sampleFilter[GET_FILTER_ENTRY(hash)], __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+    LOCK_PROFILE();
+    ProfileSample* sample = unlinkSample(ptr, hash);
+    UNLOCK_PROFILE();
+    if (dumpPending) {
+        writePendingProfile();
+    }
+    return sample;
+}
+
+// Puts a sample taken by profileDetach back if 'restore' is set, as the resize failed and the chunk
+// is still where it was, and otherwise forgets it.
+void profileReattach(void* detached, int restore) {
+    ProfileSample* sample = (ProfileSample*)detached;
+    uint64_t hash = hashPointer(sample->ptr);
+    LOCK_PROFILE();
+    if (restore) {
+        sample->next = sampleBuckets[GET_BUCKET(hash)];
+        sampleBuckets[GET_BUCKET(hash)] = sample;
+        __atomic_add_fetch(&sampleFilter[GET_FILTER_ENTRY(hash)], 1, __ATOMIC_RELAXED);
+    } else {
+        sample->next = freeSamples;
+        freeSamples = sample;
+        STAT_SUB(profileSampleCount, 1);
+    }
+    UNLOCK_PROFILE();
+    if (dumpPending) {
+        writePendingProfile();
+    }
+}
+
+/*  Sample an allocation about once every 'bytes' bytes, or stop sampling if 'bytes' is 0. */
+int setProfileSampleRate(size_t bytes) {
+#ifdef VMEM_NO_STATS
+    (void)bytes;
+    fprintf(stderr, "The profiler is compiled out of the VMEM_NO_STATS build\n");
+    return -1;
+#else
+    if (bytes != 0) {
+        // The first backtrace loads the unwinder, which allocates, so take it before sampling starts.
+        void* frame;
+        backtrace(&frame, 1);
+        lastSampleRate = bytes;
+    }
+    __atomic_store_n(&profileSampleRate, bytes, __ATOMIC_RELAXED);
+    return 0;
+#endif
+}
+
+/*  Write a heap profile of the sampled chunks that are still allocated to 'path'. */
+int vmemprofile_dump(const char* path) {
+    if (path == NULL) {
+        fprintf(stderr, "path passed to vmemprofile_dump was NULL\n");
+        return -1;
+    }
+    LOCK_PROFILE();
+    int result = writeProfileFile(path);
+    UNLOCK_PROFILE();
+    if (result) {
+        perror("Error writing heap profile");
+    }
+    return result;
+}
+
+// Writes the profile to signalDumpPath, or leaves it for the next thread to sample or free a sampled
+// chunk if the samples are being changed.
+static void dumpProfileOnSignal(int signal) {
+    (void)signal;
+    if (!TRY_LOCK_PROFILE()) {
+        dumpPending = 1;
+        return;
+    }
+    writeProfileFile(signalDumpPath);
+    UNLOCK_PROFILE();
+}
+
+/*  Write a heap profile to 'path' whenever the process receives 'signal'. */
+int vmemprofile_dump_on_signal(int signal, const char* path) {
+    if (path == NULL || strlen(path) >= sizeof(signalDumpPath)) {
+        fprintf(stderr, "path passed to vmemprofile_dump_on_signal was NULL or too long\n");
+        return -1;
+    }
+    LOCK_PROFILE();
+    strcpy(signalDumpPath, path);
+    UNLOCK_PROFILE();
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dumpProfileOnSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signal, &action, NULL)) {
+        perror("Error in sigaction");
+        return -1;
+    }
+    return 0;
+}
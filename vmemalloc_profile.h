@@ -0,0 +1,60 @@
+#ifndef VMEMALLOC_PROFILE_GUARD
+#define VMEMALLOC_PROFILE_GUARD
+
+// Sampling heap profiler. While setProfileSampleRate has set a rate, each thread counts down the bytes
+// it allocates from a random interval averaging that rate, and takes a backtrace of the allocation that
+// reaches 0. Sampled chunks are kept in a hash table until they are freed, and vmemprofile_dump writes
+// the live ones as a heap profile. Compiled out, like tracing, in the VMEM_NO_STATS build.
+
+// Average number of bytes allocated between samples, or 0 if the profiler is off.
+extern Word profileSampleRate;
+
+// Number of sampled chunks that haven't been freed. Frees only look for a sample while this isn't 0.
+extern int64_t profileSampleCount;
+
+// Counts down the allocation towards the next sample, and records it if it is sampled.
+extern void profileAllocation(void* ptr, Word size);
+
+// Forgets the sample of a chunk that is about to be freed, if it has one.
+extern void profileFree(void* ptr);
+
+// Takes the sample of a chunk that is about to be resized out of the table, and returns it (or NULL).
+extern void* profileDetach(void* ptr);
+
+// Puts a sample taken by profileDetach back if 'restore' is set, as the resize failed, and otherwise
+// forgets it.
+extern void profileReattach(void* detached, int restore);
+
+#ifdef VMEM_THREAD_SAFE
+// Take and give back the profile lock, so the child of a fork never inherits it held by another thread.
+extern void lockProfileBeforeFork(void);
+extern void unlockProfileAfterFork(void);
+#endif
+
+#ifdef VMEM_NO_STATS
+#define PROFILE_ALLOC(ptr, size) ((void)0)
+#define PROFILE_FREE(ptr) ((void)0)
+#define PROFILE_DETACH(ptr) ((void*)NULL)
+#define PROFILE_REATTACH(sample, restore) ((void)(sample))
+#else
+// Called with every chunk returned to the program, and every chunk before it is freed.
+#define PROFILE_ALLOC(ptr, size) do { \
+        if (profileSampleRate != 0) { \
+            profileAllocation((ptr), (size)); \
+        } \
+    } while (0)
+#define PROFILE_FREE(ptr) do { \
+        if (STAT_GET(profileSampleCount) != 0) { \
+            profileFree(ptr); \
+        } \
+    } while (0)
+// A resize keeps the chunk's sample aside until it knows whether the old chunk is still live.
+#define PROFILE_DETACH(ptr) (STAT_GET(profileSampleCount) != 0 ? profileDetach(ptr) : NULL)
+#define PROFILE_REATTACH(sample, restore) do { \
+        if ((sample) != NULL) { \
+            profileReattach((sample), (restore)); \
+        } \
+    } while (0)
+#endif
+
+#endif
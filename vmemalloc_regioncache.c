@@ -0,0 +1,133 @@
+#include <time.h>
+#include <sys/mman.h>
+
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+#include "vmemalloc_small.h"
+#include "vmemalloc_thread.h"
+#include "vmemalloc_regioncache.h"
+#include "vmemalloc_stats.h"
+#include "vmemalloc_hugepage.h"
+
+typedef struct CachedRegion {
+    void* region;
+    // 0 if the slot is unused.
+    Word size;
+    // When the region was cached, in milliseconds.
+    long cachedAt;
+} CachedRegion;
+
+static CachedRegion regionCache[REGION_CACHE_SLOTS];
+
+// Total size of the cached regions. Kept apart from the regionCacheBytes statistic, which is
+// compiled out in the VMEM_NO_STATS build.
+static Word cachedBytes = 0;
+
+// Regions are released once the cache holds more than this many bytes...
+static Word regionCacheLimit = DEFAULT_REGION_CACHE_BYTES;
+// ...or once they have been in the cache for this long.
+static long regionCacheDecay = DEFAULT_REGION_CACHE_DECAY_MS;
+
+// Current time in milliseconds. The coarse clock is read from the vDSO without a syscall.
+long timeInMillis(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Unmaps a cached region and frees its slot.
+static void releaseCachedRegion(CachedRegion* slot) {
+    // Regions from the hugetlbfs pool are never cached.
+    unmapPages(slot->region, slot->size, false);
+    cachedBytes -= slot->size;
+    STAT_SUB(regionCacheBytes, slot->size);
+    slot->size = 0;
+}
+
+// Unmaps regions which have been in the cache for longer than the decay time.
+static void decayRegionCache(long now) {
+    for (int i = 0; i < REGION_CACHE_SLOTS; i++) {
+        if (regionCache[i].size != 0 && now - regionCache[i].cachedAt >= regionCacheDecay) {
+            releaseCachedRegion(&regionCache[i]);
+        }
+    }
+}
+
+// Returns a cached region of at least size bytes, and no more than a quarter bigger, or NULL.
+void* takeCachedRegion(Word size, Word* regionSize) {
+    decayRegionCache(timeInMillis());
+    CachedRegion* bestFit = NULL;
+    for (int i = 0; i < REGION_CACHE_SLOTS; i++) {
+        Word slotSize = regionCache[i].size;
+        if (slotSize >= size && slotSize <= size + size / 4 && (bestFit == NULL || slotSize < bestFit->size)) {
+            bestFit = &regionCache[i];
+        }
+    }
+    if (bestFit == NULL) {
+        STAT_ADD(regionCacheMisses, 1);
+        return NULL;
+    }
+    STAT_ADD(regionCacheHits, 1);
+    cachedBytes -= bestFit->size;
+    STAT_SUB(regionCacheBytes, bestFit->size);
+    *regionSize = bestFit->size;
+    bestFit->size = 0;
+    return bestFit->region;
+}
+
+// Keeps an empty region for reuse. Returns 0 if it doesn't fit in the cache.
+int cacheRegion(void* region, Word regionSize) {
+    long now = timeInMillis();
+    decayRegionCache(now);
+    if (cachedBytes + regionSize > regionCacheLimit) {
+        return 0;
+    }
+    for (int i = 0; i < REGION_CACHE_SLOTS; i++) {
+        if (regionCache[i].size == 0) {
+            regionCache[i].region = region;
+            regionCache[i].size = regionSize;
+            regionCache[i].cachedAt = now;
+            cachedBytes += regionSize;
+            STAT_ADD(regionCacheBytes, regionSize);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Sets the maximum number of bytes of empty regions kept for reuse, and how long they are kept for.
+// Regions over the new limits are unmapped straight away.
+void setRegionCacheLimits(size_t maxBytes, int decayMillis) {
+    LOCK_BACKEND();
+    regionCacheLimit = maxBytes;
+    regionCacheDecay = decayMillis > 0 ? decayMillis : 0;
+    decayRegionCache(timeInMillis());
+    for (int i = 0; i < REGION_CACHE_SLOTS && cachedBytes > regionCacheLimit; i++) {
+        if (regionCache[i].size != 0) {
+            releaseCachedRegion(&regionCache[i]);
+        }
+    }
+    UNLOCK_BACKEND();
+}
+
+// Unmaps every cached region. Returns the number of bytes unmapped.
+Word releaseCachedRegions(void) {
+    Word released = cachedBytes;
+    for (int i = 0; i < REGION_CACHE_SLOTS; i++) {
+        if (regionCache[i].size != 0) {
+            releaseCachedRegion(&regionCache[i]);
+        }
+    }
+    return released;
+}
+
+// Number of bytes of the cached regions which are resident in memory.
+Word countResidentCachedBytes(void) {
+    Word bytes = 0;
+    for (int i = 0; i < REGION_CACHE_SLOTS; i++) {
+        if (regionCache[i].size != 0) {
+            bytes += countResidentBytes(regionCache[i].region, regionCache[i].size);
+        }
+    }
+    return bytes;
+}
@@ -0,0 +1,31 @@
+#ifndef VMEMALLOC_REGIONCACHE_GUARD
+#define VMEMALLOC_REGIONCACHE_GUARD
+
+// Regions emptied by removeRegion are kept mapped for a while, so newRegion can reuse them
+// instead of calling munmap and mmap again. All functions must be called with the backend lock held.
+
+// Maximum number of regions kept at once.
+#define REGION_CACHE_SLOTS 64
+
+// Default limits, which can be changed with setRegionCacheLimits.
+#define DEFAULT_REGION_CACHE_BYTES (8 * 1024 * 1024)
+#define DEFAULT_REGION_CACHE_DECAY_MS 1000
+
+// Returns a cached region of at least size bytes, and no more than a quarter bigger, or NULL.
+// The size of the region is stored in regionSize.
+extern void* takeCachedRegion(Word size, Word* regionSize);
+
+// Keeps an empty region for reuse. Returns 0 if it doesn't fit in the cache, in which case the
+// caller must unmap it.
+extern int cacheRegion(void* region, Word regionSize);
+
+// Unmaps every cached region. Returns the number of bytes unmapped.
+extern Word releaseCachedRegions(void);
+
+// Number of bytes of the cached regions which are resident in memory.
+extern Word countResidentCachedBytes(void);
+
+// Current time in milliseconds, from the coarse monotonic clock.
+extern long timeInMillis(void);
+
+#endif
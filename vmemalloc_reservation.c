@@ -0,0 +1,361 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+#include "vmemalloc_small.h"
+#include "vmemalloc_pagemap.h"
+#include "vmemalloc_thread.h"
+#include "vmemalloc_stats.h"
+#include "vmemalloc_hugepage.h"
+#include "vmemalloc_reservation.h"
+
+typedef struct Reservation {
+    void* start;
+    // 0 if the slot is unused.
+    Word size;
+    // Bytes committed from the start, all of which belong to the region if there is one.
+    Word committed;
+    // First chunk of the region, or NULL if there is no region.
+    ChunkHeader* firstChunk;
+    // Bytes from the start pinned by vmemreserve. The region is never removed while this isn't 0.
+    Word pinned;
+} Reservation;
+
+static Reservation reservations[MAX_RESERVATIONS];
+
+// The reservation new regions are committed from, or NULL.
+static Reservation* newestReservation = NULL;
+
+// Size of each reservation, or 0 to map every region on its own.
+static Word reservationBytes = DEFAULT_RESERVATION_BYTES;
+
+// Number of reservations with pinned pages.
+static int pinnedReservations = 0;
+
+// Bytes of a region that aren't part of its first chunk: the alignment offset, the header of the
+// first chunk, the fence with its header, and the region footer.
+#define RESERVED_REGION_OVERHEAD (ALIGNMENT_OFFSET + 2 * sizeof(ChunkHeader) + FENCE_SIZE + sizeof(RegionFooter))
+
+// Reserves size bytes of address space. If the space after the newest reservation is free the newest
+// reservation grows into it instead. Returns the reservation to commit from next, or NULL.
+static Reservation* reserveAddressSpace(Word size) {
+    void* next = newestReservation != NULL ? newestReservation->start + newestReservation->size : NULL;
+    // The kernel only counts the pages against its overcommit limit once they are committed.
+    void* start = mmap(next, size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|noReserveFlag, -1, 0);
+    if (start == MAP_FAILED) {
+        perror("Error reserving address space");
+        return NULL;
+    }
+    STAT_ADD(mmapCount, 1);
+    if (next != NULL && start == next) {
+        // The kernel merges the two mappings, so the region can keep growing.
+        newestReservation->size += size;
+        return newestReservation;
+    }
+    for (int i = 0; i < MAX_RESERVATIONS; i++) {
+        if (reservations[i].size == 0) {
+            reservations[i].start = start;
+            reservations[i].size = size;
+            reservations[i].committed = 0;
+            reservations[i].firstChunk = NULL;
+            reservations[i].pinned = 0;
+            newestReservation = &reservations[i];
+            return newestReservation;
+        }
+    }
+    munmap(start, size);
+    STAT_ADD(munmapCount, 1);
+    return NULL;
+}
+
+// Unmaps a reservation and frees its slot.
+static void releaseReservation(Reservation* reservation) {
+    if (munmap(reservation->start, reservation->size)) {
+        perror("Error in munmap");
+    }
+    STAT_ADD(munmapCount, 1);
+    STAT_SUB(mappedBytes, reservation->committed);
+    if (reservation == newestReservation) {
+        newestReservation = NULL;
+    }
+    reservation->size = 0;
+}
+
+// Number of bytes to commit at the end of a reservation for an allocation needing at least bytes more,
+// or 0 if they don't fit.
+static Word getCommitSize(Reservation* reservation, Word bytes) {
+    Word pageSize = getpagesize();
+    Word step = CEIL(reservation->committed / 4 + 1, pageSize);
+    if (step < MIN_COMMIT_STEP) {
+        step = MIN_COMMIT_STEP;
+    } else if (step > MAX_COMMIT_STEP) {
+        step = MAX_COMMIT_STEP;
+    }
+    Word size = bytes == 0 ? 0 : CEIL(bytes, pageSize);
+    Word space = reservation->size - reservation->committed;
+    if (size > space) {
+        return 0;
+    }
+    if (size < step) {
+        size = step < space ? step : space;
+    }
+    return size;
+}
+
+// Makes the next bytes of a reservation usable and adds them to its region.
+static int commitPages(Reservation* reservation, Word bytes) {
+    void* start = reservation->start + reservation->committed;
+    if (mprotect(start, bytes, PROT_READ|PROT_WRITE)) {
+        perror("Error committing reserved pages");
+        return -1;
+    }
+    if (setPageOwner(start, bytes, reservation->firstChunk, PAGE_LARGE)) {
+        fprintf(stderr, "Failed to add region to the page map\n");
+        mprotect(start, bytes, PROT_NONE);
+        return -1;
+    }
+    reservation->committed += bytes;
+    STAT_ADD(mappedBytes, bytes);
+    return 0;
+}
+
+// Gives back every committed page of a reservation, keeping the address space reserved.
+static void decommitPages(Reservation* reservation) {
+    // Mapping over the pages frees them, where mprotect alone would keep them.
+    if (mmap(reservation->start, reservation->committed, PROT_NONE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|noReserveFlag, -1, 0) == MAP_FAILED) {
+        perror("Error decommitting reserved pages");
+    }
+    STAT_ADD(mmapCount, 1);
+    STAT_SUB(mappedBytes, reservation->committed);
+    reservation->committed = 0;
+}
+
+// Puts the fence and the region footer at the end of the committed pages of a reservation.
+static void endRegion(Reservation* reservation) {
+    void* end = reservation->start + reservation->committed;
+    ChunkHeader* fence = (ChunkHeader*)(end - sizeof(RegionFooter) - FENCE_SIZE - sizeof(ChunkHeader));
+    initAllocdChunk(fence, FENCE_SIZE, true, false);
+    CREATE_REGION_FOOTER(reservation->start, reservation->committed, reservation->firstChunk);
+}
+
+// Creates a region at the start of an empty reservation, holding an allocated chunk of at least size bytes.
+static ChunkHeader* startRegion(Reservation* reservation, Word size, Word* zeroed) {
+    Word bytes = getCommitSize(reservation, size + RESERVED_REGION_OVERHEAD);
+    if (bytes == 0) {
+        return NULL;
+    }
+    reservation->firstChunk = (ChunkHeader*)(reservation->start + ALIGNMENT_OFFSET);
+    if (commitPages(reservation, bytes)) {
+        reservation->firstChunk = NULL;
+        return NULL;
+    }
+    ChunkHeader* chunk = reservation->firstChunk;
+    initAllocdChunk(chunk, bytes - RESERVED_REGION_OVERHEAD, false, false);
+    endRegion(reservation);
+    STAT_ADD(regionsUsed, 1);
+    // Decommitted pages are filled with zeros when they are committed again.
+    if (zeroed != NULL) {
+        *zeroed = true;
+    }
+    return chunk;
+}
+
+// Commits more pages at the end of the region of a reservation, and returns an allocated chunk of at
+// least size bytes covering them, or NULL if the reservation is full.
+static ChunkHeader* growRegion(Reservation* reservation, Word size, Word* zeroed) {
+    void* end = reservation->start + reservation->committed;
+    ChunkHeader* fence = (ChunkHeader*)(end - sizeof(RegionFooter) - FENCE_SIZE - sizeof(ChunkHeader));
+    // A free chunk before the fence takes over the new pages.
+    FreeChunkHeader* lastChunk = NULL;
+    Word available = 0;
+    if (GET_PREVIOUS_CHUNK_FREE(fence)) {
+        lastChunk = (FreeChunkHeader*)*(FreeChunkFooter*)((void*)fence - sizeof(FreeChunkFooter));
+        available = sizeof(ChunkHeader) + GET_SIZE(lastChunk);
+    }
+    // The old fence becomes the header of a chunk reaching to the new fence, which is bytes further on.
+    Word needed = sizeof(ChunkHeader) + size;
+    Word bytes = getCommitSize(reservation, needed > available ? needed - available : 0);
+    if (bytes == 0 || commitPages(reservation, bytes)) {
+        return NULL;
+    }
+    endRegion(reservation);
+    ChunkHeader* chunk = fence;
+    initAllocdChunk(chunk, bytes - sizeof(ChunkHeader), false, lastChunk != NULL ? true : false);
+    if (lastChunk != NULL) {
+        removeChunkFromBin(lastChunk);
+        SET_SIZE(lastChunk, available + GET_SIZE(chunk));
+        return makeChunkAllocated(lastChunk);
+    }
+    // Only the old fence and footer, before the new pages, aren't zeros already.
+    if (zeroed != NULL) {
+        memset((void*)chunk + sizeof(ChunkHeader), 0, end - ((void*)chunk + sizeof(ChunkHeader)));
+        *zeroed = true;
+    }
+    return chunk;
+}
+
+// Returns an allocated chunk of at least size bytes from the newest reservation.
+ChunkHeader* commitRegion(Word size, Word* zeroed) {
+    // Huge page mode maps whole huge pages anyway, and chunks too big to leave room in a reservation
+    // are better off mapped on their own.
+    if (reservationBytes == 0 || hugePageMode != VMEM_HUGE_PAGES_OFF || size > reservationBytes / 4) {
+        return NULL;
+    }
+    Reservation* reservation = newestReservation;
+    if (reservation != NULL && reservation->firstChunk != NULL) {
+        ChunkHeader* chunk = growRegion(reservation, size, zeroed);
+        if (chunk != NULL) {
+            return chunk;
+        }
+        reservation = reserveAddressSpace(reservationBytes);
+        if (reservation != NULL && reservation->firstChunk != NULL) {
+            return growRegion(reservation, size, zeroed);
+        }
+    } else if (reservation == NULL) {
+        reservation = reserveAddressSpace(reservationBytes);
+    }
+    return reservation == NULL ? NULL : startRegion(reservation, size, zeroed);
+}
+
+// Returns true if ptr is in the pinned pages of a reservation.
+Word isPinned(void* ptr) {
+    if (pinnedReservations == 0) {
+        return false;
+    }
+    for (int i = 0; i < MAX_RESERVATIONS; i++) {
+        Reservation* reservation = &reservations[i];
+        if (reservation->pinned != 0 && ptr >= reservation->start && ptr < reservation->start + reservation->pinned) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// If the free chunk fills a region in a reservation, removes the region and returns true.
+Word removeReservedRegion(FreeChunkHeader* chunk) {
+    for (int i = 0; i < MAX_RESERVATIONS; i++) {
+        Reservation* reservation = &reservations[i];
+        if (reservation->size != 0 && (void*)chunk >= reservation->start
+                && (void*)chunk < reservation->start + reservation->size) {
+            clearPageOwner(reservation->start, reservation->committed);
+            reservation->firstChunk = NULL;
+            STAT_SUB(regionsUsed, 1);
+            // The newest reservation is kept for the next region.
+            if (reservation == newestReservation) {
+                decommitPages(reservation);
+            } else {
+                releaseReservation(reservation);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sets the size of the address space reserved for regions at a time.
+void setRegionReservation(size_t bytes) {
+    LOCK_BACKEND();
+    reservationBytes = bytes == 0 ? 0 : CEIL(bytes, (Word)getpagesize());
+    // New regions go in a reservation of the new size. The newest one is unmapped straight away if it
+    // is empty, or when its region is removed otherwise.
+    if (newestReservation != NULL) {
+        Reservation* reservation = newestReservation;
+        newestReservation = NULL;
+        if (reservation->firstChunk == NULL) {
+            releaseReservation(reservation);
+        }
+    }
+    UNLOCK_BACKEND();
+}
+
+// Fills the pages inside a free chunk, so they are resident before the program uses them.
+static void populateChunk(ChunkHeader* chunk) {
+    Word pageSize = getpagesize();
+    Word start = CEIL((Word)chunk + sizeof(FreeChunkHeader), pageSize);
+    Word end = (Word)GET_FREE_CHUNK_FOOTER(chunk) & ~(pageSize - 1);
+    if (end <= start) {
+        return;
+    }
+#ifdef MADV_POPULATE_WRITE
+    // Faults every page in with one call on Linux 5.14 and later.
+    if (madvise((void*)start, end - start, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+    for (Word page = start; page < end; page += pageSize) {
+        *(volatile char*)page = 0;
+    }
+}
+
+// Commits bytes more pages to the region of the newest reservation, and puts them in the bins as a free chunk.
+static int reserveLargeChunk(Word bytes, int flags) {
+    Word size = getLargeChunkSize(bytes);
+    if (size == 0) {
+        return -1;
+    }
+    Reservation* reservation = newestReservation;
+    ChunkHeader* chunk = NULL;
+    if (reservation != NULL) {
+        chunk = reservation->firstChunk != NULL ? growRegion(reservation, size, NULL) : startRegion(reservation, size, NULL);
+    }
+    if (chunk == NULL) {
+        Word regionSize = CEIL(size + RESERVED_REGION_OVERHEAD, (Word)getpagesize());
+        reservation = reserveAddressSpace(regionSize > reservationBytes ? regionSize : reservationBytes);
+        if (reservation == NULL) {
+            return -1;
+        }
+        chunk = reservation->firstChunk != NULL ? growRegion(reservation, size, NULL) : startRegion(reservation, size, NULL);
+        if (chunk == NULL) {
+            return -1;
+        }
+    }
+    // The chunk's neighbours are the fence and an allocated chunk, so there is nothing to coalesce.
+    // It goes straight into the bins rather than through releaseChunk, which would remove an empty region.
+    addChunkToBin(makeChunkFree(chunk));
+    if (flags & VMEM_RESERVE_POPULATE) {
+        populateChunk(chunk);
+    }
+    if (flags & VMEM_RESERVE_PIN) {
+        if (reservation->pinned == 0) {
+            pinnedReservations++;
+        }
+        reservation->pinned = reservation->committed;
+    }
+    return 0;
+}
+
+// Maps memory for the large bins, and creates containers for the chosen small bins, ahead of time.
+int vmemreserve(size_t bytes, int flags) {
+    int validFlags = VMEM_RESERVE_POPULATE | VMEM_RESERVE_PIN | (VMEM_RESERVE_SMALL(NUM_SMALL_BINS) - VMEM_RESERVE_SMALL(0));
+    if (bytes == 0 || (flags & ~validFlags) != 0) {
+        fprintf(stderr, "arguments passed to vmemreserve were invalid (%zu, %d)\n", bytes, flags);
+        return -1;
+    }
+    // The bytes are shared between the large bins and each chosen small bin.
+    int shares = 1;
+    for (int bin = 0; bin < NUM_SMALL_BINS; bin++) {
+        shares += (flags & VMEM_RESERVE_SMALL(bin)) != 0;
+    }
+    Word share = bytes / shares;
+    LOCK_BACKEND();
+    if (reservationBytes == 0 || hugePageMode != VMEM_HUGE_PAGES_OFF) {
+        UNLOCK_BACKEND();
+        fprintf(stderr, "vmemreserve needs regions to be committed from reservations, with huge page mode off\n");
+        return -1;
+    }
+    int result = reserveLargeChunk(share, flags);
+    UNLOCK_BACKEND();
+    if (result != 0) {
+        return -1;
+    }
+    int containers = share / CONTAINER_REGION_SIZE > 0 ? share / CONTAINER_REGION_SIZE : 1;
+    for (int bin = 0; bin < NUM_SMALL_BINS; bin++) {
+        if ((flags & VMEM_RESERVE_SMALL(bin)) && reserveContainers(bin, containers, flags & VMEM_RESERVE_PIN) < containers) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef VMEMALLOC_RESERVATION_GUARD
+#define VMEMALLOC_RESERVATION_GUARD
+
+// Regions of large chunks are committed from address space reserved with PROT_NONE, rather than each
+// being mapped on its own. A reservation holds one region, which grows by committing the pages after it
+// in steps that grow with the region, so a heap that grows gradually stays in one region, and chunks can
+// be coalesced across what would have been separate mappings. The region ends with a fence: an allocated
+// chunk of FENCE_SIZE bytes whose PREVIOUS_CHUNK_FREE bit says whether the last chunk before it can take
+// over the pages committed next. Once the region is empty its pages are decommitted, and reservations
+// other than the newest are unmapped. All functions must be called with the backend lock held.
+
+// Default size of a reservation, which can be changed with setRegionReservation.
+#define DEFAULT_RESERVATION_BYTES (64 * 1024 * 1024)
+
+// Regions grow by a quarter of their size at a time, but by no less than MIN_COMMIT_STEP and, unless
+// an allocation needs it, no more than MAX_COMMIT_STEP.
+#define MIN_COMMIT_STEP (64 * 1024)
+#define MAX_COMMIT_STEP (4 * 1024 * 1024)
+
+// Maximum number of reservations. Regions are mapped on their own while every one is in use.
+#define MAX_RESERVATIONS 64
+
+// Size of the fence chunk, which is smaller than any other chunk so it can be recognised.
+#define FENCE_SIZE ALIGNMENT_OFFSET
+
+// Returns an allocated chunk of at least size bytes from the newest reservation, taking over the free
+// chunk at the end of its region if there is one. Returns NULL if reservations are off or the chunk is
+// too big for one, in which case the region must be mapped on its own. zeroed is set as by newRegion.
+extern ChunkHeader* commitRegion(Word size, Word* zeroed);
+
+// Returns true if ptr is in pages pinned by vmemreserve, which are never decommitted.
+extern Word isPinned(void* ptr);
+
+// If the free chunk fills a region in a reservation, removes the region and returns true.
+extern Word removeReservedRegion(FreeChunkHeader* chunk);
+
+#endif
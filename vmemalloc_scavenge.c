@@ -0,0 +1,105 @@
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+#include "vmemalloc_small.h"
+#include "vmemalloc_pagemap.h"
+#include "vmemalloc_thread.h"
+#include "vmemalloc_regioncache.h"
+#include "vmemalloc_stats.h"
+#include "vmemalloc_scavenge.h"
+#include "vmemalloc_reservation.h"
+
+// A pass runs once this many bytes have been freed since the last one, or never if it is 0...
+static Word scavengeBytes = DEFAULT_SCAVENGE_BYTES;
+// ...as long as the last pass was at least this long ago, so chunks being reused straight away
+// aren't released and faulted back in over and over.
+static long scavengeDelay = DEFAULT_SCAVENGE_DELAY_MS;
+
+// Bytes freed into the bins since the last pass.
+static Word bytesFreedSinceScavenge = 0;
+
+// When the last pass ran, in milliseconds.
+static long lastScavenge = 0;
+
+// Releases the whole pages between the links and the footer of a free chunk, and marks it as
+// decommitted. Returns the number of bytes released.
+static Word decommitChunk(FreeChunkHeader* chunk) {
+    // Memory pinned by vmemreserve stays resident, and keeps its chunks marked as resident.
+    if (isPinned(chunk)) {
+        return 0;
+    }
+    Word pageSize = getpagesize();
+    Word start = CEIL((Word)chunk + sizeof(FreeChunkHeader), pageSize);
+    Word end = (Word)GET_FREE_CHUNK_FOOTER(chunk) & ~(pageSize - 1);
+    SET_DECOMMITTED(chunk, true);
+    // Pages from the hugetlbfs pool can't be released one at a time.
+    if (end <= start || getPageOwner(chunk) & PAGE_HUGETLB) {
+        return 0;
+    }
+    // The pages read as zeros when they are touched again.
+    if (madvise((void*)start, end - start, MADV_DONTNEED)) {
+        perror("Error in madvise");
+        return 0;
+    }
+    return end - start;
+}
+
+// Releases the pages inside every free chunk in the bins.
+Word scavengeFreeChunks(void) {
+    Word released = 0;
+    // Chunks in bins below the page size can't hold a whole page.
+    int firstBin = COUNT_TRAILING_ZEROS((Word)getpagesize());
+    Word usedBins = binBitmap & (~(Word)0 << firstBin);
+    while (usedBins != 0) {
+        int bin = COUNT_TRAILING_ZEROS(usedBins);
+        usedBins &= usedBins - 1;
+        Word usedSubBins = subBinBitmaps[bin];
+        while (usedSubBins != 0) {
+            int subBin = COUNT_TRAILING_ZEROS(usedSubBins);
+            usedSubBins &= usedSubBins - 1;
+            for (FreeChunkHeader* chunk = bins[bin][subBin]; chunk != NULL; chunk = chunk->nextFree) {
+                if (!GET_DECOMMITTED(chunk)) {
+                    released += decommitChunk(chunk);
+                }
+            }
+        }
+    }
+    bytesFreedSinceScavenge = 0;
+    lastScavenge = timeInMillis();
+    STAT_ADD(scavengeCount, 1);
+    STAT_ADD(scavengedBytes, released);
+    return released;
+}
+
+// Counts bytes freed into the bins, and scavenges if the limits have been reached.
+void scavengeAfterFree(Word bytes) {
+    bytesFreedSinceScavenge += bytes;
+    if (scavengeBytes == 0 || bytesFreedSinceScavenge < scavengeBytes) {
+        return;
+    }
+    if (timeInMillis() - lastScavenge < scavengeDelay) {
+        return;
+    }
+    scavengeFreeChunks();
+}
+
+// Sets how many bytes must be freed, and how long must pass, between scavenges.
+void setScavengeLimits(size_t freedBytes, int delayMillis) {
+    LOCK_BACKEND();
+    scavengeBytes = freedBytes;
+    scavengeDelay = delayMillis > 0 ? delayMillis : 0;
+    UNLOCK_BACKEND();
+}
+
+// Releases the pages of every cached region and of the free chunks in the bins, after giving the
+// calling thread's cached large chunks back to the bins.
+size_t vmemtrim(void) {
+    LOCK_BACKEND();
+    flushThreadCache();
+    Word released = releaseCachedRegions();
+    released += scavengeFreeChunks();
+    UNLOCK_BACKEND();
+    return released;
+}
@@ -0,0 +1,20 @@
+#ifndef VMEMALLOC_SCAVENGE_GUARD
+#define VMEMALLOC_SCAVENGE_GUARD
+
+// Free large chunks keep their pages, so a region with a few chunks still in use can hold on to a lot
+// of unused memory. The scavenger gives the whole pages inside free chunks back to the kernel with
+// madvise, and marks the chunks with DECOMMITTED so they aren't released twice. A pass runs from
+// vmemfreeLarge once enough bytes have been freed and enough time has gone by since the last pass, and
+// from vmemtrim. All functions must be called with the backend lock held.
+
+// Default limits, which can be changed with setScavengeLimits.
+#define DEFAULT_SCAVENGE_BYTES (16 * 1024 * 1024)
+#define DEFAULT_SCAVENGE_DELAY_MS 1000
+
+// Counts bytes freed into the bins, and scavenges if the limits have been reached.
+extern void scavengeAfterFree(Word bytes);
+
+// Releases the pages inside every free chunk in the bins. Returns the number of bytes released.
+extern Word scavengeFreeChunks(void);
+
+#endif
@@ -1,17 +1,24 @@
 #include "vmemalloc.h"
 #include "vmemalloc_large.h"
 #include "vmemalloc_small.h"
+#include "vmemalloc_pagemap.h"
+#include "vmemalloc_thread.h"
+#include "vmemalloc_stats.h"
+#include "vmemalloc_hugepage.h"
 
+#ifndef VMEM_THREAD_SAFE
 // Small chunks are put in containers with the appropriate size (sizes are powers of 2)
-ContainerHeader* smallBins[SMALL_CHUNK_LIMIT_POWER] = {NULL}; // {1, 2, 3-4, 5-8...}
+SmallHeap mainHeap; // {1, 2, 3-4, 5-8...}
+#endif
 
 // Finds the bin for the corresponding size.
 int getSmallBin(int size) {
-    // Special case to avoid log(0).
+    // Special case to avoid clz(0).
     if (size == 1) {
         return 0;
     }
-    return (int)log2(size - 1) + 1;
+    // Position of the highest bit of size - 1, plus one.
+    return WORD_BITS - COUNT_LEADING_ZEROS((Word)(size - 1));
 }
 
 // The maximum size of a chunk in the bin.
@@ -20,91 +27,498 @@ int getSmallBinChunkSize(int bin) {
     return (1 << bin);
 }
 
-// Creates a new container and adds it to the correct bin.
-void addNewContainer(int bin, int chunkSize) {
-    int sizeToAlloc = sizeof(ContainerHeader) + (CHUNKS_PER_CONTAINER * chunkSize);
-    ContainerHeader* container = (ContainerHeader*) vmemallocLarge(sizeToAlloc);
-    // Space allocated by vmemallocLarge isn't really allocated.
-    allocatedSpace -= sizeToAlloc;
-    freeSpace += CHUNKS_PER_CONTAINER * chunkSize;
-    if (container == NULL) {
-        fprintf(stderr, "new mallocd container was null\n");
+// Number of words in the bitmap of a container with chunkCount chunks.
+int getContainerMaskWords(int chunkCount) {
+    return CEIL(chunkCount, WORD_BITS) / WORD_BITS;
+}
+
+// Offset of the first chunk in a container with bitmaps big enough for chunkCount chunks.
+int getContainerDataOffset(int chunkCount) {
+    int maskWords = getContainerMaskWords(chunkCount) * CONTAINER_MASKS;
+    return CEIL(sizeof(ContainerHeader) + maskWords * sizeof(Word), LARGEST_ALIGNMENT);
+}
+
+// The number of chunks that fit into a container along with the header and bitmaps.
+int getContainerChunkCount(int chunkSize) {
+    // Each chunk uses chunkSize bytes and one bit of each bitmap.
+    int chunkCount = ((CONTAINER_SIZE - sizeof(ContainerHeader)) * CHAR_BIT) / (CHAR_BIT * chunkSize + CONTAINER_MASKS);
+    // freeWords can only describe WORD_BITS words of the bitmap.
+    if (chunkCount > (int)(WORD_BITS * WORD_BITS)) {
+        chunkCount = WORD_BITS * WORD_BITS;
+    }
+    // Rounding the bitmaps and the chunks up to LARGEST_ALIGNMENT may leave too little space.
+    while (getContainerDataOffset(chunkCount) + chunkCount * chunkSize > (int)CONTAINER_SIZE) {
+        chunkCount--;
+    }
+    return chunkCount;
+}
+
+#ifdef VMEM_THREAD_SAFE
+// The bitmap where other threads mark the chunks they free.
+Word* getRemoteMask(ContainerHeader* container) {
+    return container->freeMask + getContainerMaskWords(container->chunkCount);
+}
+#endif
+
+// Adds a container to the head of a list.
+void pushContainer(ContainerHeader** list, ContainerHeader* container) {
+    container->lastContainer = NULL;
+    container->nextContainer = *list;
+    if (*list != NULL) {
+        (*list)->lastContainer = container;
+    }
+    *list = container;
+}
+
+// Removes a container from a list.
+void unlinkContainer(ContainerHeader** list, ContainerHeader* container) {
+    if (*list == container) {
+        *list = container->nextContainer;
+    }
+    if (container->nextContainer != NULL) {
+        container->nextContainer->lastContainer = container->lastContainer;
+    }
+    if (container->lastContainer != NULL) {
+        container->lastContainer->nextContainer = container->nextContainer;
+    }
+    container->nextContainer = NULL;
+    container->lastContainer = NULL;
+}
+
+// The list of the bin which holds containers in the given state.
+ContainerHeader** getContainerList(SmallBin* smallBin, ContainerState state) {
+    switch (state) {
+        case CONTAINER_PARTIAL:
+            return &smallBin->partial;
+        case CONTAINER_FULL:
+            return &smallBin->full;
+        default:
+            return &smallBin->empty;
+    }
+}
+
+// Moves a container to the list of the bin for its new state.
+void moveContainer(ContainerHeader* container, ContainerState state) {
+    SmallBin* smallBin = &container->heap->bins[container->bin];
+    unlinkContainer(getContainerList(smallBin, container->state), container);
+    container->state = state;
+    pushContainer(getContainerList(smallBin, state), container);
+}
+
+// Places a container in a region and records it in the page map, or gives the region back and returns
+// NULL if that fails. The caller must hold the backend lock.
+static ContainerHeader* placeContainer(void* region) {
+    // The container is placed as if it was the chunk of a region, whether or not it has its own.
+    ContainerHeader* container = GET_CONTAINER(region);
+    // Chunks in the region belong to the container rather than the large allocator.
+    if (setPageOwner(region, CONTAINER_REGION_SIZE, container, PAGE_CONTAINER)) {
+        releaseContainerRegion(region);
+        fprintf(stderr, "Failed to add container to the page map\n");
+        return NULL;
+    }
+    return container;
+}
+
+// Fills in the header of a new container, with every chunk free.
+static void initContainer(ContainerHeader* container, SmallHeap* heap, int bin) {
+    int chunkSize = getSmallBinChunkSize(bin);
+    container->heap = heap;
+    container->nextRemote = NULL;
+    container->inRemoteStack = 0;
+    container->remoteFreesInFlight = 0;
+    container->bin = bin;
+    container->chunkCount = getContainerChunkCount(chunkSize);
+    container->chunksInUse = 0;
+    container->dataOffset = getContainerDataOffset(container->chunkCount);
+
+    // Mark every chunk as free.
+    int fullWords = container->chunkCount / WORD_BITS;
+    int remainingBits = container->chunkCount % WORD_BITS;
+    for (int i = 0; i < fullWords; i++) {
+        container->freeMask[i] = ~(Word)0;
+    }
+    if (remainingBits > 0) {
+        container->freeMask[fullWords++] = ((Word)1 << remainingBits) - 1;
+    }
+    container->freeWords = (fullWords == (int)WORD_BITS) ? ~(Word)0 : ((Word)1 << fullWords) - 1;
+#ifdef VMEM_THREAD_SAFE
+    Word* remoteMask = getRemoteMask(container);
+    for (int i = 0; i < fullWords; i++) {
+        remoteMask[i] = (Word)0;
+    }
+#endif
+
+    STAT_ADD(smallBinContainers[bin], 1);
+}
+
+// Creates a new, empty container with its own region.
+ContainerHeader* newContainer(SmallHeap* heap, int bin) {
+    LOCK_BACKEND();
+    void* region = takeContainerRegion();
+    if (region == NULL) {
+        UNLOCK_BACKEND();
+        fprintf(stderr, "new mmapped container was null\n");
+        return NULL;
+    }
+    ContainerHeader* container = placeContainer(region);
+    UNLOCK_BACKEND();
+    if (container != NULL) {
+        initContainer(container, heap, bin);
+    }
+    return container;
+}
+
+// Unmaps a container which has no chunks in use.
+void removeContainer(ContainerHeader* container) {
+    STAT_SUB(smallBinContainers[container->bin], 1);
+    LOCK_BACKEND();
+    releaseContainerRegion((void*)container - sizeof(ChunkHeader) - ALIGNMENT_OFFSET);
+    UNLOCK_BACKEND();
+}
+
+// Unmaps empty containers of the bin until no more than limit are left. Containers that other
+// threads are still freeing chunks into are kept until they have finished.
+void trimEmptyContainers(SmallBin* smallBin, int limit) {
+    ContainerHeader* container = smallBin->empty;
+    while (smallBin->emptyCount > limit && container != NULL) {
+        ContainerHeader* nextContainer = container->nextContainer;
+#ifdef VMEM_THREAD_SAFE
+        if (__atomic_load_n(&container->inRemoteStack, __ATOMIC_ACQUIRE)
+                || __atomic_load_n(&container->remoteFreesInFlight, __ATOMIC_ACQUIRE)) {
+            container = nextContainer;
+            continue;
+        }
+#endif
+        unlinkContainer(&smallBin->empty, container);
+        smallBin->emptyCount--;
+        removeContainer(container);
+        container = nextContainer;
+    }
+}
+
+// Unmaps empty containers that are no longer worth keeping. All of them go once the bin has
+// no chunks in use, so an idle bin does not hold on to any memory.
+void trimBin(SmallBin* smallBin) {
+    int limit = smallBin->containersInUse > 0 ? MAX_EMPTY_CONTAINERS : 0;
+    // Pinned containers are kept whether they are in use or not.
+    if (limit < smallBin->pinnedContainers - smallBin->containersInUse) {
+        limit = smallBin->pinnedContainers - smallBin->containersInUse;
+    }
+    trimEmptyContainers(smallBin, limit);
+}
+
+// Moves a container to the right list after some of its chunks have been freed.
+void updateContainerState(ContainerHeader* container) {
+    SmallBin* smallBin = &container->heap->bins[container->bin];
+    if (container->state == CONTAINER_EMPTY) {
+        // Already counted as empty.
+        return;
+    }
+    if (container->state == CONTAINER_FULL) {
+        moveContainer(container, CONTAINER_PARTIAL);
+    }
+    if (container->chunksInUse == 0) {
+        // Container is completely empty, so keep it for reuse or unmap it.
+        moveContainer(container, CONTAINER_EMPTY);
+        smallBin->emptyCount++;
+        smallBin->containersInUse--;
+        trimBin(smallBin);
+    }
+}
+
+// Marks the chunks given by the bits of a bitmap word as free.
+void markChunksFree(ContainerHeader* container, int word, Word bits) {
+    container->freeMask[word] |= bits;
+    container->freeWords |= (Word)1 << word;
+    container->chunksInUse -= COUNT_SET_BITS(bits);
+}
+
+#ifdef VMEM_THREAD_SAFE
+// Applies the frees made by other threads to containers of the heap, and unmaps containers that become empty.
+void collectRemoteFrees(SmallHeap* heap) {
+    // Take the whole stack at once, so other threads can keep pushing onto a new one.
+    ContainerHeader* container = __atomic_exchange_n(&heap->remoteContainers, NULL, __ATOMIC_ACQUIRE);
+    while (container != NULL) {
+        ContainerHeader* nextContainer = container->nextRemote;
+        // Clear the flag before taking the bits, so a thread that frees a chunk after the bits
+        // have been taken pushes the container again.
+        __atomic_store_n(&container->inRemoteStack, 0, __ATOMIC_SEQ_CST);
+        Word* remoteMask = getRemoteMask(container);
+        int maskWords = getContainerMaskWords(container->chunkCount);
+        Word collected = false;
+        for (int word = 0; word < maskWords; word++) {
+            Word bits = __atomic_exchange_n(&remoteMask[word], (Word)0, __ATOMIC_SEQ_CST);
+            if (bits != (Word)0) {
+                markChunksFree(container, word, bits);
+                collected = true;
+            }
+        }
+        // A free made after the flag was cleared may have been taken by an earlier pass, leaving
+        // nothing to collect this time.
+        if (collected) {
+            updateContainerState(container);
+        }
+        container = nextContainer;
+    }
+}
+
+// Marks a chunk freed by a thread that doesn't own its container, without locking.
+int freeRemoteChunk(ContainerHeader* container, int index) {
+    int chunkSize = getSmallBinChunkSize(container->bin);
+    Word bit = (Word)1 << (index % WORD_BITS);
+    // The owner can't unmap the container while this thread is still using it.
+    __atomic_add_fetch(&container->remoteFreesInFlight, 1, __ATOMIC_SEQ_CST);
+    Word oldBits = __atomic_fetch_or(&getRemoteMask(container)[index / WORD_BITS], bit, __ATOMIC_SEQ_CST);
+    if (oldBits & bit) {
+        __atomic_sub_fetch(&container->remoteFreesInFlight, 1, __ATOMIC_SEQ_CST);
+        fprintf(stderr, "Tried to free a free small chunk\n");
+        return 0;
+    }
+    STAT_SUB(allocatedSpace, chunkSize);
+    STAT_SUB(smallBinChunksInUse[container->bin], 1);
+    // Push the container onto the owner's stack, unless it is already there.
+    if (!__atomic_exchange_n(&container->inRemoteStack, 1, __ATOMIC_SEQ_CST)) {
+        SmallHeap* heap = container->heap;
+        ContainerHeader* head = __atomic_load_n(&heap->remoteContainers, __ATOMIC_RELAXED);
+        do {
+            container->nextRemote = head;
+        } while (!__atomic_compare_exchange_n(&heap->remoteContainers, &head, container, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    __atomic_sub_fetch(&container->remoteFreesInFlight, 1, __ATOMIC_SEQ_CST);
+    return chunkSize;
+}
+#endif
+
+// Unmaps the empty containers of the heap, other than pinned ones, before the heap is abandoned.
+void releaseEmptyContainers(SmallHeap* heap) {
+    for (int bin = 0; bin < NUM_SMALL_BINS; bin++) {
+        SmallBin* smallBin = &heap->bins[bin];
+        trimEmptyContainers(smallBin, smallBin->pinnedContainers - smallBin->containersInUse);
+    }
+}
+
+// Creates count empty containers in a bin of the calling thread's heap.
+int reserveContainers(int bin, int count, Word pin) {
+    SmallHeap* heap = getThreadHeap();
+    if (heap == NULL) {
+        return 0;
+    }
+    SmallBin* smallBin = &heap->bins[bin];
+    int created = 0;
+    LOCK_BACKEND();
+    // The containers are carved out of one mapping rather than each mapping its own region.
+    void* block = mapContainerRegions(count);
+    if (block != NULL) {
+        while (created < count && placeContainer(block + created * CONTAINER_REGION_SIZE) != NULL) {
+            created++;
+        }
+        // Give back the regions after one the page map couldn't take.
+        for (int i = created + 1; i < count; i++) {
+            releaseContainerRegion(block + i * CONTAINER_REGION_SIZE);
+        }
+    }
+    UNLOCK_BACKEND();
+    for (int i = 0; i < created; i++) {
+        ContainerHeader* container = GET_CONTAINER(block + i * CONTAINER_REGION_SIZE);
+        initContainer(container, heap, bin);
+        container->state = CONTAINER_EMPTY;
+        pushContainer(&smallBin->empty, container);
+        smallBin->emptyCount++;
     }
-    container->s.mask = (Word)0;
-    container->s.nextContainer = smallBins[bin];
-    smallBins[bin] = container;
+    if (pin) {
+        smallBin->pinnedContainers += created;
+    }
+    return created;
+}
+
+// Gets a container with free chunks from the bin, reusing an empty container or creating one if necessary.
+ContainerHeader* getPartialContainer(SmallHeap* heap, int bin) {
+    SmallBin* smallBin = &heap->bins[bin];
+#ifdef VMEM_THREAD_SAFE
+    if (smallBin->partial == NULL) {
+        // Chunks freed by other threads may have made some containers partial again.
+        collectRemoteFrees(heap);
+    }
+#endif
+    if (smallBin->partial != NULL) {
+        return smallBin->partial;
+    }
+    ContainerHeader* container = smallBin->empty;
+    if (container != NULL) {
+        smallBin->emptyCount--;
+        moveContainer(container, CONTAINER_PARTIAL);
+    } else {
+        container = newContainer(heap, bin);
+        if (container == NULL) {
+            return NULL;
+        }
+        container->state = CONTAINER_PARTIAL;
+        pushContainer(&smallBin->partial, container);
+    }
+    smallBin->containersInUse++;
+    return container;
 }
 
 // Returns a suitable chunk for use by a program.
-// Fast but inefficient implementation for small chunks.
+// Takes the first free chunk of the first partial container, so it runs in constant time.
 void* vmemallocSmall(int size) {
+    SmallHeap* heap = getThreadHeap();
+    if (heap == NULL) {
+        return NULL;
+    }
     int bin = getSmallBin(size);
     int chunkSize = getSmallBinChunkSize(bin);
-    // If there are no suitably sized containers.
-    if (smallBins[bin] == NULL) {
-        addNewContainer(bin, chunkSize);
-    }
-
-    ContainerHeader* container = smallBins[bin];
-    // Find a bit in the mask signifying a free space.
-    Word mask = (Word)1;
-    for (int i = 0; (Word)i < CHUNKS_PER_CONTAINER; i++) {
-        if (!(container->s.mask & mask)) {
-            // Found a free positiion.
-            // Flip the bit for the position.
-            container->s.mask |= mask;
-            allocatedSpace += chunkSize;
-            freeSpace -= chunkSize;
-            // Calculate position of chunk to return.
-            return (void*)container + sizeof(ContainerHeader) + (i * chunkSize);
+    ContainerHeader* container = getPartialContainer(heap, bin);
+    if (container == NULL) {
+        return NULL;
+    }
+
+    // Find a word of the bitmap with a free chunk, then the free chunk within it.
+    int word = COUNT_TRAILING_ZEROS(container->freeWords);
+    int bit = COUNT_TRAILING_ZEROS(container->freeMask[word]);
+    container->freeMask[word] &= ~((Word)1 << bit);
+    if (container->freeMask[word] == (Word)0) {
+        container->freeWords &= ~((Word)1 << word);
+    }
+    container->chunksInUse++;
+    if (container->chunksInUse == container->chunkCount) {
+        moveContainer(container, CONTAINER_FULL);
+    }
+    STAT_ADD(allocatedSpace, chunkSize);
+    STAT_ADD(smallBinChunksInUse[bin], 1);
+    // Calculate position of chunk to return.
+    int index = word * WORD_BITS + bit;
+    return (void*)container + container->dataOffset + (index << bin);
+}
+
+// Allocates count chunks of size bytes, taking every free chunk of a bitmap word at once.
+// Returns the number of chunks allocated, which is less than count if no more containers could be created.
+Word vmemallocSmallBatch(int size, Word count, void** chunks) {
+    SmallHeap* heap = getThreadHeap();
+    if (heap == NULL) {
+        return 0;
+    }
+    int bin = getSmallBin(size);
+    Word allocated = 0;
+    while (allocated < count) {
+        ContainerHeader* container = getPartialContainer(heap, bin);
+        if (container == NULL) {
+            break;
         }
-        // Weird Haskell. Or possibly bit shifting the mask to the next position.
-        mask <<= 1;
-    }
-
-    // If we get to here, the container must be full, so make a new one.
-    addNewContainer(bin, chunkSize);
-    // New container will always be at the top of the list.
-    container = smallBins[bin];
-    // Use the first chunk.
-    container->s.mask = (Word)1;
-    allocatedSpace += chunkSize;
-    freeSpace -= chunkSize;
-    return (void*)container + sizeof(ContainerHeader);
-}
-
-// Frees a chunk used by a program so it can be re-used.
-// Returns the amount of space saved or 0 if ptr wasn't created by vmemallocSmall.
-// Fast but inefficient implementation for small chunks.
-int vmemfreeSmall(void* ptr) {
-    // Search bins for the right container.
-    for (int bin = 0; bin < SMALL_CHUNK_LIMIT_POWER; bin++) {
-        int chunkSize = getSmallBinChunkSize(bin);
-        int containerSize = sizeof(ContainerHeader) + (CHUNKS_PER_CONTAINER * chunkSize);
-        // May need to modify pointer to container if removing container from the list.
-        ContainerHeader** containerPtr = &smallBins[bin];
-        ContainerHeader* container = smallBins[bin];
-        // Search all containers in the bin.
-        while (container != NULL) {
-            // If pointer is inside the container.
-            if (ptr >= (void*)container + sizeof(ContainerHeader) && ptr < (void*)container + containerSize) {
-                int ptrIndex = (ptr - sizeof(ContainerHeader) - (void*)container) / chunkSize;
-                // Mark the chunk as free.
-                container->s.mask &= ~(((Word)1) << ptrIndex);
-                allocatedSpace -= chunkSize;
-                freeSpace += chunkSize;
-                if (container->s.mask == (Word)0) {
-                    // Container is completely empty and can be removed.
-                    *containerPtr = container->s.nextContainer;
-                    vmemfreeLarge(container);
-                    allocatedSpace += sizeof(ContainerHeader) + (CHUNKS_PER_CONTAINER * chunkSize);
-                    freeSpace -= CHUNKS_PER_CONTAINER * chunkSize;
-                }
-                return chunkSize;
+        while (allocated < count && container->freeWords != (Word)0) {
+            int word = COUNT_TRAILING_ZEROS(container->freeWords);
+            Word bits = container->freeMask[word];
+            int taken = 0;
+            // Clear the lowest set bit until the word or the batch runs out.
+            while (bits != (Word)0 && allocated < count) {
+                int index = word * WORD_BITS + COUNT_TRAILING_ZEROS(bits);
+                chunks[allocated++] = (void*)container + container->dataOffset + (index << bin);
+                bits &= bits - 1;
+                taken++;
+            }
+            container->freeMask[word] = bits;
+            if (bits == (Word)0) {
+                container->freeWords &= ~((Word)1 << word);
             }
-            containerPtr = &container->s.nextContainer;
-            container = container->s.nextContainer;
+            container->chunksInUse += taken;
         }
+        if (container->chunksInUse == container->chunkCount) {
+            moveContainer(container, CONTAINER_FULL);
+        }
+    }
+    STAT_ADD(allocatedSpace, (int64_t)allocated * getSmallBinChunkSize(bin));
+    STAT_ADD(smallBinChunksInUse[bin], (int64_t)allocated);
+    return allocated;
+}
+
+// The index of the chunk at ptr in the container, or -1 if ptr isn't the start of one of its chunks.
+int getContainerChunkIndex(ContainerHeader* container, void* ptr) {
+    int chunkSize = getSmallBinChunkSize(container->bin);
+    int offset = ptr - ((void*)container + container->dataOffset);
+    int index = offset >> container->bin;
+    if (offset < 0 || index >= container->chunkCount || (offset & (chunkSize - 1)) != 0) {
+        fprintf(stderr, "Tried to free a pointer into the middle of a small chunk\n");
+        return -1;
     }
-    return 0;
-}
\ No newline at end of file
+    return index;
+}
+
+// Frees chunks of one container, sorted by address, updating each bitmap word and the container's
+// lists once. Returns the number of chunks freed.
+Word vmemfreeSmallBatch(ContainerHeader* container, void** chunks, Word count) {
+    Word freed = 0;
+#ifdef VMEM_THREAD_SAFE
+    // Only the owner of the container may change its lists and bitmap.
+    if (container->heap != peekThreadHeap()) {
+        for (Word i = 0; i < count; i++) {
+            int index = getContainerChunkIndex(container, chunks[i]);
+            if (index >= 0 && freeRemoteChunk(container, index) != 0) {
+                freed++;
+            }
+        }
+        return freed;
+    }
+#endif
+    int word = 0;
+    Word bits = 0;
+    for (Word i = 0; i < count; i++) {
+        int index = getContainerChunkIndex(container, chunks[i]);
+        if (index < 0) {
+            continue;
+        }
+        // Sorted chunks in the same word are next to each other, so each word is written once.
+        if (index / (int)WORD_BITS != word) {
+            if (bits != (Word)0) {
+                markChunksFree(container, word, bits);
+            }
+            word = index / WORD_BITS;
+            bits = 0;
+        }
+        Word bit = (Word)1 << (index % WORD_BITS);
+        if ((container->freeMask[word] | bits) & bit) {
+            fprintf(stderr, "Tried to free a free small chunk\n");
+            continue;
+        }
+        bits |= bit;
+        freed++;
+    }
+    if (bits != (Word)0) {
+        markChunksFree(container, word, bits);
+    }
+    if (freed > 0) {
+        STAT_SUB(allocatedSpace, (int64_t)freed * getSmallBinChunkSize(container->bin));
+        STAT_SUB(smallBinChunksInUse[container->bin], (int64_t)freed);
+        updateContainerState(container);
+    }
+    return freed;
+}
+
+// Frees a chunk in a container so it can be re-used.
+// Returns the amount of space saved or 0 if ptr isn't an allocated chunk of the container.
+int vmemfreeSmall(ContainerHeader* container, void* ptr) {
+    int chunkSize = getSmallBinChunkSize(container->bin);
+    int index = getContainerChunkIndex(container, ptr);
+    if (index < 0) {
+        return 0;
+    }
+#ifdef VMEM_THREAD_SAFE
+    // Only the owner of the container may change its lists and bitmap.
+    if (container->heap != peekThreadHeap()) {
+        return freeRemoteChunk(container, index);
+    }
+#endif
+    int word = index / WORD_BITS;
+    Word bit = (Word)1 << (index % WORD_BITS);
+    if (container->freeMask[word] & bit) {
+        fprintf(stderr, "Tried to free a free small chunk\n");
+        return 0;
+    }
+
+    // Mark the chunk as free.
+    markChunksFree(container, word, bit);
+    STAT_SUB(allocatedSpace, chunkSize);
+    STAT_SUB(smallBinChunksInUse[container->bin], 1);
+    updateContainerState(container);
+    return chunkSize;
+}
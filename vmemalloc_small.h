@@ -1,27 +1,129 @@
 #ifndef VMEMALLOC_SMALL_GUARD
 #define VMEMALLOC_SMALL_GUARD
 
-// Semi arbitrary - need to balance container size so it's not too small or too large.
-#define CHUNKS_PER_CONTAINER ((CHAR_BIT * sizeof(Word)) / 4)
-
-// Container for lots of small chunks. Implemented as alloc'd chunk.
-typedef union ContainerHeader {
-    struct {
-        // part of a linked list of containers.
-        union ContainerHeader* nextContainer;
-        // Bitmap where the nth bit represents the freeness of the nth chunk.
-        Word mask;
-    } s;
-    LARGEST_ALIGNMENT_TYPE padding;
+// Number of bins of small chunks. Sizes up to SMALL_CHUNK_LIMIT - 1 round up to SMALL_CHUNK_LIMIT,
+// so the last bin holds chunks of size SMALL_CHUNK_LIMIT.
+#define NUM_SMALL_BINS (SMALL_CHUNK_LIMIT_POWER + 1)
+
+// Every container lives in its own region of this size. Regions created by mmap are page aligned,
+// so the region (and the container inside it) can be found by rounding a chunk address down.
+#define CONTAINER_REGION_SIZE 4096
+
+// Space left for the container after the region footer and the chunk header of the region.
+#define CONTAINER_SIZE (CONTAINER_REGION_SIZE - sizeof(RegionFooter) - sizeof(ChunkHeader) - ALIGNMENT_OFFSET)
+
+// Number of bits in a bitmap word.
+#define WORD_BITS (CHAR_BIT * sizeof(Word))
+
+// Maximum number of empty containers kept in a bin for reuse while the bin has chunks in use.
+#define MAX_EMPTY_CONTAINERS 2
+
+// In the thread-safe build each bitmap word has a partner where other threads mark the chunks they free.
+#ifdef VMEM_THREAD_SAFE
+#define CONTAINER_MASKS 2
+#else
+#define CONTAINER_MASKS 1
+#endif
+
+// Which list of its bin a container is in.
+typedef enum ContainerState {
+    CONTAINER_PARTIAL,
+    CONTAINER_FULL,
+    CONTAINER_EMPTY
+} ContainerState;
+
+struct SmallHeap;
+
+// Container for lots of small chunks of the same size. Fills a region created by newRegion.
+typedef struct ContainerHeader {
+    // Part of a doubly linked list of containers in the same state.
+    struct ContainerHeader* nextContainer;
+    struct ContainerHeader* lastContainer;
+    // The heap that owns the container. Only the thread using the heap changes freeMask.
+    struct SmallHeap* heap;
+    // Part of the heap's stack of containers with chunks freed by other threads.
+    struct ContainerHeader* nextRemote;
+    // Set while the container is in the heap's stack of containers with remote frees.
+    int inRemoteStack;
+    // Number of other threads part way through freeing a chunk in the container.
+    int remoteFreesInFlight;
+    // Bin the container belongs to - the chunk size is 2^bin.
+    int bin;
+    ContainerState state;
+    // Number of chunks in the container, and how many of them are in use.
+    int chunkCount;
+    int chunksInUse;
+    // Offset from the start of the container to the first chunk.
+    int dataOffset;
+    // Bit n is set if freeMask[n] has a free chunk, so a free chunk can be found with two bit scans.
+    Word freeWords;
+    // Bitmap where the nth bit is set if the nth chunk is free. In the thread-safe build it is followed
+    // by a bitmap of the same size where other threads set the bits of chunks they have freed.
+    Word freeMask[];
 } ContainerHeader;
 
+// Lists of containers with the same chunk size.
+typedef struct SmallBin {
+    // Containers with some free chunks. Allocation always uses the head of this list.
+    ContainerHeader* partial;
+    // Containers with no free chunks.
+    ContainerHeader* full;
+    // Containers with no chunks in use, kept to avoid remapping them.
+    ContainerHeader* empty;
+    int emptyCount;
+    // Number of partial and full containers.
+    int containersInUse;
+    // Number of containers pinned by vmemreserve, which are kept even when they are empty.
+    int pinnedContainers;
+} SmallBin;
+
+// All of the small bins used by a thread (or the whole program in the single threaded build).
+typedef struct SmallHeap {
+    SmallBin bins[NUM_SMALL_BINS];
+    // Stack of containers with chunks freed by other threads. Pushed by any thread, emptied by the owner.
+    ContainerHeader* remoteContainers;
+    // Part of the list of heaps of threads that have exited, waiting to be adopted by a new thread.
+    struct SmallHeap* nextAbandoned;
+} SmallHeap;
+
+// Finds the bin for chunks of the given size.
+extern int getSmallBin(int size);
+
+// The container holding a small chunk. Containers fill a CONTAINER_REGION_SIZE block aligned to its size,
+// placed like the chunk of a region, so it is found by rounding the chunk address down.
+#define GET_CONTAINER(ptr) ((ContainerHeader*)(((Word)(ptr) & ~(Word)(CONTAINER_REGION_SIZE - 1)) \
+        + ALIGNMENT_OFFSET + sizeof(ChunkHeader)))
+
+// The number of chunks of the given size that fit into a container.
+extern int getContainerChunkCount(int chunkSize);
+
 // Returns a suitable chunk for use by a program.
 // Fast but inefficient implementation for small chunks.
 extern void* vmemallocSmall(int size);
 
-// Frees a chunk used by a program so it can be re-used.
-// Returns the amount of space saved or 0 if ptr wasn't created by vmemallocSmall.
-// Fast but inefficient implementation for small chunks.
-extern int vmemfreeSmall(void* ptr);
+// Allocates count chunks of size bytes, taking every free chunk of a bitmap word at once.
+// Returns the number of chunks allocated, which is less than count if no more containers could be created.
+extern Word vmemallocSmallBatch(int size, Word count, void** chunks);
+
+// Frees chunks of one container, sorted by address, updating each bitmap word and the container's
+// lists once. Returns the number of chunks freed.
+extern Word vmemfreeSmallBatch(ContainerHeader* container, void** chunks, Word count);
+
+// Frees a chunk in a container so it can be re-used. The container is found with the page map.
+// Returns the amount of space saved or 0 if ptr isn't an allocated chunk of the container.
+extern int vmemfreeSmall(ContainerHeader* container, void* ptr);
+
+#ifdef VMEM_THREAD_SAFE
+// Applies the frees made by other threads to containers of the heap, and unmaps containers that become empty.
+extern void collectRemoteFrees(SmallHeap* heap);
+#endif
+
+// Creates count empty containers in a bin of the calling thread's heap, carved out of one mapping, so
+// allocations use them before mapping new ones. If pin is true the bin keeps at least that many more containers from then on.
+// Returns the number of containers created.
+extern int reserveContainers(int bin, int count, Word pin);
+
+// Unmaps the empty containers of the heap, other than pinned ones, before the heap is abandoned.
+extern void releaseEmptyContainers(SmallHeap* heap);
 
 #endif
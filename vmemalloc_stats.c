@@ -0,0 +1,175 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+#include "vmemalloc_small.h"
+#include "vmemalloc_pagemap.h"
+#include "vmemalloc_thread.h"
+#include "vmemalloc_regioncache.h"
+#include "vmemalloc_stats.h"
+
+_Static_assert(VMEM_STATS_LARGE_BINS == NUM_BINS && VMEM_STATS_SMALL_BINS == NUM_SMALL_BINS,
+    "VmemStats must have an entry for every bin");
+
+// Bytes mapped for regions (including those in the region cache) and huge chunks.
+int64_t mappedBytes = 0;
+
+// Bytes mapped for page map nodes and thread heaps.
+int64_t metadataBytes = 0;
+
+// Number of calls made to mmap, munmap and mremap.
+int64_t mmapCount = 0;
+int64_t munmapCount = 0;
+int64_t mremapCount = 0;
+
+// Number and total size of allocated huge chunks.
+int64_t hugeChunkCount = 0;
+int64_t hugeChunkBytes = 0;
+
+// Bytes mapped from the hugetlbfs pool, and bytes mapped with MADV_HUGEPAGE, in huge page mode.
+int64_t hugetlbBytes = 0;
+int64_t transparentHugePageBytes = 0;
+
+// Number of scavenges, and bytes of free chunks released by them.
+int64_t scavengeCount = 0;
+int64_t scavengedBytes = 0;
+
+// Number and total size of the free chunks in each bin of the large allocator.
+int64_t largeBinChunks[NUM_BINS];
+int64_t largeBinBytes[NUM_BINS];
+
+// Number of containers, and of chunks in use, in each bin of the small allocator.
+int64_t smallBinContainers[NUM_SMALL_BINS];
+int64_t smallBinChunksInUse[NUM_SMALL_BINS];
+
+// Number of pages checked by each call to mincore.
+#define RESIDENT_BATCH_PAGES 256
+
+// Number of bytes of [start, start + length) which are resident in memory.
+Word countResidentBytes(void* start, Word length) {
+    Word pageSize = getpagesize();
+    unsigned char pages[RESIDENT_BATCH_PAGES];
+    Word bytes = 0;
+    for (Word offset = 0; offset < length; offset += RESIDENT_BATCH_PAGES * pageSize) {
+        Word batch = length - offset;
+        if (batch > RESIDENT_BATCH_PAGES * pageSize) {
+            batch = RESIDENT_BATCH_PAGES * pageSize;
+        }
+        if (mincore(start + offset, batch, pages)) {
+            continue;
+        }
+        Word pageCount = CEIL(batch, pageSize) / pageSize;
+        for (Word i = 0; i < pageCount; i++) {
+            bytes += (pages[i] & 1) * pageSize;
+        }
+    }
+    return bytes;
+}
+
+// Range of consecutive pages found by visitPageMap, waiting to be checked with mincore.
+typedef struct ResidentCount {
+    void* start;
+    Word length;
+    Word bytes;
+} ResidentCount;
+
+// Adds a run of pages to the resident count. Runs next to each other are checked together, and
+// huge chunks are checked in full, as only their first page is in the page map.
+static void countResidentRun(void* start, Word length, PageMapEntry entry, void* context) {
+    ResidentCount* count = (ResidentCount*)context;
+    if (GET_PAGE_KIND(entry) == PAGE_HUGE) {
+        ChunkHeader* chunk = (ChunkHeader*)GET_PAGE_OWNER(entry);
+        count->bytes += countResidentBytes(start, ALIGNMENT_OFFSET + sizeof(ChunkHeader) + GET_SIZE(chunk));
+        return;
+    }
+    if (start == count->start + count->length) {
+        count->length += length;
+        return;
+    }
+    if (count->length != 0) {
+        count->bytes += countResidentBytes(count->start, count->length);
+    }
+    count->start = start;
+    count->length = length;
+}
+
+// Counts the resident bytes of every region, cached region and huge chunk.
+static Word countAllResidentBytes(void) {
+    ResidentCount count = {NULL, 0, 0};
+    // Regions and huge chunks can't be unmapped while the lock is held.
+    LOCK_BACKEND();
+    visitPageMap(countResidentRun, &count);
+    if (count.length != 0) {
+        count.bytes += countResidentBytes(count.start, count.length);
+    }
+    count.bytes += countResidentCachedBytes();
+    UNLOCK_BACKEND();
+    return count.bytes;
+}
+
+// Counters may be a little negative when read in the middle of an update by another thread.
+static uint64_t clampCounter(int64_t value) {
+    return value > 0 ? (uint64_t)value : 0;
+}
+
+// Fills stats with a snapshot of the counters. Only the resident byte count takes the lock.
+int vmemstats(VmemStats* stats, int flags) {
+    if (stats == NULL || stats->size < 2 * sizeof(uint32_t)) {
+        fprintf(stderr, "vmemstats needs a VmemStats with its size set\n");
+        return -1;
+    }
+    VmemStats snapshot;
+    memset(&snapshot, 0, sizeof(VmemStats));
+    snapshot.version = VMEM_STATS_VERSION;
+    snapshot.size = stats->size < sizeof(VmemStats) ? stats->size : sizeof(VmemStats);
+
+    snapshot.allocatedBytes = clampCounter(STAT_GET(allocatedSpace));
+    snapshot.allocatedChunks = clampCounter(STAT_GET(allocatedChunkCount));
+    snapshot.hugeAllocatedBytes = clampCounter(STAT_GET(hugeChunkBytes));
+    snapshot.hugeChunks = clampCounter(STAT_GET(hugeChunkCount));
+    for (int bin = 0; bin < (int)NUM_BINS; bin++) {
+        VmemLargeBinStats* binStats = &snapshot.largeBins[bin];
+        binStats->freeChunks = clampCounter(STAT_GET(largeBinChunks[bin]));
+        binStats->freeBytes = clampCounter(STAT_GET(largeBinBytes[bin]));
+        snapshot.freeChunks += binStats->freeChunks;
+        snapshot.freeBytes += binStats->freeBytes;
+    }
+    // Chunks kept by thread caches are counted in freeSpace but not in the bins.
+    snapshot.threadCacheBytes = clampCounter(STAT_GET(freeSpace) - (int64_t)snapshot.freeBytes);
+    for (int bin = 0; bin < NUM_SMALL_BINS; bin++) {
+        VmemSmallBinStats* binStats = &snapshot.smallBins[bin];
+        int chunkSize = 1 << bin;
+        binStats->chunkSize = chunkSize;
+        binStats->containers = clampCounter(STAT_GET(smallBinContainers[bin]));
+        binStats->chunks = binStats->containers * getContainerChunkCount(chunkSize);
+        binStats->chunksInUse = clampCounter(STAT_GET(smallBinChunksInUse[bin]));
+        if (binStats->chunksInUse > binStats->chunks) {
+            binStats->chunksInUse = binStats->chunks;
+        }
+        snapshot.smallAllocatedBytes += binStats->chunksInUse * chunkSize;
+        snapshot.smallFreeBytes += (binStats->chunks - binStats->chunksInUse) * chunkSize;
+    }
+    snapshot.regions = clampCounter(STAT_GET(regionsUsed));
+    snapshot.regionCacheBytes = clampCounter(STAT_GET(regionCacheBytes));
+    snapshot.regionCacheHits = clampCounter(STAT_GET(regionCacheHits));
+    snapshot.regionCacheMisses = clampCounter(STAT_GET(regionCacheMisses));
+    snapshot.mappedBytes = clampCounter(STAT_GET(mappedBytes));
+    snapshot.metadataBytes = clampCounter(STAT_GET(metadataBytes));
+    snapshot.mmapCalls = clampCounter(STAT_GET(mmapCount));
+    snapshot.munmapCalls = clampCounter(STAT_GET(munmapCount));
+    snapshot.mremapCalls = clampCounter(STAT_GET(mremapCount));
+    snapshot.hugePageBytes = clampCounter(STAT_GET(hugetlbBytes));
+    snapshot.transparentHugePageBytes = clampCounter(STAT_GET(transparentHugePageBytes));
+    snapshot.scavengedBytes = clampCounter(STAT_GET(scavengedBytes));
+    snapshot.scavengePasses = clampCounter(STAT_GET(scavengeCount));
+    if (snapshot.mappedBytes > snapshot.allocatedBytes) {
+        snapshot.fragmentation = 1.0 - (double)snapshot.allocatedBytes / (double)snapshot.mappedBytes;
+    }
+    if (flags & VMEM_STATS_RESIDENT) {
+        snapshot.residentBytes = countAllResidentBytes();
+    }
+    memcpy(stats, &snapshot, snapshot.size);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef VMEMALLOC_STATS_GUARD
+#define VMEMALLOC_STATS_GUARD
+
+// Counters read by vmemstats, kept alongside the counters in logger.h. Like them, they are updated
+// with STAT_ADD, so they are compiled out in the VMEM_NO_STATS build.
+
+// Bytes mapped for regions (including those in the region cache) and huge chunks.
+extern int64_t mappedBytes;
+
+// Bytes mapped for the allocator's own bookkeeping: page map nodes and thread heaps.
+extern int64_t metadataBytes;
+
+// Number of calls made to mmap, munmap and mremap.
+extern int64_t mmapCount;
+extern int64_t munmapCount;
+extern int64_t mremapCount;
+
+// Number and total size of allocated huge chunks.
+extern int64_t hugeChunkCount;
+extern int64_t hugeChunkBytes;
+
+// Number and total size of the free chunks in each bin of the large allocator, over all sub-bins.
+extern int64_t largeBinChunks[NUM_BINS];
+extern int64_t largeBinBytes[NUM_BINS];
+
+// Bytes mapped from the hugetlbfs pool, and bytes mapped with MADV_HUGEPAGE, in huge page mode.
+extern int64_t hugetlbBytes;
+extern int64_t transparentHugePageBytes;
+
+// Number of scavenges, and bytes of free chunks released by them.
+extern int64_t scavengeCount;
+extern int64_t scavengedBytes;
+
+// Number of containers, and of chunks in use, in each bin of the small allocator, over all heaps.
+extern int64_t smallBinContainers[NUM_SMALL_BINS];
+extern int64_t smallBinChunksInUse[NUM_SMALL_BINS];
+
+// Record a mapping of data (regions and huge chunks) being created, removed or resized.
+#define COUNT_MMAP(bytes) (STAT_ADD(mmapCount, 1), STAT_ADD(mappedBytes, (int64_t)(bytes)))
+#define COUNT_MUNMAP(bytes) (STAT_ADD(munmapCount, 1), STAT_SUB(mappedBytes, (int64_t)(bytes)))
+#define COUNT_MREMAP(oldBytes, newBytes) (STAT_ADD(mremapCount, 1), \
+    STAT_ADD(mappedBytes, (int64_t)(newBytes) - (int64_t)(oldBytes)))
+
+// Record a mapping of metadata being created.
+#define COUNT_METADATA_MMAP(bytes) (STAT_ADD(mmapCount, 1), STAT_ADD(metadataBytes, (int64_t)(bytes)))
+
+// Number of bytes of [start, start + length) which are resident in memory, found with mincore.
+// start must be page aligned. Pages which aren't mapped count as not resident.
+extern Word countResidentBytes(void* start, Word length);
+
+#endif
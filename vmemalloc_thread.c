@@ -0,0 +1,199 @@
+#ifdef VMEM_THREAD_SAFE
+
+#include <sys/mman.h>
+
+#include "vmemalloc.h"
+#include "vmemalloc_large.h"
+#include "vmemalloc_small.h"
+#include "vmemalloc_thread.h"
+#include "vmemalloc_stats.h"
+#include "vmemalloc_profile.h"
+#include "vmemalloc_latency.h"
+
+// Everything a thread keeps for itself.
+typedef struct ThreadCache {
+    // Heap of small containers owned by the thread.
+    SmallHeap* heap;
+    // Stacks of cached large chunks with the same size, linked through their first word.
+    void* largeChunks[LARGE_CACHE_CLASSES];
+    // Total size of the cached large chunks.
+    Word largeCacheBytes;
+    // Latency histograms the thread records into, or NULL before its first timed operation.
+    LatencyHistogram* latency;
+    // Set once the thread has registered for cleanup when it exits.
+    int registered;
+} ThreadCache;
+
+pthread_mutex_t backendLock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread ThreadCache threadCache;
+
+// Bytes of large chunks cached by all threads together.
+static Word cachedChunkBytes = 0;
+
+// Heaps of threads that have exited. Protected by the backend lock.
+static SmallHeap* abandonedHeaps = NULL;
+
+// Key used to run releaseThreadCache when a thread exits.
+static pthread_key_t threadCacheKey;
+static pthread_once_t threadCacheKeyOnce = PTHREAD_ONCE_INIT;
+
+// Gives the cached large chunks of a thread back to the bins. The caller must hold the backend lock.
+static void releaseLargeChunks(ThreadCache* cache) {
+    for (int i = 0; i < (int)LARGE_CACHE_CLASSES; i++) {
+        while (cache->largeChunks[i] != NULL) {
+            void* ptr = cache->largeChunks[i];
+            cache->largeChunks[i] = *(void**)ptr;
+            ChunkHeader* chunk = (ChunkHeader*)(ptr - sizeof(ChunkHeader));
+            STAT_SUB(freeSpace, GET_SIZE(chunk));
+            releaseChunk(chunk);
+        }
+    }
+    __atomic_sub_fetch(&cachedChunkBytes, cache->largeCacheBytes, __ATOMIC_RELAXED);
+    cache->largeCacheBytes = 0;
+}
+
+// Gives the large chunks cached by the calling thread back to the bins.
+void flushThreadCache(void) {
+    releaseLargeChunks(&threadCache);
+}
+
+// Gives everything cached by an exiting thread back to the shared allocator.
+static void releaseThreadCache(void* value) {
+    ThreadCache* cache = (ThreadCache*)value;
+    LOCK_BACKEND();
+    releaseLargeChunks(cache);
+    UNLOCK_BACKEND();
+
+    SmallHeap* heap = cache->heap;
+    if (heap != NULL) {
+        // Chunks still in use keep their containers, which wait for another thread to adopt the heap.
+        collectRemoteFrees(heap);
+        releaseEmptyContainers(heap);
+        cache->heap = NULL;
+        LOCK_BACKEND();
+        heap->nextAbandoned = abandonedHeaps;
+        abandonedHeaps = heap;
+        UNLOCK_BACKEND();
+    }
+    // The counts stay in the histograms, which the next new thread takes over.
+    if (cache->latency != NULL) {
+        releaseLatencyHistogram(cache->latency);
+        cache->latency = NULL;
+    }
+    cache->registered = 0;
+}
+
+// Take the backend lock across fork, so the child never inherits it part way through a change
+// to the bins, regions or page map made by a thread that doesn't exist in the child. The profile lock
+// is taken too, and first, so a thread sampling or dumping the profile can't be caught holding it.
+static void lockBeforeFork(void) {
+    lockProfileBeforeFork();
+    LOCK_BACKEND();
+}
+
+static void unlockAfterFork(void) {
+    UNLOCK_BACKEND();
+    unlockProfileAfterFork();
+}
+
+// Registered when the library is loaded rather than on first use, as pthread_atfork may allocate.
+__attribute__((constructor))
+static void registerForkHandlers(void) {
+    pthread_atfork(lockBeforeFork, unlockAfterFork, unlockAfterFork);
+}
+
+static void createThreadCacheKey(void) {
+    pthread_key_create(&threadCacheKey, releaseThreadCache);
+}
+
+// Makes sure releaseThreadCache is called when the thread exits.
+static void registerThreadCache(void) {
+    if (!threadCache.registered) {
+        pthread_once(&threadCacheKeyOnce, createThreadCacheKey);
+        pthread_setspecific(threadCacheKey, &threadCache);
+        threadCache.registered = 1;
+    }
+}
+
+// Returns the latency histograms of the calling thread, claiming them on its first timed operation.
+LatencyHistogram* getThreadLatency(void) {
+    if (threadCache.latency == NULL) {
+        threadCache.latency = claimLatencyHistogram();
+        registerThreadCache();
+    }
+    return threadCache.latency;
+}
+
+// Returns the heap of the calling thread, or NULL if it has none.
+SmallHeap* peekThreadHeap(void) {
+    return threadCache.heap;
+}
+
+// Returns the heap of the calling thread, adopting an abandoned heap or creating one if it has none.
+SmallHeap* getThreadHeap(void) {
+    if (threadCache.heap != NULL) {
+        return threadCache.heap;
+    }
+    LOCK_BACKEND();
+    SmallHeap* heap = abandonedHeaps;
+    if (heap != NULL) {
+        abandonedHeaps = heap->nextAbandoned;
+    }
+    UNLOCK_BACKEND();
+    if (heap == NULL) {
+        // Heaps are never unmapped, so other threads can always push onto their remote stacks.
+        heap = (SmallHeap*)mmap(0, sizeof(SmallHeap), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (heap == MAP_FAILED) {
+            perror("Error creating thread heap");
+            return NULL;
+        }
+        COUNT_METADATA_MMAP(sizeof(SmallHeap));
+    }
+    heap->nextAbandoned = NULL;
+    threadCache.heap = heap;
+    registerThreadCache();
+    return heap;
+}
+
+// Returns a cached chunk of exactly the given size, or NULL if there isn't one.
+ChunkHeader* takeCachedChunk(Word size) {
+    if (size > LARGE_CACHE_LIMIT) {
+        return NULL;
+    }
+    void** stack = &threadCache.largeChunks[size / LARGEST_ALIGNMENT];
+    void* ptr = *stack;
+    if (ptr == NULL) {
+        return NULL;
+    }
+    *stack = *(void**)ptr;
+    ChunkHeader* chunk = (ChunkHeader*)(ptr - sizeof(ChunkHeader));
+    threadCache.largeCacheBytes -= GET_SIZE(chunk);
+    __atomic_sub_fetch(&cachedChunkBytes, GET_SIZE(chunk), __ATOMIC_RELAXED);
+    STAT_SUB(freeSpace, GET_SIZE(chunk));
+    return chunk;
+}
+
+// Keeps an allocated large chunk for reuse by the calling thread.
+// Returns 0 if the chunk is too big or the cache is full.
+int cacheChunk(ChunkHeader* chunk) {
+    Word size = GET_SIZE(chunk);
+    if (size > LARGE_CACHE_LIMIT || threadCache.largeCacheBytes + size > LARGE_CACHE_BYTES) {
+        return 0;
+    }
+    // The caches of all threads share a limit as well, so many threads can't hold on to much memory.
+    if (__atomic_add_fetch(&cachedChunkBytes, size, __ATOMIC_RELAXED) > LARGE_CACHE_TOTAL_BYTES) {
+        __atomic_sub_fetch(&cachedChunkBytes, size, __ATOMIC_RELAXED);
+        return 0;
+    }
+    registerThreadCache();
+    void* ptr = (void*)chunk + sizeof(ChunkHeader);
+    void** stack = &threadCache.largeChunks[size / LARGEST_ALIGNMENT];
+    *(void**)ptr = *stack;
+    *stack = ptr;
+    threadCache.largeCacheBytes += size;
+    STAT_ADD(freeSpace, size);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef VMEMALLOC_THREAD_GUARD
+#define VMEMALLOC_THREAD_GUARD
+
+// In the thread-safe build (VMEM_THREAD_SAFE), each thread allocates small chunks from its own heap
+// and keeps a cache of recently freed large chunks. The large allocator's bins and regions and the
+// page map are shared, and are protected by the backend lock.
+// Threads read the headers of their own allocated large chunks without the lock. The backend may
+// change the PREVIOUS_CHUNK_FREE bit of such a header at the same time, but never its size.
+
+#ifdef VMEM_THREAD_SAFE
+#include <pthread.h>
+
+extern pthread_mutex_t backendLock;
+#define LOCK_BACKEND() pthread_mutex_lock(&backendLock)
+#define UNLOCK_BACKEND() pthread_mutex_unlock(&backendLock)
+
+// Large chunks up to this size are cached by the thread that frees them.
+#define LARGE_CACHE_LIMIT 2048
+// Cached chunks are grouped by size, and chunk sizes are multiples of LARGEST_ALIGNMENT (plus ALIGNMENT_OFFSET).
+#define LARGE_CACHE_CLASSES (LARGE_CACHE_LIMIT / LARGEST_ALIGNMENT + 1)
+// Maximum space used by the cached large chunks of a thread, and of all threads together.
+#define LARGE_CACHE_BYTES (256 * 1024)
+#define LARGE_CACHE_TOTAL_BYTES (4 * 1024 * 1024)
+
+// Returns the heap of the calling thread, adopting an abandoned heap or creating one if it has none.
+extern SmallHeap* getThreadHeap(void);
+
+// Returns the heap of the calling thread, or NULL if it has none.
+extern SmallHeap* peekThreadHeap(void);
+
+// Returns a cached chunk of exactly the given size, or NULL if there isn't one.
+extern ChunkHeader* takeCachedChunk(Word size);
+
+// Keeps an allocated large chunk for reuse by the calling thread.
+// Returns 0 if the chunk is too big or the cache is full.
+extern int cacheChunk(ChunkHeader* chunk);
+
+// Gives the large chunks cached by the calling thread back to the bins. The caller must hold the
+// backend lock.
+extern void flushThreadCache(void);
+
+#else
+
+#define LOCK_BACKEND()
+#define UNLOCK_BACKEND()
+
+// The only heap, used by the whole program.
+extern SmallHeap mainHeap;
+#define getThreadHeap() (&mainHeap)
+#define peekThreadHeap() (&mainHeap)
+#define flushThreadCache() ((void)0)
+
+#endif
+
+#endif
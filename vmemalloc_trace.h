@@ -0,0 +1,68 @@
+#ifndef VMEMALLOC_TRACE_GUARD
+#define VMEMALLOC_TRACE_GUARD
+
+#include <stdint.h>
+
+// Layout of a binary trace file. The file is a header followed by a ring of fixed-size records,
+// mapped into memory while the program runs, so recording an operation is a few stores.
+// Once the ring is full the oldest records are overwritten. vmem_trace2csv converts a trace to CSV.
+
+// "VMEMTRC" in ASCII, when read as a little endian word.
+#define TRACE_MAGIC 0x004352544d454d56ULL
+#define TRACE_VERSION 1
+
+// Number of records kept by default. The file is sparse, so only the records written use disk space.
+#define DEFAULT_TRACE_RECORDS (1 << 20)
+
+// Operations that are traced.
+typedef enum TraceOp {
+    TRACE_ALLOC,
+    TRACE_FREE,
+    TRACE_REALLOC,
+    TRACE_CALLOC,
+    TRACE_ALIGN,
+    // A record claimed before an operation that then failed, which vmem_replay skips.
+    TRACE_FAILED,
+    TRACE_OP_COUNT
+} TraceOp;
+
+typedef struct TraceFileHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    // Number of records in the ring - always a power of two.
+    uint64_t capacity;
+    // Number of records ever written. The newest is at (nextRecord - 1) % capacity.
+    uint64_t nextRecord;
+    // Timestamps in ticks and in nanoseconds at the start and at the latest checkpoint, used to
+    // convert ticks to time. Ticks are the time stamp counter on x86, or nanoseconds elsewhere.
+    uint64_t startTicks;
+    int64_t startNanos;
+    uint64_t endTicks;
+    int64_t endNanos;
+} TraceFileHeader;
+
+typedef struct TraceRecord {
+    uint64_t ticks;
+    // The chunk returned by an allocation, or the chunk freed.
+    uint64_t ptr;
+    // The old chunk for TRACE_REALLOC, or the alignment for TRACE_ALIGN.
+    uint64_t arg;
+    // The size requested, or the size of the chunk freed.
+    uint64_t size;
+    // Small number identifying the thread, in order of each thread's first traced operation.
+    uint32_t thread;
+    uint8_t op;
+    // The kind of page holding the chunk (PAGE_CONTAINER, PAGE_LARGE or PAGE_HUGE).
+    uint8_t kind;
+    // The small bin of a container chunk, or the bin * NUM_SUB_BINS + sub-bin of a large chunk.
+    int16_t bin;
+    // Statistics after the operation.
+    int64_t allocatedSpace;
+    int64_t allocatedChunkCount;
+    int64_t freeSpace;
+    int64_t freeChunkCount;
+    int64_t regionsUsed;
+} TraceRecord;
+
+#endif